@@ -11,10 +11,11 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 */
 
 /* Usage:
-    The wrapper generater is a simple interpreter. It does not
-    run or emulate a preprocessor. It has a very rudimentary
-    understanding of C grammar. For greatest success, keep your
-    kernel definitions as simple as possible.
+    The wrapper generater is a simple interpreter. It runs a
+    minimal preprocessor (#include, #if and friends, #define for
+    the sake of #if), then has a very rudimentary understanding of
+    C grammar. For greatest success, keep your kernel definitions
+    as simple as possible.
 
     1) Use the "kernel" or "__kernel" keywords. DO NOT
          use a substitute, e.g. #define KERNEL kernel
@@ -25,11 +26,23 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
            kernel MYDEFINE void MYDEFINE myKernelName(...){...}
          This, however, IS OK:
            kernel MYVOIDDEFINE myKernelName(...){...}
-    3) All #includes are expanded, even within comments.
+    3) #includes are expanded, except within comments and code that
+       #if rules out. Files with #pragma once or an include guard are
+       expanded once, or once on each path through undecided #ifs;
+       their kernels are wrapped once. #line markers keep build errors
+       pointing at the original files.
     4) All kernels encountered while processing #includes are also wrapped
-    5) The wrapper generator ignores preprocessor directives.
-         E.g. kernels and #includes within #if...#endif are interpreted
-         hence it's easier to encounter infinite recursive #includes
+    5) #if conditions are evaluated with macros from -D and -U, and from
+       #define and #undef seen before them. Conditions on other macros,
+       e.g. those the OpenCL compiler defines, are left in the source
+       with all their branches, whose kernels are wrapped too.
+       Macros not given to -D at generation time but defined at build
+       time, e.g. by build options, count as unknown unless -U is used.
+    6) Mark global pointer parameters that take shared virtual memory
+       (from cluSVMAlloc) with CLU_SVM, e.g. global CLU_SVM Node* nodes.
+       The wrapper takes a void* and calls clSetKernelArgSVMPointer.
+       The generated program defines CLU_SVM as nothing.
+       -svm treats every global pointer parameter this way. C mode only.
 */
 #define _CRT_SECURE_NO_WARNINGS
 
@@ -41,6 +54,17 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <set>
+#include <chrono>
+#include <ctype.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "string.h"
 
@@ -51,6 +75,7 @@ struct ParamPair
     string m_type;
     string m_name;
     bool   m_isLocal;
+    bool   m_isSVM;
 };
 typedef vector<ParamPair> ParamPairArray;
 struct KernelStrings
@@ -67,6 +92,8 @@ typedef list<string>          StringList;
 
 #define CLU_MAGIC_BUILD_FLAG "CLU_GENERATED_BUILD" // matching #define in clu_runtime.cpp
 
+#define CLU_SVM_MARKER "CLU_SVM" // marks SVM pointer parameters
+
 // arbitrary maximum recursion depth for #includes
 // prevents infinite loops
 const int MAX_RECURSION_DEPTH = 256;
@@ -75,6 +102,9 @@ bool g_verbose = true;
 bool g_lineNumbers = true;
 int  g_lineNumber = 1;
 bool g_generateCPP = false;
+bool g_svm = false; // every global pointer parameter is an SVM pointer
+bool g_svmMarkerUsed = false; // some parameter is marked CLU_SVM
+bool g_timing = false; // report the time each stage takes
 
 //------------------------------------------------------------------------
 // Error routine -- called to exit generator semi-gracefully
@@ -85,6 +115,149 @@ void ReturnError(const string& in_errString)
     exit(-1);
 }
 
+//------------------------------------------------------------------------
+// characters of a string owned elsewhere, e.g. a mapped file. nothing is copied
+//------------------------------------------------------------------------
+struct StringRef
+{
+    const char* m_data;
+    size_t      m_size;
+
+    StringRef() : m_data(""), m_size(0) {}
+    StringRef(const char* in_data, size_t in_size) : m_data(in_data), m_size(in_size) {}
+    StringRef(const char* in_str) : m_data(in_str), m_size(strlen(in_str)) {}
+    StringRef(const string& in_str) : m_data(in_str.data()), m_size(in_str.size()) {}
+
+    const char* begin() const {return m_data;}
+    const char* end() const   {return m_data + m_size;}
+};
+
+//------------------------------------------------------------------------
+// character classes shared by the scanners, looked up instead of compared
+//------------------------------------------------------------------------
+enum
+{
+    CHAR_BLANK    = 1, // ' ', '\t', '\r': skipped before a directive
+    CHAR_LEXICAL  = 2, // '/', '"', '\'': may start a comment or a literal
+    CHAR_SIMPLIFY = 4, // '/', '{': may start a comment or a body, see CopySimplify
+    CHAR_ESCAPE   = 8, // '"', '\\': escaped in stringified source
+    CHAR_IDENT    = 16 // letters, digits and '_'
+};
+
+class CharClassTable
+{
+public:
+    CharClassTable()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            m_classes[c] = (0 != isalnum(c)) ? CHAR_IDENT : 0;
+        }
+        m_classes[(unsigned char)'_']  |= CHAR_IDENT;
+        m_classes[(unsigned char)' ']  |= CHAR_BLANK;
+        m_classes[(unsigned char)'\t'] |= CHAR_BLANK;
+        m_classes[(unsigned char)'\r'] |= CHAR_BLANK;
+        m_classes[(unsigned char)'/']  |= CHAR_LEXICAL | CHAR_SIMPLIFY;
+        m_classes[(unsigned char)'"']  |= CHAR_LEXICAL | CHAR_ESCAPE;
+        m_classes[(unsigned char)'\''] |= CHAR_LEXICAL;
+        m_classes[(unsigned char)'{']  |= CHAR_SIMPLIFY;
+        m_classes[(unsigned char)'\\'] |= CHAR_ESCAPE;
+    }
+    bool Is(char in_c, int in_classes) const {return 0 != (m_classes[(unsigned char)in_c] & in_classes);}
+private:
+    unsigned char m_classes[256];
+};
+const CharClassTable g_charClasses;
+
+//------------------------------------------------------------------------
+// step io_pos over the next line as std::getline would: out_line excludes the
+// '\n', and there is no empty line after a final '\n'. false at the end
+//------------------------------------------------------------------------
+bool NextLine(const char*& io_pos, const char* in_end, StringRef& out_line)
+{
+    if (io_pos >= in_end)
+    {
+        return false;
+    }
+    const char* newline = (const char*)memchr(io_pos, '\n', in_end - io_pos);
+    const char* lineEnd = newline ? newline : in_end;
+    out_line = StringRef(io_pos, lineEnd - io_pos);
+    io_pos = newline ? newline + 1 : in_end;
+    return true;
+}
+
+//------------------------------------------------------------------------
+// read-only view of a whole file. mapped where mmap is available, so large
+// kernel libraries are scanned in place; otherwise read into memory
+//------------------------------------------------------------------------
+class MappedFile
+{
+public:
+    MappedFile() : m_mapping(0), m_size(0) {}
+    ~MappedFile() {Close();}
+
+    bool Open(const string& in_fileName);
+    StringRef Contents() const {return m_mapping ? StringRef(m_mapping, m_size) : StringRef(m_copy);}
+
+private:
+    MappedFile(const MappedFile&);            // not copyable: the mapping is released once
+    MappedFile& operator=(const MappedFile&);
+    void Close();
+
+    const char* m_mapping;
+    size_t      m_size;
+    string      m_copy; // contents when not mapped
+};
+
+bool MappedFile::Open(const string& in_fileName)
+{
+    Close();
+#ifdef __linux__
+    int fd = open(in_fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if ((0 == fstat(fd, &fileStat)) && S_ISREG(fileStat.st_mode) && (fileStat.st_size > 0))
+    {
+        void* p = mmap(0, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != p)
+        {
+            madvise(p, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+            m_mapping = (const char*)p;
+            m_size = (size_t)fileStat.st_size;
+        }
+    }
+    close(fd); // the mapping keeps the file open
+    if (m_mapping)
+    {
+        return true;
+    }
+#endif
+    // no mmap, or nothing to map: read the file
+    ifstream file(in_fileName.c_str());
+    if (!file.good())
+    {
+        return false;
+    }
+    m_copy.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef __linux__
+    if (m_mapping)
+    {
+        munmap((void*)m_mapping, m_size);
+    }
+#endif
+    m_mapping = 0;
+    m_size = 0;
+    m_copy.clear();
+}
+
 //------------------------------------------------------------------------
 // simple tokenizer class that does not modify the input strings.
 // step along tokens with NextToken, which returns TOKEN_END if no more tokens
@@ -94,28 +267,27 @@ class Tokenizer
 {
 private:
     const string &m_string;
-    const string &m_delimiters;
+    bool m_isDelimiter[256]; // indexed by unsigned char
     int m_index; // current position in source string
     int m_start; // start of current token
     int m_end;   // end of current token
 
-    bool IsDelimiter(const char c)
+    bool IsDelimiter(const char c) const
     {
-        bool found = false;
-        for (unsigned int i = 0; i < m_delimiters.size(); i++)
-        {
-            if (c == m_delimiters[i])
-            {
-                found = true;
-                break;
-            }
-        }
-        return found;
+        return m_isDelimiter[(unsigned char)c];
     }
     Tokenizer& operator = (const Tokenizer&) {return *this;} // unused, removes compile warning
 public:
     Tokenizer(const string& in_string, const string& in_delimiters)
-        : m_string(in_string), m_delimiters(in_delimiters) {m_index = 0;}
+        : m_string(in_string)
+    {
+        m_index = 0;
+        memset(m_isDelimiter, 0, sizeof(m_isDelimiter));
+        for (size_t i = 0; i < in_delimiters.size(); i++)
+        {
+            m_isDelimiter[(unsigned char)in_delimiters[i]] = true;
+        }
+    }
 
     enum
     {
@@ -153,6 +325,14 @@ public:
         out_string = m_string.substr(m_start, m_end-m_start);
     }
 
+    // compares the current token without copying it
+    bool TokenIs(const char* in_token) const
+    {
+        size_t size = strlen(in_token);
+        return (TOKEN_END != m_start) && ((size_t)(m_end - m_start) == size) &&
+            (0 == m_string.compare(m_start, size, in_token));
+    }
+
     // Jump over a sequence of tokens starting with the specified token and
     // ending with the specified delimiter.
     // Particularly useful to skip the '__attribute__' sequence in the kernel declaration.
@@ -162,10 +342,7 @@ public:
 
         NextToken();
 
-        string localToken;
-        GetToken(localToken);
-
-        if (token.compare(localToken) == 0)
+        if (TokenIs(token.c_str()))
         {
             m_index = m_string.find(delimiter, m_index);
 
@@ -226,6 +403,7 @@ void GetParamTokens(const string& param, vector<string>& paramTokens)
 //    global int* foo    -> cl_mem foo or cl::Buffer & foo in C++ mode
 //    local double * foo -> int foo
 //    float foo          -> float foo
+//    global CLU_SVM int* foo -> void* foo
 // Returns the index into the source string after the parameters
 //------------------------------------------------------------------------
 int GetParameterString(const string& in_src, int in_srcIndex,
@@ -269,10 +447,13 @@ int GetParameterString(const string& in_src, int in_srcIndex,
         {
             PARAM_LOCAL,
             PARAM_GLOBAL,
+            PARAM_SVM,
             PARAM_SAMPLER,
             PARAM_DEFAULT
         };
         eParamType paramType = PARAM_DEFAULT;
+        bool svmMarker = (paramTokens.begin() + numTokens != find(paramTokens.begin(), paramTokens.begin() + numTokens, CLU_SVM_MARKER));
+        bool isPointer = (string::npos != param.find('*'));
         // loop over the tokens that describe the type of the parameter
         for (int i = 0; i < (numTokens); i++)
         {
@@ -281,6 +462,11 @@ int GetParameterString(const string& in_src, int in_srcIndex,
                 paramType = PARAM_LOCAL;
                 break;
             }
+            if ((("global" == paramTokens[i]) || ("__global" == paramTokens[i])) && isPointer && (svmMarker || g_svm))
+            {
+                paramType = PARAM_SVM;
+                break;
+            }
             if (("global" == paramTokens[i]) || ("__global" == paramTokens[i]) ||
                 ("constant" == paramTokens[i]) || ("__constant" == paramTokens[i]) ||
                 ("image1d_t" == paramTokens[i]) ||
@@ -304,6 +490,19 @@ int GetParameterString(const string& in_src, int in_srcIndex,
         int size = out_params.size();
         out_params.resize(size+1);
         out_params[size].m_isLocal = false;
+        out_params[size].m_isSVM = false;
+        if (svmMarker)
+        {
+            if (PARAM_SVM != paramType)
+            {
+                ReturnError(CLU_SVM_MARKER " must mark a global pointer parameter: " + param);
+            }
+            g_svmMarkerUsed = true;
+        }
+        if ((PARAM_SVM == paramType) && g_generateCPP)
+        {
+            ReturnError("SVM pointer parameters are only supported in C mode: " + param);
+        }
         switch (paramType)
         {
         case PARAM_LOCAL:
@@ -317,6 +516,10 @@ int GetParameterString(const string& in_src, int in_srcIndex,
                 out_params[size].m_type = "cl_mem";
             }
             break;
+        case PARAM_SVM:
+            out_params[size].m_type = "void*";
+            out_params[size].m_isSVM = true;
+            break;
         case PARAM_SAMPLER:
             out_params[size].m_type = "cl_sampler";
             break;
@@ -365,10 +568,23 @@ int GetParameterString(const string& in_src, int in_srcIndex,
 void CopySimplify(string& out_src, const string& in_src)
 {
     int size = in_src.size();
+    out_src.reserve(out_src.size() + size);
     // remove potentially confusing code: comments and function bodies
     // we only care about kernel definitions
     for (int i = 0; i < (size-1); i++)
     {
+        // copy up to the next character that may start a comment or a body in one go
+        int run = i;
+        while ((i < (size-1)) && !g_charClasses.Is(in_src[i], CHAR_SIMPLIFY))
+        {
+            i++;
+        }
+        out_src.append(in_src, run, i - run);
+        if (i >= (size-1))
+        {
+            break;
+        }
+
         // remove comments
         if ('/' == in_src[i]) // may be "//" or "/*"
         {
@@ -430,21 +646,29 @@ void CopySimplify(string& out_src, const string& in_src)
 
 //------------------------------------------------------------------------
 // Find all the kernels, plus their parameter names and types
+// a kernel is listed once, by its first definition: the source may contain
+// it more than once, e.g. a header with #pragma once or an include guard that
+// is expanded under an undecided #if and again after it. the device compiler
+// sees one of them, and one wrapper is all the header may define
 //------------------------------------------------------------------------
 void FindKernels(const string& src, KernelList& out_kernels)
 {
     const string kernelDelimiters(" ,()\n\r\t");
 
+    set<string> names;
+    for (KernelList::const_iterator i = out_kernels.begin(); i != out_kernels.end(); i++)
+    {
+        names.insert(i->m_kernelName);
+    }
+
     // find the kernel names and parameters
     Tokenizer tokenizer(src, kernelDelimiters);
 
     int srcIndex;
     while (Tokenizer::TOKEN_END != (srcIndex = tokenizer.NextToken()))
     {
-        string token;
-        tokenizer.GetToken(token);
         // must be of form "kernel SOMETHING myKernelName(...."
-        if (("kernel" == token) || ("__kernel" == token))
+        if (tokenizer.TokenIs("kernel") || tokenizer.TokenIs("__kernel"))
         {
             // structure to be returned containing kernel name & parameters
             KernelStrings kernelStrings;
@@ -481,8 +705,11 @@ void FindKernels(const string& src, KernelList& out_kernels)
 
             // get kernel name
             tokenizer.GetToken(kernelStrings.m_kernelName);
-            // add kernel name to list
-            out_kernels.push_back(kernelStrings);
+            // add kernel name to list, unless an earlier copy of the kernel is there
+            if (names.insert(kernelStrings.m_kernelName).second)
+            {
+                out_kernels.push_back(kernelStrings);
+            }
             // scoot tokenizer forward past the parameters (we got this index from GetParameterString)
             tokenizer.SetStartIndex(index);
         }
@@ -491,86 +718,921 @@ void FindKernels(const string& src, KernelList& out_kernels)
 
 
 //------------------------------------------------------------------------
-// recursively search for and include #includes
+// preprocessor front end: expands #includes and resolves what it can of
+// #if, #ifdef, #ifndef, #elif, #else and #endif before the source is embedded.
+// conditions are tri-state. a macro is known to be defined or undefined only
+// after -D, -U, or a #define or #undef the preprocessor has seen on every path.
+// conditions it cannot decide, e.g. on macros the OpenCL compiler predefines,
+// are kept with their branches for the device compiler to resolve.
+// files with #pragma once or an include guard are expanded once.
+// #line markers keep build errors pointing at the original files and lines.
 //------------------------------------------------------------------------
-void FindIncludes(string& out_src, stringstream& in_is, const StringList& in_includePaths)
+class Preprocessor
 {
-    static int recursionDepth = 0;
+public:
+    Preprocessor(const StringList& in_includePaths) : m_includePaths(in_includePaths), m_depth(0), m_numOnce(0) {}
+
+    void Define(const string& in_name, const string& in_value);
+    void Undefine(const string& in_name);
+
+    // preprocess the main source, including the #defines from Define()
+    void Process(const string& in_fileName, StringRef in_src, string& out_src);
+
+private:
+    enum State // of a condition, or of a region of source
+    {
+        STATE_FALSE,   // dead: dropped
+        STATE_UNKNOWN, // kept, with the directives that select it
+        STATE_TRUE     // live: kept, directives dropped
+    };
+
+    struct Macro
+    {
+        bool   m_defined;
+        bool   m_functionLike;
+        string m_value;
+    };
+    typedef map<string, Macro> MacroMap; // absent = unknown
 
-    recursionDepth++;
-    if (recursionDepth > MAX_RECURSION_DEPTH)
+    struct Conditional
+    {
+        State  m_enclosing;  // region the #if is in
+        State  m_taken;      // some earlier branch was taken: FALSE no, UNKNOWN maybe, TRUE yes
+        State  m_branch;     // region of the current branch
+        bool   m_emitted;    // the #if was kept in the output, so its #endif must be
+        bool   m_firstBranch;
+        string m_notDefined; // X of #ifndef X or #if !defined(X), else empty
+    };
+
+    struct Value // of a #if expression
+    {
+        bool      m_known;
+        long long m_value;
+    };
+
+    void   ProcessFile(const string& in_fileName, StringRef in_src, State in_region, string& out_src);
+    void   Include(const string& in_directive, const string& in_fileName, State in_region, string& out_src);
+    bool   FindFile(const string& in_name, bool in_quoted, const string& in_fromFile, string& out_path, MappedFile& out_file);
+    void   DefineDirective(const string& in_args, State in_region, const vector<Conditional>& in_stack);
+    State  Evaluate(const string& in_expression);
+    void   Expand(const string& in_expression, vector<string>& out_tokens, int in_depth);
+    Value  Parse(const vector<string>& in_tokens, size_t& io_pos, int in_precedence);
+    Value  ParseUnary(const vector<string>& in_tokens, size_t& io_pos);
+    void   Emit(StringRef in_text, int in_firstLine, int in_numLines, bool in_inComment,
+                const string& in_fileName, int& io_nextLine, string& out_src);
+
+    const StringList&   m_includePaths;
+    MacroMap            m_macros;
+    map<string, string> m_fileGuards; // file path -> macro that, when defined, makes the file expand to nothing
+    int                 m_depth;      // of #includes
+    int                 m_numOnce;    // files with #pragma once, for their guard macros
+    string              m_defines;    // from Define(), written ahead of the main source
+};
+
+// tokens of #if expressions
+#define PP_UNKNOWN "?unknown"
+const char* const PP_BINARY_OPERATORS[] = // by increasing precedence, one level per entry
+    {"||", "&&", "|", "^", "&", "== !=", "< > <= >=", "<< >>", "+ -", "* / %"};
+const int PP_NUM_BINARY_LEVELS = sizeof(PP_BINARY_OPERATORS) / sizeof(PP_BINARY_OPERATORS[0]);
+
+//------------------------------------------------------------------------
+// remove comments from a line, carrying the state of /* */ across lines
+//------------------------------------------------------------------------
+string StripComments(StringRef in_line, bool& io_inComment)
+{
+    string out;
+    out.reserve(in_line.m_size);
+    char quote = 0;
+    for (size_t i = 0; i < in_line.m_size; i++)
+    {
+        char c = in_line.m_data[i];
+        char next = (i + 1 < in_line.m_size) ? in_line.m_data[i+1] : 0;
+        if (io_inComment)
+        {
+            if (('*' == c) && ('/' == next))
+            {
+                io_inComment = false;
+                out += ' ';
+                i++;
+            }
+        }
+        else if (quote)
+        {
+            out += c;
+            if ('\\' == c)
+            {
+                if (next) out += next;
+                i++;
+            }
+            else if (quote == c)
+            {
+                quote = 0;
+            }
+        }
+        else if (('/' == c) && ('/' == next))
+        {
+            break;
+        }
+        else if (('/' == c) && ('*' == next))
+        {
+            io_inComment = true;
+            i++;
+        }
+        else
+        {
+            if (('"' == c) || ('\'' == c)) quote = c;
+            out += c;
+        }
+    }
+    return out;
+}
+
+//------------------------------------------------------------------------
+// what StripComments would leave of a line, found without copying it.
+// carries the state of /* */ across lines the same way
+//------------------------------------------------------------------------
+enum LineKind
+{
+    LINE_BLANK,     // nothing but blanks and comments
+    LINE_DIRECTIVE, // the first significant character is #
+    LINE_CODE
+};
+
+LineKind ScanLine(StringRef in_line, bool& io_inComment)
+{
+    LineKind kind = LINE_BLANK;
+    const char* p = in_line.begin();
+    const char* const end = in_line.end();
+    while (p < end)
+    {
+        if (io_inComment)
+        {
+            while ((p < end) && !(('*' == p[0]) && (p + 1 < end) && ('/' == p[1]))) p++;
+            if (p == end) break;
+            io_inComment = false;
+            p += 2;
+            continue;
+        }
+        if (LINE_BLANK != kind)
+        {
+            // only comments and literals matter now
+            while ((p < end) && !g_charClasses.Is(*p, CHAR_LEXICAL)) p++;
+            if (p == end) break;
+        }
+        char c = *p;
+        char next = (p + 1 < end) ? p[1] : 0;
+        if (('/' == c) && ('/' == next))
+        {
+            break;
+        }
+        if (('/' == c) && ('*' == next))
+        {
+            io_inComment = true;
+            p += 2;
+            continue;
+        }
+        if ((LINE_BLANK == kind) && !g_charClasses.Is(c, CHAR_BLANK))
+        {
+            kind = ('#' == c) ? LINE_DIRECTIVE : LINE_CODE;
+        }
+        if (('"' == c) || ('\'' == c))
+        {
+            // skip the literal. an unterminated one ends with the line
+            for (p++; (p < end) && (c != *p); p++)
+            {
+                if (('\\' == *p) && (p + 1 < end)) p++;
+            }
+        }
+        p++;
+    }
+    return kind;
+}
+
+bool IsIdentifierChar(char c)
+{
+    return g_charClasses.Is(c, CHAR_IDENT);
+}
+
+// the identifier at io_pos, which is moved past it. empty if there is none
+string ReadIdentifier(const string& in_str, size_t& io_pos)
+{
+    while ((io_pos < in_str.size()) && isspace((unsigned char)in_str[io_pos])) io_pos++;
+    size_t start = io_pos;
+    if ((io_pos < in_str.size()) && !isdigit((unsigned char)in_str[io_pos]))
+    {
+        while ((io_pos < in_str.size()) && IsIdentifierChar(in_str[io_pos])) io_pos++;
+    }
+    return in_str.substr(start, io_pos - start);
+}
+
+string Trim(const string& in_str)
+{
+    size_t start = in_str.find_first_not_of(" \t\r\n");
+    if (string::npos == start) return string();
+    size_t end = in_str.find_last_not_of(" \t\r\n");
+    return in_str.substr(start, end - start + 1);
+}
+
+void Preprocessor::Define(const string& in_name, const string& in_value)
+{
+    Macro macro = {true, false, in_value};
+    m_macros[in_name] = macro;
+    m_defines += "#define " + in_name + " " + in_value + "\n";
+}
+
+void Preprocessor::Undefine(const string& in_name)
+{
+    Macro macro = {false, false, ""};
+    m_macros[in_name] = macro;
+}
+
+void Preprocessor::Process(const string& in_fileName, StringRef in_src, string& out_src)
+{
+    out_src.reserve(out_src.size() + m_defines.size() + in_src.m_size + in_src.m_size / 8);
+    out_src += m_defines;
+    ProcessFile(in_fileName, in_src, STATE_TRUE, out_src);
+}
+
+//------------------------------------------------------------------------
+// append lines, preceded by a #line marker if lines before them were dropped.
+// in_text has no final newline, Emit adds it
+// io_nextLine is the line the device compiler will number the next line, 0 = unknown
+//------------------------------------------------------------------------
+void Preprocessor::Emit(StringRef in_text, int in_firstLine, int in_numLines, bool in_inComment,
+    const string& in_fileName, int& io_nextLine, string& out_src)
+{
+    if (io_nextLine != in_firstLine)
+    {
+        if (in_inComment)
+        {
+            io_nextLine = 0; // a marker here would be commented out, try again on the next line
+            out_src.append(in_text.m_data, in_text.m_size);
+            out_src += '\n';
+            return;
+        }
+        string name = in_fileName;
+        replace(name.begin(), name.end(), '\\', '/');
+        stringstream marker;
+        marker << "#line " << in_firstLine << " \"" << name << "\"\n";
+        out_src += marker.str();
+    }
+    out_src.append(in_text.m_data, in_text.m_size);
+    out_src += '\n';
+    io_nextLine = in_firstLine + in_numLines;
+}
+
+//------------------------------------------------------------------------
+// preprocess one file. in_region is the state of the #include that named it
+//------------------------------------------------------------------------
+void Preprocessor::ProcessFile(const string& in_fileName, StringRef in_src, State in_region, string& out_src)
+{
+    m_depth++;
+    if (m_depth > MAX_RECURSION_DEPTH)
     {
         string error = "Reached max #include recursion depth";
         ReturnError(error);
     }
-    string tmp;
-    while( std::getline(in_is, tmp) )
+
+    vector<Conditional> stack;
+    State region = in_region;
+    bool inComment = false;
+    int nextLine = 0;        // see Emit
+    bool pragmaOnce = false;
+    string guard;            // include guard: #ifndef X around everything else in the file
+    enum {GUARD_NONE, GUARD_OPEN, GUARD_CLOSED, GUARD_INVALID} guardState = GUARD_NONE;
+    string body;
+    body.reserve(in_src.m_size + in_src.m_size / 8);
+
+    // lines are views into in_src: only directives are copied
+    const char* cursor = in_src.begin();
+    StringRef line;
+    int lineNumber = 0;
+    while (NextLine(cursor, in_src.end(), line))
     {
-        if (string::npos != tmp.find("#include"))
+        if ((line.m_size > 0) && ('\r' == line.m_data[line.m_size-1])) line.m_size--;
+        lineNumber++;
+        int firstLine = lineNumber;
+        bool startsInComment = inComment;
+
+        LineKind kind = ScanLine(line, inComment);
+        if (LINE_DIRECTIVE != kind)
         {
-            string::size_type start = tmp.find_first_of('"');
-            string::size_type end = tmp.find_last_of('"');
-            if (string::npos == start)
+            // not significant if blank, or only a comment
+            if ((LINE_CODE == kind) && (GUARD_OPEN != guardState))
+            {
+                guardState = GUARD_INVALID;
+            }
+            if (STATE_FALSE != region)
             {
-                start = tmp.find_first_of('<');
-                end = tmp.find_last_of('>');
+                Emit(line, firstLine, 1, startsInComment, in_fileName, nextLine, body);
             }
-            if (string::npos == start) // neither "" nor <>
+            continue;
+        }
+        inComment = startsInComment;
+        string code = StripComments(line, inComment);
+        string text(line.m_data, line.m_size);
+        size_t hash = code.find_first_not_of(" \t\r");
+
+        // join continued lines
+        while ((code.size() > 0) && ('\\' == code[code.size()-1]) && NextLine(cursor, in_src.end(), line))
+        {
+            if ((line.m_size > 0) && ('\r' == line.m_data[line.m_size-1])) line.m_size--;
+            lineNumber++;
+            code.erase(code.size()-1);
+            code += StripComments(line, inComment);
+            text += '\n';
+            text.append(line.m_data, line.m_size);
+        }
+        size_t pos = hash + 1;
+        string directive = ReadIdentifier(code, pos);
+        string args = Trim(code.substr(pos));
+
+        // include guard: the first significant line is #ifndef X, its #endif the last
+        bool isIf = ("if" == directive) || ("ifdef" == directive) || ("ifndef" == directive);
+        if (GUARD_NONE == guardState)
+        {
+            guardState = GUARD_INVALID;
+            if ("ifndef" == directive)
             {
-                string error = "Could not interpret include directive:\n" + tmp;
-                ReturnError(error);
+                size_t p = 0;
+                guard = ReadIdentifier(args, p);
+                guardState = guard.empty() ? GUARD_INVALID : GUARD_OPEN;
             }
-            string incName = tmp.substr(start+1,end-start-1);
+        }
+        else if ((GUARD_CLOSED == guardState) ||
+            ((GUARD_OPEN == guardState) && (1 == stack.size()) && (("elif" == directive) || ("else" == directive))))
+        {
+            guardState = GUARD_INVALID;
+        }
+        int numLines = lineNumber - firstLine + 1;
 
-            // search all include paths for the file
-            bool found = false;
-            for(StringList::const_iterator i = in_includePaths.begin(); i != in_includePaths.end(); i++)
+        bool keep = false; // copy the directive to the output as is
+        if (isIf)
+        {
+            Conditional c;
+            c.m_enclosing = region;
+            c.m_emitted = false;
+            c.m_firstBranch = true;
+            if ("if" == directive)
             {
-                string pathString = *i + incName.c_str();
-                const char* path = pathString.c_str();
-                ifstream incFile(path);
-                if (incFile.good())
+                // #if !defined(X) and #if !defined X
+                size_t p = 0;
+                while ((p < args.size()) && isspace((unsigned char)args[p])) p++;
+                if ((p < args.size()) && ('!' == args[p]))
                 {
-                    string src((std::istreambuf_iterator<char>(incFile)), std::istreambuf_iterator<char>());
-                    incFile.close();
-                    stringstream is;
-                    is << src;
-                    FindIncludes(out_src, is, in_includePaths);
-                    found = true;
-                    break;
+                    p++;
+                    if ("defined" == ReadIdentifier(args, p))
+                    {
+                        while ((p < args.size()) && (isspace((unsigned char)args[p]) || ('(' == args[p]))) p++;
+                        c.m_notDefined = ReadIdentifier(args, p);
+                        string rest = Trim(args.substr(p));
+                        if (!rest.empty() && (")" != rest)) c.m_notDefined.clear();
+                    }
                 }
             }
-            if (!found)
+            else if ("ifndef" == directive)
+            {
+                size_t p = 0;
+                c.m_notDefined = ReadIdentifier(args, p);
+            }
+            if (STATE_FALSE == region)
             {
-                string error("File could not be found for #include: ");
-                error += incName;
-                ReturnError(error);
+                c.m_taken = STATE_TRUE; // every branch is dead
+                c.m_branch = STATE_FALSE;
             }
-            out_src += "/* included " + incName + "*/\n";
+            else
+            {
+                State condition = STATE_UNKNOWN;
+                if ("if" == directive)
+                {
+                    condition = Evaluate(args);
+                }
+                else
+                {
+                    size_t p = 0;
+                    MacroMap::const_iterator macro = m_macros.find(ReadIdentifier(args, p));
+                    if (macro != m_macros.end())
+                    {
+                        condition = (macro->second.m_defined == ("ifdef" == directive)) ? STATE_TRUE : STATE_FALSE;
+                    }
+                }
+                c.m_taken = condition;
+                c.m_branch = min(region, condition);
+                c.m_emitted = keep = (STATE_UNKNOWN == condition);
+            }
+            stack.push_back(c);
+            region = c.m_branch;
+        }
+        else if (("elif" == directive) || ("else" == directive))
+        {
+            if (stack.empty())
+            {
+                ReturnError("#" + directive + " without #if in " + in_fileName);
+            }
+            Conditional& c = stack.back();
+            c.m_firstBranch = false;
+            if ((STATE_FALSE == c.m_enclosing) || (STATE_TRUE == c.m_taken))
+            {
+                c.m_branch = STATE_FALSE;
+            }
+            else
+            {
+                State condition = ("else" == directive) ? STATE_TRUE : Evaluate(args);
+                if (STATE_FALSE == c.m_taken) // every earlier branch is known to be dead
+                {
+                    c.m_taken = condition;
+                    c.m_branch = min(c.m_enclosing, condition);
+                    if (STATE_UNKNOWN == condition)
+                    {
+                        Emit("#if " + args, firstLine, 1, startsInComment, in_fileName, nextLine, body);
+                        c.m_emitted = true;
+                    }
+                }
+                else if (STATE_FALSE == condition) // an earlier branch may be taken, this one is not
+                {
+                    c.m_branch = STATE_FALSE;
+                }
+                else
+                {
+                    if (STATE_TRUE == condition)
+                    {
+                        Emit("#else", firstLine, 1, startsInComment, in_fileName, nextLine, body);
+                    }
+                    else
+                    {
+                        Emit(text, firstLine, numLines, startsInComment, in_fileName, nextLine, body);
+                    }
+                    c.m_taken = condition;
+                    c.m_branch = min(c.m_enclosing, STATE_UNKNOWN);
+                }
+            }
+            region = c.m_branch;
+        }
+        else if ("endif" == directive)
+        {
+            if (stack.empty())
+            {
+                ReturnError("#endif without #if in " + in_fileName);
+            }
+            if (stack.back().m_emitted)
+            {
+                Emit("#endif", firstLine, 1, startsInComment, in_fileName, nextLine, body);
+            }
+            region = stack.back().m_enclosing;
+            stack.pop_back();
+            if ((GUARD_OPEN == guardState) && stack.empty())
+            {
+                guardState = GUARD_CLOSED;
+            }
+        }
+        else if (STATE_FALSE == region)
+        {
+            // any other directive in a dead region
+        }
+        else if ("include" == directive)
+        {
+            Include(args, in_fileName, region, body);
+            nextLine = 0;
+        }
+        else if ("define" == directive)
+        {
+            DefineDirective(args, region, stack);
+            keep = true;
+        }
+        else if ("undef" == directive)
+        {
+            size_t p = 0;
+            string name = ReadIdentifier(args, p);
+            if (STATE_TRUE == region)
+            {
+                Macro macro = {false, false, ""};
+                m_macros[name] = macro;
+            }
+            else
+            {
+                m_macros.erase(name);
+            }
+            keep = true;
+        }
+        else if (("pragma" == directive) && ("once" == args))
+        {
+            pragmaOnce = true;
         }
         else
         {
-            out_src += tmp + "\n";
+            keep = true; // e.g. #pragma OPENCL EXTENSION, #error: for the device compiler
+        }
+
+        if (keep)
+        {
+            Emit(text, firstLine, numLines, startsInComment, in_fileName, nextLine, body);
         }
     } // end loop over lines of code
-    recursionDepth--;
+
+    if (!stack.empty())
+    {
+        ReturnError("#if without #endif in " + in_fileName);
+    }
+
+    if (pragmaOnce)
+    {
+        // the file gets a guard of its own. the first time it is expanded where the #include
+        // is known to be taken, the guard is only recorded; otherwise the device compiler needs it too
+        map<string, string>::const_iterator existing = m_fileGuards.find(in_fileName);
+        bool firstTime = (existing == m_fileGuards.end());
+        if (firstTime)
+        {
+            stringstream name;
+            name << "CLU_PRAGMA_ONCE_" << ++m_numOnce;
+            guard = name.str();
+        }
+        else
+        {
+            guard = existing->second;
+        }
+        if (!firstTime || (STATE_TRUE != in_region))
+        {
+            body = "#ifndef " + guard + "\n#define " + guard + "\n" + body + "#endif\n";
+        }
+        Macro macro = {true, false, ""};
+        if (STATE_TRUE == in_region)
+        {
+            m_macros[guard] = macro;
+        }
+        else
+        {
+            m_macros.erase(guard);
+        }
+        m_fileGuards[in_fileName] = guard;
+    }
+    else if ((GUARD_OPEN == guardState) || (GUARD_CLOSED == guardState))
+    {
+        m_fileGuards[in_fileName] = guard;
+    }
+    out_src += body;
+    m_depth--;
+}
+
+//------------------------------------------------------------------------
+// #define: keep track of the macro where it is known to be defined
+//------------------------------------------------------------------------
+void Preprocessor::DefineDirective(const string& in_args, State in_region, const vector<Conditional>& in_stack)
+{
+    size_t p = 0;
+    string name = ReadIdentifier(in_args, p);
+    if (name.empty())
+    {
+        return;
+    }
+    Macro macro;
+    macro.m_defined = true;
+    macro.m_functionLike = (p < in_args.size()) && ('(' == in_args[p]);
+    macro.m_value = Trim(in_args.substr(p));
+
+    // #ifndef X / #define X: on the path that skips the #define, X was defined already.
+    // so X is defined after the #endif if that #ifndef is all that makes this line uncertain
+    bool known = (STATE_TRUE == in_region);
+    if (!known && (STATE_UNKNOWN == in_region) && !in_stack.empty() && (STATE_TRUE == in_stack[0].m_enclosing))
+    {
+        known = true;
+        for (size_t i = 0; i < in_stack.size(); i++)
+        {
+            const Conditional& c = in_stack[i];
+            bool guardedByName = c.m_firstBranch && (name == c.m_notDefined);
+            if ((STATE_TRUE != c.m_branch) && !guardedByName)
+            {
+                known = false;
+            }
+        }
+    }
+    if (known)
+    {
+        m_macros[name] = macro;
+    }
+    else
+    {
+        m_macros.erase(name);
+    }
+}
+
+//------------------------------------------------------------------------
+// #include: expand the file, unless its guard is known to be defined
+//------------------------------------------------------------------------
+void Preprocessor::Include(const string& in_directive, const string& in_fileName, State in_region, string& out_src)
+{
+    string::size_type start = in_directive.find_first_of('"');
+    string::size_type end = in_directive.find_last_of('"');
+    bool quoted = (string::npos != start);
+    if (!quoted)
+    {
+        start = in_directive.find_first_of('<');
+        end = in_directive.find_last_of('>');
+    }
+    if ((string::npos == start) || (string::npos == end) || (end <= start)) // neither "" nor <>
+    {
+        string error = "Could not interpret include directive:\n#include " + in_directive;
+        ReturnError(error);
+    }
+    string incName = in_directive.substr(start+1, end-start-1);
+
+    string path;
+    MappedFile file;
+    if (!FindFile(incName, quoted, in_fileName, path, file))
+    {
+        string error("File could not be found for #include: ");
+        error += incName;
+        ReturnError(error);
+    }
+
+    map<string, string>::const_iterator guard = m_fileGuards.find(path);
+    if (guard != m_fileGuards.end())
+    {
+        MacroMap::const_iterator macro = m_macros.find(guard->second);
+        if ((macro != m_macros.end()) && macro->second.m_defined)
+        {
+            return; // would expand to nothing
+        }
+    }
+    ProcessFile(path, file.Contents(), in_region, out_src);
+}
+
+//------------------------------------------------------------------------
+// "file" is searched next to the including file first, then like <file>
+//------------------------------------------------------------------------
+bool Preprocessor::FindFile(const string& in_name, bool in_quoted, const string& in_fromFile,
+    string& out_path, MappedFile& out_file)
+{
+    StringList paths;
+    if (in_quoted)
+    {
+        string::size_type slash = in_fromFile.find_last_of("/\\");
+        if (string::npos != slash)
+        {
+            paths.push_back(in_fromFile.substr(0, slash + 1));
+        }
+    }
+    paths.insert(paths.end(), m_includePaths.begin(), m_includePaths.end());
+
+    for (StringList::const_iterator i = paths.begin(); i != paths.end(); i++)
+    {
+        string pathString = *i + in_name;
+        if (out_file.Open(pathString))
+        {
+            out_path = pathString;
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------
+// evaluate a #if expression. STATE_UNKNOWN if it depends on unknown macros
+//------------------------------------------------------------------------
+Preprocessor::State Preprocessor::Evaluate(const string& in_expression)
+{
+    vector<string> tokens;
+    Expand(in_expression, tokens, 0);
+    size_t pos = 0;
+    Value v = Parse(tokens, pos, 0);
+    if (!v.m_known || (pos != tokens.size()))
+    {
+        return STATE_UNKNOWN;
+    }
+    return v.m_value ? STATE_TRUE : STATE_FALSE;
+}
+
+// split into tokens, replacing macros by their values and defined(X) by 0 or 1
+void Preprocessor::Expand(const string& in_expression, vector<string>& out_tokens, int in_depth)
+{
+    const int MAX_EXPANSION_DEPTH = 32;
+    size_t i = 0;
+    while (i < in_expression.size())
+    {
+        char c = in_expression[i];
+        if (isspace((unsigned char)c))
+        {
+            i++;
+        }
+        else if (isdigit((unsigned char)c))
+        {
+            size_t start = i;
+            while ((i < in_expression.size()) && IsIdentifierChar(in_expression[i])) i++;
+            out_tokens.push_back(in_expression.substr(start, i - start));
+        }
+        else if (IsIdentifierChar(c))
+        {
+            string name = ReadIdentifier(in_expression, i);
+            if ("defined" == name)
+            {
+                while ((i < in_expression.size()) && (isspace((unsigned char)in_expression[i]) || ('(' == in_expression[i]))) i++;
+                MacroMap::const_iterator macro = m_macros.find(ReadIdentifier(in_expression, i));
+                while ((i < in_expression.size()) && (isspace((unsigned char)in_expression[i]) || (')' == in_expression[i]))) i++;
+                if (macro == m_macros.end())
+                {
+                    out_tokens.push_back(PP_UNKNOWN);
+                }
+                else
+                {
+                    out_tokens.push_back(macro->second.m_defined ? "1" : "0");
+                }
+                continue;
+            }
+            MacroMap::const_iterator macro = m_macros.find(name);
+            if (macro == m_macros.end())
+            {
+                out_tokens.push_back(PP_UNKNOWN);
+            }
+            else if (!macro->second.m_defined)
+            {
+                out_tokens.push_back("0"); // as in C, undefined identifiers are 0
+            }
+            else if (macro->second.m_functionLike || macro->second.m_value.empty() || (in_depth > MAX_EXPANSION_DEPTH))
+            {
+                out_tokens.push_back(PP_UNKNOWN);
+            }
+            else
+            {
+                out_tokens.push_back("(");
+                Expand(macro->second.m_value, out_tokens, in_depth + 1);
+                out_tokens.push_back(")");
+            }
+        }
+        else
+        {
+            static const char* const twoCharOperators[] = {"&&", "||", "==", "!=", "<=", ">=", "<<", ">>"};
+            string op(1, c);
+            for (size_t j = 0; j < sizeof(twoCharOperators) / sizeof(twoCharOperators[0]); j++)
+            {
+                if (0 == in_expression.compare(i, 2, twoCharOperators[j]))
+                {
+                    op = twoCharOperators[j];
+                }
+            }
+            out_tokens.push_back(op);
+            i += op.size();
+        }
+    }
+}
+
+// precedence climbing over PP_BINARY_OPERATORS, with ?: below all of them
+Preprocessor::Value Preprocessor::Parse(const vector<string>& in_tokens, size_t& io_pos, int in_precedence)
+{
+    if (in_precedence > PP_NUM_BINARY_LEVELS)
+    {
+        return ParseUnary(in_tokens, io_pos);
+    }
+    if (0 == in_precedence)
+    {
+        Value condition = Parse(in_tokens, io_pos, 1);
+        if ((io_pos < in_tokens.size()) && ("?" == in_tokens[io_pos]))
+        {
+            io_pos++;
+            Value a = Parse(in_tokens, io_pos, 0);
+            if ((io_pos >= in_tokens.size()) || (":" != in_tokens[io_pos]))
+            {
+                Value unknown = {false, 0};
+                return unknown;
+            }
+            io_pos++;
+            Value b = Parse(in_tokens, io_pos, 0);
+            if (!condition.m_known)
+            {
+                Value same = {a.m_known && b.m_known && (a.m_value == b.m_value), a.m_value};
+                return same;
+            }
+            return condition.m_value ? a : b;
+        }
+        return condition;
+    }
+
+    Value left = Parse(in_tokens, io_pos, in_precedence + 1);
+    const string operators = string(" ") + PP_BINARY_OPERATORS[in_precedence - 1] + " ";
+    while ((io_pos < in_tokens.size()) && (string::npos != operators.find(" " + in_tokens[io_pos] + " ")))
+    {
+        string op = in_tokens[io_pos++];
+        Value right = Parse(in_tokens, io_pos, in_precedence + 1);
+        Value result = {left.m_known && right.m_known, 0};
+
+        // a known operand can decide && and || on its own
+        if ("&&" == op)
+        {
+            if ((left.m_known && !left.m_value) || (right.m_known && !right.m_value))
+            {
+                result.m_known = true;
+                result.m_value = 0;
+            }
+            else result.m_value = 1;
+        }
+        else if ("||" == op)
+        {
+            if ((left.m_known && left.m_value) || (right.m_known && right.m_value))
+            {
+                result.m_known = true;
+                result.m_value = 1;
+            }
+            else result.m_value = 0;
+        }
+        else if (result.m_known)
+        {
+            long long a = left.m_value;
+            long long b = right.m_value;
+            if      ("|"  == op) result.m_value = a | b;
+            else if ("^"  == op) result.m_value = a ^ b;
+            else if ("&"  == op) result.m_value = a & b;
+            else if ("==" == op) result.m_value = a == b;
+            else if ("!=" == op) result.m_value = a != b;
+            else if ("<"  == op) result.m_value = a < b;
+            else if (">"  == op) result.m_value = a > b;
+            else if ("<=" == op) result.m_value = a <= b;
+            else if (">=" == op) result.m_value = a >= b;
+            else if ("<<" == op) result.m_value = (b >= 0 && b < 64) ? (a << b) : 0;
+            else if (">>" == op) result.m_value = (b >= 0 && b < 64) ? (a >> b) : 0;
+            else if ("+"  == op) result.m_value = a + b;
+            else if ("-"  == op) result.m_value = a - b;
+            else if ("*"  == op) result.m_value = a * b;
+            else if (0 == b)     result.m_known = false; // division by zero
+            else if ("/"  == op) result.m_value = a / b;
+            else if ("%"  == op) result.m_value = a % b;
+        }
+        left = result;
+    }
+    return left;
 }
 
+Preprocessor::Value Preprocessor::ParseUnary(const vector<string>& in_tokens, size_t& io_pos)
+{
+    Value v = {false, 0};
+    if (io_pos >= in_tokens.size())
+    {
+        return v;
+    }
+    const string& token = in_tokens[io_pos++];
+    if (("!" == token) || ("~" == token) || ("-" == token) || ("+" == token))
+    {
+        v = ParseUnary(in_tokens, io_pos);
+        if      ("!" == token) v.m_value = !v.m_value;
+        else if ("~" == token) v.m_value = ~v.m_value;
+        else if ("-" == token) v.m_value = -v.m_value;
+    }
+    else if ("(" == token)
+    {
+        v = Parse(in_tokens, io_pos, 0);
+        if ((io_pos < in_tokens.size()) && (")" == in_tokens[io_pos]))
+        {
+            io_pos++;
+        }
+        else
+        {
+            v.m_known = false;
+        }
+    }
+    else if (isdigit((unsigned char)token[0]))
+    {
+        char* end = 0;
+        v.m_value = strtoll(token.c_str(), &end, 0);
+        v.m_known = true;
+        for (; *end; end++) // only integer suffixes
+        {
+            if (!strchr("uUlL", *end)) v.m_known = false;
+        }
+    }
+    // else PP_UNKNOWN, or not understood
+    return v;
+}
+
+//------------------------------------------------------------------------
+// -t: time from the previous stage, written to stderr
+//------------------------------------------------------------------------
+class StageTimer
+{
+public:
+    StageTimer() : m_start(std::chrono::steady_clock::now()) {}
+    void Report(const char* in_stage)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (g_timing)
+        {
+            cerr << in_stage << ": " <<
+                std::chrono::duration_cast<std::chrono::microseconds>(now - m_start).count() / 1000.0 << " ms" << endl;
+        }
+        m_start = now;
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
 //------------------------------------------------------------------------
 // scan through source for kernels and #includes
 // recursively search all included files
 //------------------------------------------------------------------------
-void ProcessSource(const string& in_src, const StringList& in_includePaths,
-    StringList& out_sources, KernelList& out_kernels)
+void ProcessSource(const string& in_fileName, StringRef in_src, Preprocessor& in_preprocessor,
+    StringList& out_sources, KernelList& out_kernels, StageTimer& io_timer)
 {
-    // first, incorporate all #includes in incoming source
-    // search for #include.  This is recursive.
-    string included;
-    stringstream is;
-    is << in_src;
-    FindIncludes(included, is, in_includePaths);
-
-    out_sources.push_back(included);
+    // first, preprocess: expand #includes, drop what #if rules out
+    out_sources.push_back(string());
+    string& included = out_sources.back();
+    in_preprocessor.Process(in_fileName, in_src, included);
+    io_timer.Report("preprocess");
 
     // make a very simplified copy of the string that is easy
     // to search for tokens, e.g. "kernel" and "#include"
@@ -579,6 +1641,7 @@ void ProcessSource(const string& in_src, const StringList& in_includePaths,
 
     // search for kernels & parameters
     FindKernels(simpleSrc, out_kernels);
+    io_timer.Report("find kernels");
 }
 
 //------------------------------------------------------------------------
@@ -587,10 +1650,10 @@ void ProcessSource(const string& in_src, const StringList& in_includePaths,
 class WriteExports
 {
 private:
-    ofstream& m_outFile;
+    ostream&  m_outFile;
     WriteExports& operator = (const WriteExports&) {return *this;} // unused, removes compile warning
 public:
-    WriteExports(ofstream& out_file) : m_outFile(out_file) {}
+    WriteExports(ostream& out_file) : m_outFile(out_file) {}
     void operator() (const KernelStrings& in_kernelStrings)
     {
         const string& name = in_kernelStrings.m_kernelName;
@@ -605,10 +1668,10 @@ public:
 class WriteCPPExports
 {
 private:
-    ofstream& m_outFile;
+    ostream&  m_outFile;
     WriteCPPExports& operator = (const WriteCPPExports&) {return *this;} // unused, removes compile warning
 public:
-    WriteCPPExports(ofstream& out_file) : m_outFile(out_file) {}
+    WriteCPPExports(ostream& out_file) : m_outFile(out_file) {}
     void operator() (const KernelStrings& in_kernelStrings)
     {
         // Output definition of function that returns the std::function interface to the kernel
@@ -623,11 +1686,11 @@ public:
 class WriteKernelWrapper
 {
 private:
-    ofstream& m_outFile;
+    ostream&  m_outFile;
     string&   m_getProgramName;
     WriteKernelWrapper& operator = (const WriteKernelWrapper&) {return *this;} // unused, removes compile warning
 public:
-    WriteKernelWrapper(ofstream& outFile, string& in_getProgramName) :
+    WriteKernelWrapper(ostream& outFile, string& in_getProgramName) :
       m_outFile(outFile), m_getProgramName(in_getProgramName) {}
     void operator() (const KernelStrings& in_kernelStrings)
     {
@@ -682,6 +1745,13 @@ public:
 
         for (unsigned int i = 0; i < kernelParams.size(); i++)
         {
+            if (kernelParams[i].m_isSVM)
+            {
+                m_outFile <<
+                    "    status = clSetKernelArgSVMPointer(s.m_kernel, " << i << ", " << kernelParams[i].m_name << ");" << endl <<
+                    "    if (CL_SUCCESS != status) return status;" << endl;
+                continue;
+            }
             m_outFile <<
                 "    status = clSetKernelArg(s.m_kernel, " << i << ", ";
             if (true == kernelParams[i].m_isLocal)
@@ -709,11 +1779,11 @@ public:
 class WriteCPPKernelWrapper
 {
 private:
-    ofstream& m_outFile;
+    ostream&  m_outFile;
     string&   m_getProgramName;
     WriteCPPKernelWrapper& operator = (const WriteCPPKernelWrapper&) {return *this;} // unused, removes compile warning
 public:
-    WriteCPPKernelWrapper(ofstream& outFile, string& in_getProgramName) :
+    WriteCPPKernelWrapper(ostream& outFile, string& in_getProgramName) :
       m_outFile(outFile), m_getProgramName(in_getProgramName) {}
     void operator() (const KernelStrings& in_kernelStrings)
     {
@@ -775,20 +1845,19 @@ public:
 class WriteSourceString
 {
 private:
-    ofstream& m_outFile;
+    ostream&  m_outFile;
     WriteSourceString& operator = (const WriteSourceString&) {return *this;} // unused, removes compile warning
 
 public:
-    WriteSourceString(ofstream& out_file) : m_outFile(out_file) {}
+    WriteSourceString(ostream& out_file) : m_outFile(out_file) {}
     void operator () (const string& in_src)
     {
-        stringstream is;
-        string tmp;
+        StringRef tmp;
+        const char* pos = in_src.data();
 
         bool empty_string = true; // workaround case where string is pruned to nothing
 
-        is << in_src;
-        while( std::getline(is, tmp) )
+        while( NextLine(pos, in_src.data() + in_src.size(), tmp) )
         {
             // DO NOT skip empty lines: need them for debugging to work
             //if (0 == tmp.size()) continue; // skip empty lines
@@ -801,17 +1870,18 @@ public:
             }
             m_outFile << "\"";
 
-            // fix problem characters (quotes and backslashes)
-            for (size_t i = 0; i < tmp.size(); i ++)
+            // fix problem characters (quotes and backslashes), writing the runs between them as is
+            const char* run = tmp.begin();
+            for (const char* c = run; c < tmp.end(); c++)
             {
-                char c = tmp[i];
-                switch (c)
+                if (g_charClasses.Is(*c, CHAR_ESCAPE))
                 {
-                case '"': m_outFile << '\\'; break;
-                case '\\': m_outFile << '\\'; break;
+                    m_outFile.write(run, c - run);
+                    m_outFile << '\\';
+                    run = c;
                 }
-                m_outFile << c;
             } // end loop over line
+            m_outFile.write(run, tmp.end() - run);
             m_outFile << "\\n\""; // end of line
             empty_string = false;
         } // end loop over lines of code
@@ -830,36 +1900,38 @@ public:
 // write stringified cl source wrapped in function that also builds it
 //------------------------------------------------------------------------
 void GenerateWrappers(const string& in_inFileName, const string& in_outFileName,
-    const StringList& in_includePaths)
+    Preprocessor& in_preprocessor)
 {
-    // read the whole source file in as a single string
-    ifstream inFile(in_inFileName.c_str());
-    if (!inFile.is_open())
+    StageTimer timer;
+
+    // map the whole source file, it is scanned in place
+    MappedFile inFile;
+    if (!inFile.Open(in_inFileName))
     {
         string error("File not found: ");
         error += in_inFileName;
         ReturnError(error);
     }
-    string src((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
-    inFile.close();
 
     StringList sources; // list of source strings, the original and all #includes
     KernelList kernels; // kernels and their arguments
 
     // scan through source for kernels and #includes
     // recursively search all included files
-    ProcessSource(src, in_includePaths, sources, kernels);
+    ProcessSource(in_inFileName, inFile.Contents(), in_preprocessor, sources, kernels, timer);
 
     string header = GetHeader(in_outFileName);
     string getProgramName = CLU_PREFIX "Get_" + header;
 
-    ofstream outFile(in_outFileName.c_str());
-    if (!outFile.is_open())
+    ofstream file(in_outFileName.c_str());
+    if (!file.is_open())
     {
         string error("File could not be opened for writing: ");
         error += in_outFileName;
         ReturnError(error);
     }
+    // the header is assembled in memory and written at once: endl does not flush it line by line
+    stringstream outFile;
 
     // helpful comments
     if( g_generateCPP ) 
@@ -942,13 +2014,22 @@ void GenerateWrappers(const string& in_inFileName, const string& in_outFileName,
             "#ifndef __" << header.c_str() << endl <<
             "#define __" << header.c_str() << endl << endl;
 
+        // CLU_SVM is only a marker for the generator, the device compiler must see nothing.
+        // an extra string in front defines it, then restores the line numbers of the source
+        size_t numSources = sources.size() + (g_svmMarkerUsed ? 1 : 0);
+
         // function to build program from stringified sources
         outFile <<
             "/* This function is shared by all " CLU_PREFIX_CREATE "* functions below */" << endl <<
             "CLU_INLINE cl_program " << getProgramName << "(cl_int* out_pStatus)" << endl <<
             "{" << endl <<
-            "    static const char* src[" << sources.size() << "] = {";
+            "    static const char* src[" << numSources << "] = {";
 
+        if (g_svmMarkerUsed)
+        {
+            outFile << endl <<
+                "    \"#ifndef " CLU_SVM_MARKER "\\n#define " CLU_SVM_MARKER "\\n#endif\\n#line 1\\n\",";
+        }
         for_each(sources.begin(), sources.end(), WriteSourceString(outFile));
 
         outFile << endl <<
@@ -956,7 +2037,7 @@ void GenerateWrappers(const string& in_inFileName, const string& in_outFileName,
             "    /* CLU will only build this program the first time */" << endl <<
             "    /* CLU will release this program upon shutdown (cluRelease) */" << endl <<
             // pass a flag to the build API so it will know to manage the lifetime of the resulting cl_program
-            "    cl_program program = cluBuildSourceArray(" << sources.size() << ", src, 0, \"" << CLU_MAGIC_BUILD_FLAG << "\", out_pStatus);" << endl <<
+            "    cl_program program = cluBuildSourceArray(" << numSources << ", src, 0, \"" << CLU_MAGIC_BUILD_FLAG << "\", out_pStatus);" << endl <<
             "    return program;" << endl <<
             "}" << endl << endl;
 
@@ -966,7 +2047,9 @@ void GenerateWrappers(const string& in_inFileName, const string& in_outFileName,
     }
 
 
-    outFile.close();
+    file << outFile.rdbuf();
+    file.close();
+    timer.Report("write header");
 
     if (g_verbose)
     {
@@ -992,7 +2075,11 @@ void Usage()
         "-o -O output_file_name (defaults to input_file_name.h)" << endl <<
         "-q -Q quiet mode" << endl <<
         "-n -N do not show line numbers" << endl <<
-        "-cpp output the header in C++ mode to work with cl.hpp" << endl;
+        "-D name[=value] define a macro for #if, and for the generated program (value defaults to 1)" << endl <<
+        "-U name treat a macro as undefined for #if" << endl <<
+        "-cpp output the header in C++ mode to work with cl.hpp" << endl <<
+        "-svm pass every global pointer parameter as an SVM pointer (void*), C mode only" << endl <<
+        "-t report the time each stage takes" << endl;
 }
 
 //************************************************************************
@@ -1001,6 +2088,8 @@ void Usage()
 int main(int argc, char *argv[])
 {
     StringList includePaths;
+    StringList defines;   // NAME or NAME=VALUE
+    StringList undefines;
     string inFileName;
     string outFileName;
 
@@ -1029,6 +2118,17 @@ int main(int argc, char *argv[])
                 return -1;
             }
         }
+        else if ((!strcmp(argv[arg], "-D")) || (!strcmp(argv[arg], "-U")))
+        {
+            StringList& names = ('D' == argv[arg][1]) ? defines : undefines;
+            arg++;
+            if (argc <= arg)
+            {
+                Usage();
+                return -1;
+            }
+            names.push_back(argv[arg]);
+        }
         else if (!strcmp(argv[arg], "-h"))
         {
             Usage();
@@ -1051,6 +2151,14 @@ int main(int argc, char *argv[])
         {
             g_generateCPP = true;
         }
+        else if ((!strcmp(argv[arg], "-svm")))
+        {
+            g_svm = true;
+        }
+        else if ((!strcmp(argv[arg], "-t")))
+        {
+            g_timing = true;
+        }
         else // default, undecorated argument assumed to be name
         {
             inFileName = argv[arg];
@@ -1075,8 +2183,26 @@ int main(int argc, char *argv[])
     // first path is current path
     includePaths.push_front("");
 
+    Preprocessor preprocessor(includePaths);
+    for (StringList::const_iterator i = defines.begin(); i != defines.end(); i++)
+    {
+        string::size_type equals = i->find('=');
+        if (string::npos == equals)
+        {
+            preprocessor.Define(*i, "1");
+        }
+        else
+        {
+            preprocessor.Define(i->substr(0, equals), i->substr(equals + 1));
+        }
+    }
+    for (StringList::const_iterator i = undefines.begin(); i != undefines.end(); i++)
+    {
+        preprocessor.Undefine(*i);
+    }
+
     // open input & output files, write output file
-    GenerateWrappers(inFileName, outFileName, includePaths);
+    GenerateWrappers(inFileName, outFileName, preprocessor);
 
     return 0;
 }
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2012, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Usage:
+    clu_generator_bench num_kernels output_file_name
+
+    Writes a synthetic kernel library to time clu_generator with, e.g.
+    the clu_generator_bench build target. Each kernel has comments,
+    an attribute, a #if on a macro the generator cannot resolve and a
+    body of a few lines, so every stage of the generator has work to do.
+    A small header is written next to the output and #included from it.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+using namespace std;
+
+//------------------------------------------------------------------------
+// Error routine -- called to exit semi-gracefully
+//------------------------------------------------------------------------
+void ReturnError(const string& in_errString)
+{
+    fprintf(stderr, "ERROR: %s\n", in_errString.c_str());
+    exit(-1);
+}
+
+//------------------------------------------------------------------------
+// the header every kernel library file includes
+//------------------------------------------------------------------------
+void WriteHeader(const string& in_fileName)
+{
+    FILE* f = fopen(in_fileName.c_str(), "w");
+    if (0 == f)
+    {
+        ReturnError("File could not be opened for writing: " + in_fileName);
+    }
+    fprintf(f,
+        "#ifndef BENCH_COMMON_H\n"
+        "#define BENCH_COMMON_H\n"
+        "/* helpers shared by the kernels */\n"
+        "#define BENCH_SCALE(x) ((x) * 2.0f)\n"
+        "#endif\n");
+    fclose(f);
+}
+
+//------------------------------------------------------------------------
+// one kernel of the library. i selects a few variations
+//------------------------------------------------------------------------
+void WriteKernel(FILE* f, int i)
+{
+    fprintf(f,
+        "/*\n"
+        " * kernel %d: scales a, adds b, writes \"c\"\n"
+        " */\n", i);
+    if (0 == (i % 4))
+    {
+        fprintf(f, "kernel __attribute__((reqd_work_group_size(64, 1, 1))) void k%d(\n", i);
+    }
+    else
+    {
+        fprintf(f, "__kernel void k%d(\n", i);
+    }
+    fprintf(f,
+        "    global const float* a, // input\n"
+        "    global const float* b,\n"
+        "    global float* c,\n"
+        "    float scale, int n)\n"
+        "{\n"
+        "    int id = get_global_id(0);\n"
+        "    if (id >= n) { return; }\n"
+        "#if BENCH_VARIANT > 1\n"
+        "    c[id] = BENCH_SCALE(a[id]) * scale + b[id]; /* variant { */\n"
+        "#else\n"
+        "    c[id] = a[id] * scale + b[id];\n"
+        "#endif\n"
+        "}\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (3 != argc)
+    {
+        fprintf(stderr, "The syntax of this command is:\n\nclu_generator_bench num_kernels output_file_name\n");
+        return -1;
+    }
+    int numKernels = atoi(argv[1]);
+    string outFileName = argv[2];
+
+    // the header goes next to the output
+    string path;
+    string::size_type slash = outFileName.find_last_of("/\\");
+    if (string::npos != slash)
+    {
+        path = outFileName.substr(0, slash + 1);
+    }
+    WriteHeader(path + "bench_common.h");
+
+    FILE* f = fopen(outFileName.c_str(), "w");
+    if (0 == f)
+    {
+        ReturnError("File could not be opened for writing: " + outFileName);
+    }
+    fprintf(f, "#include \"bench_common.h\"\n\n");
+    for (int i = 0; i < numKernels; i++)
+    {
+        WriteKernel(f, i);
+    }
+    fclose(f);
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef GUARDED_H
+#define GUARDED_H
+
+kernel void GuardedKernel(global int* a)
+{
+    a[get_global_id(0)] = 2;
+}
+
+#endif
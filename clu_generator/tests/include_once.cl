@@ -0,0 +1,19 @@
+// generator test: headers expanded more than once
+// once.h and guarded.h are included under a condition the generator cannot
+// decide, then again unconditionally. the source keeps both expansions for
+// the device compiler, which sees one of each; every kernel is wrapped once.
+//
+// expected: kernels found: OnceKernel, GuardedKernel, MainKernel
+
+#ifdef UNDECIDED
+#include "once.h"
+#include "guarded.h"
+#endif
+
+#include "once.h"
+#include "guarded.h"
+
+kernel void MainKernel(global int* a)
+{
+    a[get_global_id(0)] = 3;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+kernel void OnceKernel(global int* a)
+{
+    a[get_global_id(0)] = 1;
+}
@@ -79,6 +79,11 @@ typedef struct
     cl_uint          num_events_in_wait_list; /* may be NULL */
     cl_event*        event_wait_list;         /* may be NULL */
     cl_event*        out_event; /* may be NULL: application-provided return event */
+    /* residency hint (cluEnqueue): once the launch completes, migrate these buffers to prefetch_device, */
+    /* e.g. the next stage's inputs, so the transfer overlaps with other work. see cluMigrate */
+    cl_uint          num_prefetch_buffers;
+    const cl_mem*    prefetch_buffers;        /* may be NULL */
+    cl_device_type   prefetch_device;         /* 0 = CL_DEVICE_TYPE_DEFAULT */
 } clu_enqueue_params;
 
 typedef struct
@@ -89,8 +94,218 @@ typedef struct
     cl_command_queue_properties default_queue_props;   /* may be NULL */
     cl_context_properties*      default_context_props; /* may be NULL */
     cl_device_type              preferred_device_type; /* may be NULL */
+    cl_bitfield                 runtime_flags;         /* may be NULL: CLU_RUNTIME_* */
+    const char*                 trace_file;            /* may be NULL: trace written here by cluRelease */
 } clu_initialize_params;
 
+/* clu_initialize_params.runtime_flags */
+#define CLU_RUNTIME_PROFILING (1 << 0) /* profile every kernel launch, see cluGetKernelStats */
+#define CLU_RUNTIME_TRACING   (1 << 1) /* record a timeline of clu calls and device commands, see cluWriteTrace */
+#define CLU_RUNTIME_HUGE_PAGES (1 << 2) /* back large aligned buffers with huge pages when possible, see CLU_MEM_HUGE_PAGES */
+#define CLU_RUNTIME_ZERO_COPY_CHECKS (1 << 3) /* warn on stderr when aligned buffers or cluEnqueueMapBuffer copy, see cluGetZeroCopyStats */
+
+/* cl_mem_flags understood by clu, removed before the flags are passed to OpenCL */
+#define CLU_MEM_HUGE_PAGES ((cl_mem_flags)1 << 40) /* aligned buffers: back the host memory with 2MB pages when possible */
+#define CLU_MEM_PREFETCH   ((cl_mem_flags)1 << 41) /* file buffers: start reading the whole range into the page cache now */
+
+/* how the host memory of an aligned buffer was allocated */
+#define CLU_HOST_MEMORY_DEFAULT                0 /* aligned malloc */
+#define CLU_HOST_MEMORY_HUGETLB                1 /* reserved huge pages: mmap(MAP_HUGETLB) */
+#define CLU_HOST_MEMORY_TRANSPARENT_HUGE_PAGES 2 /* 2MB aligned, madvise(MADV_HUGEPAGE): huge pages if the kernel can find them */
+
+/* counters of CLU_RUNTIME_ZERO_COPY_CHECKS */
+typedef struct
+{
+    cl_ulong buffers_checked;     /* aligned buffers probed when created, once per device */
+    cl_ulong buffers_copied;      /* probes where mapping did not return the buffer's host memory, or was slow */
+    cl_ulong maps;                /* cluEnqueueMapBuffer calls on CL_MEM_USE_HOST_PTR buffers */
+    cl_ulong maps_copied;         /* maps that returned a pointer other than the buffer's host memory */
+    cl_ulong bytes_copied;        /* bytes those maps and their unmaps copied, which zero-copy would have avoided */
+} clu_zero_copy_stats;
+
+/* NUMA node of host memory or of a device, when there is no single node or it cannot be determined */
+#define CLU_NUMA_NODE_ANY -1
+
+typedef struct
+{
+    void*   host_ptr;
+    size_t  size;    /* bytes allocated, may be more than the buffer size */
+    cl_uint backing; /* CLU_HOST_MEMORY_* */
+} clu_host_memory_info;
+
+/* called by cluEnqueueTiled after each tile has been enqueued */
+/* the application may enqueue other commands from the callback; they will run between tiles */
+/* return CL_FALSE to cancel the remaining tiles */
+typedef cl_bool (CLU_CALLBACK *clu_tile_callback)(const clu_nd_range* tile,
+                                                 cl_uint             tile_index,
+                                                 cl_uint             num_tiles,
+                                                 void*               user_data);
+
+typedef struct
+{
+    size_t            tile[3];        /* tile size per dimension, 0 = do not split. all 0 = automatic */
+    cl_uint           max_in_flight;  /* may be NULL: tiles enqueued but not yet complete, 0 = unlimited */
+    clu_tile_callback callback;       /* may be NULL */
+    void*             user_data;      /* may be NULL: passed to callback */
+} clu_tile_params;
+
+typedef struct
+{
+    size_t                  chunk_size;       /* work items per chunk in the slowest-varying dimension, 0 = automatic */
+    cl_uint                 max_in_flight;    /* chunks in flight per queue, 0 = 2 */
+    cl_uint                 num_queues;       /* ignored if queues is NULL */
+    const cl_command_queue* queues;           /* may be NULL: one queue per device in the context */
+    cl_uint*                out_chunk_counts; /* may be NULL: chunks executed by each queue, valid when the launch completes */
+} clu_dynamic_params;
+
+/* cluStream: fill host_ptr with the next chunk of input. return the bytes written, 0 = no more input */
+typedef size_t (CLU_CALLBACK *clu_stream_producer)(void*   host_ptr,
+                                                   size_t  capacity,
+                                                   cl_uint chunk_index,
+                                                   void*   user_data);
+
+/* cluStream: set the kernel arguments (typically input and output) and params->nd_range for one chunk */
+/* *output_bytes starts as output_chunk_size: set it to the bytes of output this chunk produces */
+/* params->queue and the wait list are ignored. return an error to stop the stream */
+typedef cl_int (CLU_CALLBACK *clu_stream_launch)(cl_kernel           kern,
+                                                 cl_mem              input,
+                                                 cl_mem              output,
+                                                 size_t              input_bytes,
+                                                 cl_uint             chunk_index,
+                                                 clu_enqueue_params* params,
+                                                 size_t*             output_bytes,
+                                                 void*               user_data);
+
+/* cluStream: use a chunk of output. host_ptr is only valid during the call. return CL_FALSE to stop the stream */
+typedef cl_bool (CLU_CALLBACK *clu_stream_consumer)(const void* host_ptr,
+                                                    size_t      bytes,
+                                                    cl_uint     chunk_index,
+                                                    void*       user_data);
+
+/* cluReadAsync: use the data read. host_ptr is NULL if the read failed, and only valid during the call */
+typedef void (CLU_CALLBACK *clu_read_callback)(const void* host_ptr,
+                                               size_t      size,
+                                               cl_int      status,
+                                               void*       user_data);
+
+typedef struct
+{
+    cl_kernel           kernel;
+    size_t              input_chunk_size;  /* bytes per chunk of input */
+    size_t              output_chunk_size; /* bytes per chunk of output */
+    cl_uint             num_buffers;       /* chunks in flight, each with its own staging buffers, 0 = 3 */
+    cl_command_queue    upload_queue;      /* may be NULL: a new queue on the compute queue's device */
+    cl_command_queue    compute_queue;     /* may be NULL (uses default) */
+    cl_command_queue    download_queue;    /* may be NULL: a new queue on the compute queue's device */
+    clu_stream_producer producer;
+    clu_stream_launch   launch;
+    clu_stream_consumer consumer;          /* may be NULL */
+    void*               user_data;         /* may be NULL: passed to the callbacks */
+} clu_stream_params;
+
+typedef struct
+{
+    cl_uint  chunks;
+    cl_ulong input_bytes;
+    cl_ulong output_bytes;
+    cl_ulong elapsed_ns;
+    cl_ulong stall_ns;         /* time the producer waited for a free staging buffer */
+    double   bytes_per_second; /* input bytes per second */
+} clu_stream_stats;
+
+/* kinds of call reported to clu_hooks */
+#define CLU_CALL_BUILD_PROGRAM 1 /* cluBuild*, including programs built by generated code */
+#define CLU_CALL_ENQUEUE       2 /* cluEnqueue, cluEnqueueTiled, cluEnqueueSplit, cluEnqueueDynamic */
+#define CLU_CALL_CREATE_BUFFER 3 /* cluCreateAlignedBuffer, cluPoolAcquire, cluCreateAlignedImage2D/3D, cluCreateBufferFromFile */
+#define CLU_CALL_WAIT          4 /* cluWaitOnAnyEvent, cluWaitOnAnyEventEx, cluWaitSetWait, cluWait, cluFinish */
+#define CLU_CALL_RELEASE       5 /* cluRelease */
+
+/* description of a call, passed to clu_hooks */
+typedef struct
+{
+    cl_uint             call;        /* CLU_CALL_* */
+    const char*         api_name;    /* e.g. "cluEnqueue" */
+    const char*         kernel_name; /* may be NULL: enqueue only */
+    const clu_nd_range* nd_range;    /* may be NULL: enqueue only */
+    cl_command_queue    queue;       /* may be NULL: enqueue only, NULL = default queue */
+    size_t              bytes;       /* create buffer only */
+    cl_int              status;      /* post hook only */
+    cl_ulong            duration_ns; /* post hook only: host time spent in the call */
+} clu_call_info;
+
+typedef void (CLU_CALLBACK *clu_call_hook)(const clu_call_info* info, void* user_data);
+
+typedef struct
+{
+    clu_call_hook pre;       /* may be NULL: called on entry */
+    clu_call_hook post;      /* may be NULL: called on exit */
+    void*         user_data; /* may be NULL: passed to the hooks */
+} clu_hooks;
+
+/* a reusable set of events to wait on, see cluCreateWaitSet */
+typedef struct _clu_wait_set* clu_wait_set;
+
+/* a cache of aligned buffers, see cluBufferPoolCreate */
+typedef struct _clu_buffer_pool* clu_buffer_pool;
+
+typedef struct
+{
+    cl_mem_flags flags;            /* 0 = read/write. CL_MEM_USE_HOST_PTR is added */
+    size_t       max_cached_bytes; /* idle buffers beyond this many bytes are released, 0 = no limit */
+} clu_buffer_pool_params;
+
+typedef struct
+{
+    cl_ulong acquires;          /* buffers handed out */
+    cl_ulong hits;              /* acquires served by an idle buffer */
+    cl_ulong releases;          /* buffers handed back */
+    cl_ulong trimmed;           /* idle buffers released to stay under max_cached_bytes, or by cluBufferPoolTrim */
+    size_t   bytes_in_use;      /* handed out and not yet handed back */
+    size_t   bytes_cached;      /* idle */
+    size_t   peak_bytes_in_use;
+} clu_buffer_pool_stats;
+
+typedef struct
+{
+    cl_ulong allocs;       /* pointers handed out */
+    cl_ulong hits;         /* allocs served by an idle allocation */
+    cl_ulong frees;        /* pointers handed back */
+    size_t   bytes_in_use; /* handed out and not yet handed back */
+    size_t   bytes_cached; /* idle */
+} clu_svm_stats;
+
+/* a linear allocator of sub-buffers, see cluCreateArena */
+typedef struct _clu_arena* clu_arena;
+
+/* a queue of completed events, see cluCreateCompletionQueue */
+typedef struct _clu_completion_queue* clu_completion_queue;
+
+/* return code of the wait functions when the timeout expires */
+#define CLU_WAIT_TIMEOUT  -9000
+/* return code of calls that would take memory objects past the limit set by cluSetMemorySoftLimit */
+#define CLU_MEMORY_LIMIT_EXCEEDED -9001
+#define CLU_WAIT_INFINITE 0xFFFFFFFF
+
+/* how cluWait and cluFinish wait: spin, then yield, then block in the OpenCL runtime */
+typedef struct
+{
+    cl_ulong spin_ns;  /* poll the events without giving up the cpu for this long, may be CLU_WAIT_ADAPTIVE */
+    cl_ulong yield_ns; /* then poll, yielding the cpu between polls, for this long, may be CLU_WAIT_ADAPTIVE */
+} clu_wait_policy;
+
+/* derive the time from recent waits, 0 once they are too long for polling to pay off */
+#define CLU_WAIT_ADAPTIVE ((cl_ulong)-1)
+
+/* counters of the event references held by CLU */
+typedef struct
+{
+    cl_ulong created;         /* events CLU created or retained for itself, plus those handed to cluRecycleEvent */
+    cl_ulong released;        /* events CLU released: its own, and those handed to cluRecycleEvent */
+    cl_ulong alive;           /* created - released: references CLU still holds. events returned to the */
+                              /* application are not counted until they are handed to cluRecycleEvent */
+    cl_uint  pending_release; /* events waiting in the recycler for the next batch release */
+} clu_event_stats;
+
 /********************************************************************************************************/
 /* Platform API                                                                                         */
 /********************************************************************************************************/
@@ -128,6 +343,93 @@ extern CLU_API_ENTRY cl_int CLU_API_CALL
 cluEnqueue(cl_kernel kern,
            clu_enqueue_params* params);
 
+/* Split the ND range into tiles (using nd_range.offset) and enqueue them one at a time */
+/* params->out_event, if requested, completes when all enqueued tiles complete */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluEnqueueTiled(cl_kernel              kern,
+                clu_enqueue_params*    params,
+                const clu_tile_params* tile_params); /* may be NULL */
+
+/* Split the ND range into one slice per device (along the slowest-varying dimension) and */
+/* enqueue each slice on that device's queue. params->queue is ignored. */
+/* weights = NULL sizes slices by the throughput measured on previous calls with this kernel, */
+/* keeping a small slice for every device so each one is measured again */
+/* params->out_event, if requested, completes when every slice completes */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluEnqueueSplit(cl_kernel             kern,
+                clu_enqueue_params*   params,
+                cl_uint               num_devices,  /* ignored if devices is NULL */
+                const cl_device_type* devices,      /* may be NULL: all devices in the context */
+                const float*          weights);     /* may be NULL */
+
+/* Cut the ND range into many chunks and share them out dynamically between queues: */
+/* each queue keeps a few chunks in flight and takes the next one when a chunk completes, */
+/* so faster queues execute more chunks. params->queue is ignored. */
+/* If params->out_event is NULL this returns when every chunk has completed. Otherwise it returns */
+/* immediately, and the kernel arguments must not change until out_event completes. */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluEnqueueDynamic(cl_kernel                 kern,
+                  clu_enqueue_params*       params,
+                  const clu_dynamic_params* dynamic_params); /* may be NULL */
+
+/* Process input larger than device memory in chunks: produce, upload, compute, download, consume */
+/* Up to num_buffers chunks are in flight, so the upload, compute and download of consecutive chunks */
+/* overlap on their own queues. When every staging buffer is in use, the producer waits for the oldest */
+/* chunk to be downloaded and consumed. The callbacks are called on the calling thread, in chunk order */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluStream(const clu_stream_params* params,
+          clu_stream_stats*        out_stats); /* may be NULL */
+
+/* Read a range of a buffer without blocking: it is copied into a reusable staging buffer, and the */
+/* callback is called on a CLU completion thread once the copy completes. Callbacks are called one at */
+/* a time, in completion order, and may call cluReadAsync. Up to CLU_READ_ASYNC_MAX_STAGING reads are */
+/* in flight; beyond that this waits for a staging buffer (or, from a callback, returns CL_OUT_OF_RESOURCES) */
+/* cluRelease waits for every pending callback */
+#define CLU_READ_ASYNC_MAX_STAGING 8
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluReadAsync(cl_command_queue  queue,                   /* may be NULL (uses default) */
+             cl_mem            buffer,
+             size_t            offset,
+             size_t            size,
+             clu_read_callback callback,
+             void*             user_data,               /* may be NULL: passed to the callback */
+             cl_uint           num_events_in_wait_list,
+             const cl_event*   event_wait_list);        /* may be NULL */
+
+/* Move buffers to a device ahead of the commands that use them, on that device's CLU queue */
+/* flags as for clEnqueueMigrateMemObjects: CL_MIGRATE_MEM_OBJECT_HOST moves them to the host instead, */
+/* CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED skips the copy. moves are counted, see cluGetMigrationStats */
+/* requires OpenCL 1.2, otherwise returns CL_INVALID_OPERATION */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluMigrate(const cl_mem*          buffers,
+           cl_uint                num_buffers,
+           cl_device_type         device,                  /* 0 = CL_DEVICE_TYPE_DEFAULT */
+           cl_bitfield            flags,                   /* cl_mem_migration_flags, 0 = move the contents */
+           cl_uint                num_events_in_wait_list,
+           const cl_event*        event_wait_list,         /* may be NULL */
+           cl_event*              event);                  /* may be NULL */
+
+/* Event APIs */
+/* Launch without out_event, and ask for an event only at the points you need to synchronize: */
+/* the marker completes when all work previously enqueued in the queue completes */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluEnqueueMarker(cl_command_queue queue,      /* may be NULL (uses default) */
+                 cl_event*        out_event);
+
+/* Hand an event back to CLU instead of calling clReleaseEvent */
+/* CLU releases recycled events in batches, away from the submitting thread's fast path */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluRecycleEvent(cl_event event);
+
+/* Release every recycled event now */
+extern CLU_API_ENTRY void CLU_API_CALL
+cluFlushRecycledEvents(void);
+
+/* Return counters of the events created and released by CLU */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetEventStats(clu_event_stats* out_stats);
+
 /* Get build errors (if any) from a program */
 extern CLU_API_ENTRY const char * CLU_API_CALL
 cluGetBuildErrors(cl_program program);
@@ -182,11 +484,283 @@ cluCreateAlignedBuffer(cl_mem_flags flags        /* 0 = read/write */,
                        void**       out_host_ptr /* may be NULL */,
                        cl_int*      errcode_ret  /* may be NULL */);
 
+/* create an aligned buffer with its host memory bound to a NUMA node (Linux only, elsewhere the node is ignored) */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluCreateAlignedBufferOnNode(cl_mem_flags flags        /* 0 = read/write */,
+                             size_t       size,
+                             cl_int       numa_node    /* may be CLU_NUMA_NODE_ANY */,
+                             void**       out_host_ptr /* may be NULL */,
+                             cl_int*      errcode_ret  /* may be NULL */);
+
+/* create an aligned buffer with its host memory local to a device */
+/* devices with a known node are handled like cluCreateAlignedBufferOnNode. otherwise the */
+/* device (e.g. a cpu sub-device) zero-fills the buffer, so its own threads first touch the pages */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluCreateAlignedBufferForDevice(cl_mem_flags flags        /* 0 = read/write */,
+                                size_t       size,
+                                cl_device_id device,
+                                void**       out_host_ptr /* may be NULL */,
+                                cl_int*      errcode_ret  /* may be NULL */);
+
+/* Map a range of a file into memory and create a buffer using it, so devices read the file from the page cache */
+/* the mapping is private: writes to the buffer never reach the file. it is unmapped by clReleaseMemObject() */
+/* the buffer is zero-copy when offset is a multiple of 4096. where mmap is not available, the range is read */
+/* into an aligned buffer instead */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluCreateBufferFromFile(const char*  file_name,
+                        size_t       offset,
+                        size_t       size        /* 0 = to the end of the file */,
+                        cl_mem_flags flags       /* 0 = read/write, may include CLU_MEM_PREFETCH */,
+                        cl_int*      errcode_ret /* may be NULL */);
+
+/* Allocate aligned host memory and create an image using it, with a row pitch every device accepts for zero-copy */
+/* the format must support CL_MEM_USE_HOST_PTR (see cluGetSupportedImageFormats), else CL_IMAGE_FORMAT_NOT_SUPPORTED */
+/* host memory is freed by clReleaseMemObject(), like cluCreateAlignedBuffer */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluCreateAlignedImage2D(cl_mem_flags           flags         /* 0 = read/write */,
+                        const cl_image_format* format,
+                        size_t                 width,
+                        size_t                 height,
+                        size_t*                out_row_pitch /* may be NULL */,
+                        void**                 out_host_ptr  /* may be NULL */,
+                        cl_int*                errcode_ret   /* may be NULL */);
+
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluCreateAlignedImage3D(cl_mem_flags           flags           /* 0 = read/write */,
+                        const cl_image_format* format,
+                        size_t                 width,
+                        size_t                 height,
+                        size_t                 depth,
+                        size_t*                out_row_pitch   /* may be NULL */,
+                        size_t*                out_slice_pitch /* may be NULL */,
+                        void**                 out_host_ptr    /* may be NULL */,
+                        cl_int*                errcode_ret     /* may be NULL */);
+
+/* return a sampler, created on first request and shared by every later request with the same settings */
+/* the sampler is internal to CLU and released by cluRelease, applications should not release it */
+extern CLU_API_ENTRY cl_sampler CLU_API_CALL
+cluGetSampler(cl_bool            normalized_coords,
+              cl_addressing_mode addressing_mode,
+              cl_filter_mode     filter_mode,
+              cl_int*            errcode_ret /* may be NULL */);
+
+/* NUMA node of a device attached to the PCI bus (cl_khr_pci_bus_info), else CLU_NUMA_NODE_ANY */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetDeviceNumaNode(cl_device_id device,
+                     cl_int*      out_numa_node);
+
+/* NUMA node holding most of the pages of an aligned buffer, CLU_NUMA_NODE_ANY if none are resident */
+/* for a sub-buffer, only the pages of its range are sampled */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetBufferNumaNode(cl_mem  buffer,
+                     cl_int* out_numa_node);
+
+/* move the host memory of an aligned buffer to a NUMA node, and keep it there */
+/* a sub-buffer moves only the pages of its range; pages it shares with its neighbours move too */
+/* the buffer must not be in use by the device */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluMigrateBufferToNode(cl_mem buffer,
+                       cl_int numa_node);
+
+/* clEnqueueMapBuffer and clEnqueueUnmapMemObject; with CLU_RUNTIME_ZERO_COPY_CHECKS, report maps that copy */
+extern CLU_API_ENTRY void* CLU_API_CALL
+cluEnqueueMapBuffer(cl_command_queue queue,        /* may be NULL (uses default) */
+                    cl_mem           buffer,
+                    cl_bool          blocking_map,
+                    cl_map_flags     map_flags,
+                    size_t           offset,
+                    size_t           size,
+                    cl_uint          num_events_in_wait_list,
+                    const cl_event*  event_wait_list, /* may be NULL */
+                    cl_event*        event,           /* may be NULL */
+                    cl_int*          errcode_ret);    /* may be NULL */
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluEnqueueUnmapMemObject(cl_command_queue queue,        /* may be NULL (uses default) */
+                         cl_mem           memobj,
+                         void*            mapped_ptr,
+                         cl_uint          num_events_in_wait_list,
+                         const cl_event*  event_wait_list, /* may be NULL */
+                         cl_event*        event);          /* may be NULL */
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetZeroCopyStats(clu_zero_copy_stats* out_stats);
+
+/* describe the host memory behind a buffer (or sub-buffer) created by cluCreateAlignedBuffer, a pool or an arena */
+/* returns CL_INVALID_MEM_OBJECT for other buffers */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetHostMemoryInfo(cl_mem                buffer,
+                     clu_host_memory_info* out_info);
+
+/* buffer pools: aligned buffers are handed out by size class and reused instead of being released */
+/* a thread-safe replacement for cluCreateAlignedBuffer/clReleaseMemObject pairs on temporaries */
+extern CLU_API_ENTRY clu_buffer_pool CLU_API_CALL
+cluBufferPoolCreate(const clu_buffer_pool_params* params,       /* may be NULL */
+                    cl_int*                       errcode_ret); /* may be NULL */
+
+/* the buffer may be larger than size, it is rounded up to its size class */
+/* fails with CL_INVALID_BUFFER_SIZE if size cannot be rounded up to a size class */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluPoolAcquire(clu_buffer_pool pool,
+               size_t          size,
+               void**          out_host_ptr, /* may be NULL */
+               cl_int*         errcode_ret); /* may be NULL */
+
+/* hand a buffer back to the pool it was acquired from, instead of releasing it */
+/* the application must not use the buffer afterwards, including in commands not yet complete */
+/* returns CL_INVALID_MEM_OBJECT for a buffer the pool did not hand out or already got back */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluPoolRelease(clu_buffer_pool pool,
+               cl_mem          buffer);
+
+/* release idle buffers until no more than max_cached_bytes are idle */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluBufferPoolTrim(clu_buffer_pool pool,
+                  size_t          max_cached_bytes);
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetBufferPoolStats(clu_buffer_pool        pool,
+                      clu_buffer_pool_stats* out_stats);
+
+/* release the idle buffers and the pool. buffers still acquired must be released with clReleaseMemObject */
+/* destroy pools before cluRelease */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluBufferPoolDestroy(clu_buffer_pool pool);
+
+/* shared virtual memory (OpenCL 2.0): allocations are cached by size class and flags instead of being freed */
+/* flags 0 = coarse-grained read/write: the host must clEnqueueSVMMap before touching the memory */
+/* flags CL_MEM_SVM_FINE_GRAIN_BUFFER (optionally | CL_MEM_SVM_ATOMICS) = the host may touch it at any time */
+/* returns NULL with CL_INVALID_OPERATION if a device in the context does not support the requested mode */
+/* and with CL_INVALID_BUFFER_SIZE if size cannot be rounded up to a size class */
+extern CLU_API_ENTRY void* CLU_API_CALL
+cluSVMAlloc(cl_svm_mem_flags flags,
+            size_t           size,
+            cl_int*          errcode_ret); /* may be NULL */
+
+/* hand a pointer from cluSVMAlloc back to the cache */
+/* the application must not use it afterwards, including in commands not yet complete */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluSVMFree(void* ptr);
+
+/* free idle allocations until no more than max_cached_bytes are idle. cluRelease frees them all */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluSVMTrim(size_t max_cached_bytes);
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluGetSVMStats(clu_svm_stats* out_stats);
+
+/* arenas: one aligned buffer, allocated from front to back as sub-buffers, and recycled all at once */
+/* an arena is not thread safe, use one per thread or per request */
+extern CLU_API_ENTRY clu_arena CLU_API_CALL
+cluCreateArena(cl_mem_flags flags       /* 0 = read/write */,
+               size_t       capacity,
+               cl_int*      errcode_ret /* may be NULL */);
+
+/* return a sub-buffer at the next offset aligned for every device in the context */
+/* the sub-buffer belongs to the arena: do not release it */
+/* returns CL_MEM_OBJECT_ALLOCATION_FAILURE if the arena is full */
+extern CLU_API_ENTRY cl_mem CLU_API_CALL
+cluArenaAlloc(clu_arena arena,
+              size_t    size,
+              void**    out_host_ptr, /* may be NULL */
+              cl_int*   errcode_ret); /* may be NULL */
+
+/* make all the memory available again, once fence completes */
+/* sub-buffers are reused by the next allocations of the same sizes, in the same order */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluArenaReset(clu_arena arena,
+              cl_event  fence); /* may be NULL: the memory is no longer in use */
+
+/* bytes allocated since the last reset, including alignment padding */
+extern CLU_API_ENTRY size_t CLU_API_CALL
+cluArenaUsed(clu_arena arena);
+
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluReleaseArena(clu_arena arena);
+
 /* wait until /any/ event in the list becomes CL_COMPLETE */
 extern CLU_API_ENTRY cl_int CLU_API_CALL
 cluWaitOnAnyEvent(const cl_event* event_list,
                   cl_uint         num_events);
 
+/* wait until any event in the list completes, or the timeout (milliseconds, may be CLU_WAIT_INFINITE) expires */
+/* returns CLU_WAIT_TIMEOUT if no event completed in time */
+/* to wait repeatedly on many events, use a wait set instead */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluWaitOnAnyEventEx(const cl_event* event_list,
+                    cl_uint         num_events,
+                    cl_uint         timeout_ms,
+                    cl_uint*        out_index); /* may be NULL: index in event_list of an event that completed */
+
+/* wait until all events complete, polling their status before blocking */
+/* lower wake-up latency than clWaitForEvents for short commands, at the cost of cpu time */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluWait(const cl_event*        event_list,
+        cl_uint                num_events,
+        const clu_wait_policy* policy); /* may be NULL: adaptive */
+
+/* wait until all commands in the queue complete, like clFinish but with a wait policy */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluFinish(cl_command_queue       queue,   /* may be NULL: default queue */
+          const clu_wait_policy* policy); /* may be NULL: adaptive */
+
+/* wait sets: each event is added once, each wait reports the events that completed since the last wait */
+/* the set holds no reference to the events, the application must keep them alive until they complete */
+extern CLU_API_ENTRY clu_wait_set CLU_API_CALL
+cluCreateWaitSet(cl_int* errcode_ret); /* may be NULL */
+
+/* indices count up from 0 in the order events are added to the set */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluWaitSetAdd(clu_wait_set wait_set,
+              cl_event     event,
+              cl_uint*     out_index); /* may be NULL */
+
+/* wait until at least one event has completed, or the timeout (milliseconds, may be CLU_WAIT_INFINITE) expires */
+/* each completed event is reported once. events beyond max_indices are reported by the next wait */
+/* returns CLU_WAIT_TIMEOUT if no event completed in time */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluWaitSetWait(clu_wait_set wait_set,
+               cl_uint      timeout_ms,
+               cl_uint      max_indices,
+               cl_uint*     out_indices,      /* array of max_indices */
+               cl_uint*     out_num_indices); /* may be NULL */
+
+/* number of events added to the set that have not been reported yet */
+extern CLU_API_ENTRY cl_uint CLU_API_CALL
+cluWaitSetPending(clu_wait_set wait_set);
+
+/* the set is destroyed once the events still pending have completed */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluReleaseWaitSet(clu_wait_set wait_set);
+
+/* completion queues: events are registered with a tag, and their tags come out of the queue as they complete */
+/* any thread may add events. only one thread at a time may poll */
+/* capacity: maximum number of events registered and not yet polled, 0 = 4096 */
+extern CLU_API_ENTRY clu_completion_queue CLU_API_CALL
+cluCreateCompletionQueue(cl_uint capacity,
+                         cl_int* errcode_ret); /* may be NULL */
+
+/* returns CL_OUT_OF_RESOURCES if capacity events are already registered and not yet polled */
+/* the queue holds no reference to the event, the application must keep it alive until it completes */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluCompletionQueueAdd(clu_completion_queue queue,
+                      cl_event             event,
+                      void*                tag); /* may be NULL */
+
+/* wait until at least one registered event has completed, or the timeout (milliseconds, may be CLU_WAIT_INFINITE) expires */
+/* returns the tags of up to max_tags completed events, and CLU_WAIT_TIMEOUT if none completed in time */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluCompletionQueuePoll(clu_completion_queue queue,
+                       void**               out_tags,         /* array of max_tags */
+                       cl_int*              out_statuses,     /* may be NULL: array of max_tags, execution status of each event */
+                       cl_uint              max_tags,
+                       cl_uint              timeout_ms,
+                       cl_uint*             out_num_tags);    /* may be NULL */
+
+/* the queue is destroyed once the events still registered have completed */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluReleaseCompletionQueue(clu_completion_queue queue);
+
 /********************************************************************************************************/
 /* APIs INLINEd for performance                                                                         */
 /********************************************************************************************************/
@@ -326,6 +900,121 @@ extern CLU_API_ENTRY const clu_image_format* CLU_API_CALL
 cluGetSupportedImageFormats(cl_uint* array_size,
                             cl_int* errcode_ret); /* may be NULL */
 
+/********************************************************************************************************/
+/* Profiling: initialize with CLU_RUNTIME_PROFILING                                                     */
+/********************************************************************************************************/
+
+/* device execution time of a kernel, aggregated over every launch made through CLU */
+typedef struct
+{
+    char     kernel_name[CLU_UTIL_MAX_STRING_LENGTH];
+    cl_ulong count;     /* number of launches */
+    cl_ulong total_ns;  /* CL_PROFILING_COMMAND_END - CL_PROFILING_COMMAND_START, summed */
+    cl_ulong min_ns;
+    cl_ulong max_ns;
+    cl_ulong p50_ns;    /* percentiles of the most recent launches */
+    cl_ulong p99_ns;
+    cl_ulong queued_ns; /* CL_PROFILING_COMMAND_START - CL_PROFILING_COMMAND_QUEUED, summed */
+} clu_kernel_stats;
+
+/* return an array of statistics, one entry per kernel name */
+/* the array returned is internal to CLU, applications should not attempt to free/delete it */
+extern CLU_API_ENTRY const clu_kernel_stats* CLU_API_CALL
+cluGetKernelStats(cl_uint* array_size,
+                  cl_int*  errcode_ret); /* may be NULL */
+
+/* start collecting statistics again from zero */
+extern CLU_API_ENTRY void CLU_API_CALL
+cluResetKernelStats(void);
+
+/********************************************************************************************************/
+/* Tracing: initialize with CLU_RUNTIME_TRACING                                                         */
+/********************************************************************************************************/
+
+/* add a command enqueued by the application (e.g. a map or a copy) to the trace */
+/* the command queue must have been created with CL_QUEUE_PROFILING_ENABLE. the first command traced on */
+/* a queue clu has not launched on enqueues a marker after it, to line the device clock up with the host */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluTraceCommand(cl_event    event,
+                const char* name);
+
+/* write the trace recorded so far as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev) */
+/* host calls appear on one track per thread, device commands on one track per command queue */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluWriteTrace(const char* file_name);
+
+/********************************************************************************************************/
+/* Memory accounting: every cl_mem CLU creates, by tag                                                  */
+/********************************************************************************************************/
+
+/* memory objects created by CLU: aligned buffers and images, pools, arenas, file buffers, stream buffers */
+/* sub-buffers are not counted, their parent is */
+typedef struct
+{
+    size_t   live_bytes;
+    size_t   peak_bytes;
+    size_t   host_backed_bytes; /* live bytes in host memory (CL_MEM_USE_HOST_PTR or CL_MEM_ALLOC_HOST_PTR) */
+    cl_ulong live_objects;
+    size_t   soft_limit;        /* 0 = no limit */
+    cl_ulong limit_failures;    /* creations refused with CLU_MEMORY_LIMIT_EXCEEDED */
+} clu_memory_stats;
+
+/* objects are tagged with the tag set by cluSetMemoryTag on the creating thread, else the name of the CLU call */
+typedef struct
+{
+    char     tag[CLU_UTIL_MAX_STRING_LENGTH];
+    size_t   live_bytes;
+    size_t   peak_bytes;
+    cl_ulong created;
+    cl_ulong released;
+    cl_ulong lifetime_ns; /* summed over released objects */
+} clu_memory_tag_stats;
+
+/* return an array of statistics, one entry per tag, and fill in the totals */
+/* the array returned is internal to CLU, applications should not attempt to free/delete it */
+extern CLU_API_ENTRY const clu_memory_tag_stats* CLU_API_CALL
+cluGetMemoryStats(clu_memory_stats* out_totals,  /* may be NULL */
+                  cl_uint*          array_size,
+                  cl_int*           errcode_ret); /* may be NULL */
+
+/* tag the memory objects this thread creates through CLU from now on, e.g. with a subsystem name */
+/* NULL = tag with the name of the CLU call. a thread that set a tag must set NULL before it exits: */
+/* thread ids are reused, and a tag left behind would pass to a later thread */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluSetMemoryTag(const char* tag);
+
+/* refuse to create memory objects that would take live bytes past limit_bytes, 0 = no limit */
+/* objects already created are not affected, objects being created count against it. the limit stays set across cluRelease */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluSetMemorySoftLimit(size_t limit_bytes);
+
+/* bytes moved by cluMigrate and prefetch hints, per pair of devices. from/to NULL = the host */
+/* the first move of a buffer is counted from the host */
+typedef struct
+{
+    cl_device_id from;
+    cl_device_id to;
+    cl_ulong     migrations; /* buffers moved */
+    cl_ulong     bytes;
+} clu_migration_stats;
+
+/* return an array of statistics, one entry per pair of devices data moved between */
+/* the array returned is internal to CLU, applications should not attempt to free/delete it */
+/* reset by cluRelease */
+extern CLU_API_ENTRY const clu_migration_stats* CLU_API_CALL
+cluGetMigrationStats(cl_uint* array_size,
+                     cl_int*  errcode_ret); /* may be NULL */
+
+/********************************************************************************************************/
+/* Hooks: observe calls into CLU                                                                        */
+/********************************************************************************************************/
+
+/* register hooks called around every build, enqueue, buffer creation, wait and release */
+/* pass NULL to remove them. hooks stay registered across cluRelease */
+/* not thread safe: register before other threads call into CLU */
+extern CLU_API_ENTRY cl_int CLU_API_CALL
+cluSetHooks(const clu_hooks* hooks); /* may be NULL */
+
 /********************************************************************************************************/
 /* String Functions: convert enums/defines to char*                                                     */
 /********************************************************************************************************/
@@ -0,0 +1,256 @@
+/*
+Copyright (c) 2012, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/******************************************************************************/
+/* header-only C++ layer over clu.h                                          */
+/*                                                                            */
+/* clu::buffer<T> owns one aligned, zero-copy buffer of T. it is move-only:   */
+/* the buffer is released exactly once, when its owner goes out of scope.     */
+/* it converts to cl_mem without a retain, so it can be passed directly to    */
+/* generated kernel wrappers and to OpenCL calls.                             */
+/*                                                                            */
+/* errors are reported as in the C API: an optional cl_int* errcode_ret.      */
+/* a buffer that failed to create is empty (get() == 0).                      */
+/******************************************************************************/
+
+#ifndef __CLU_HPP
+#define __CLU_HPP
+
+#include "clu.h"
+#include <cstddef>
+
+namespace clu
+{
+
+//==============================================================================
+// mapped range of a buffer<T>, unmapped when it goes out of scope
+// behaves like a span: data(), size(), begin(), end(), operator[]
+//==============================================================================
+template <typename T>
+class mapped
+{
+public:
+    typedef T        value_type;
+    typedef T*       iterator;
+    typedef const T* const_iterator;
+
+    mapped() : m_queue(0), m_mem(0), m_ptr(0), m_count(0) {}
+
+    // map count elements starting at element offset, blocking
+    mapped(cl_command_queue in_queue, cl_mem in_mem, cl_map_flags in_flags,
+           size_t in_offset, size_t in_count, cl_int* out_pStatus = 0)
+        : m_queue(in_queue), m_mem(in_mem), m_ptr(0), m_count(0)
+    {
+        cl_int status = CL_SUCCESS;
+        m_ptr = (T*)cluEnqueueMapBuffer(m_queue, m_mem, CL_TRUE, in_flags,
+            in_offset * sizeof(T), in_count * sizeof(T), 0, 0, 0, &status);
+        if (m_ptr)
+        {
+            m_count = in_count;
+        }
+        if (out_pStatus)
+        {
+            *out_pStatus = status;
+        }
+    }
+
+    mapped(mapped&& in_other)
+        : m_queue(in_other.m_queue), m_mem(in_other.m_mem), m_ptr(in_other.m_ptr), m_count(in_other.m_count)
+    {
+        in_other.m_ptr = 0;
+        in_other.m_count = 0;
+    }
+
+    mapped& operator=(mapped&& in_other)
+    {
+        if (this != &in_other)
+        {
+            unmap();
+            m_queue = in_other.m_queue;
+            m_mem = in_other.m_mem;
+            m_ptr = in_other.m_ptr;
+            m_count = in_other.m_count;
+            in_other.m_ptr = 0;
+            in_other.m_count = 0;
+        }
+        return *this;
+    }
+
+    ~mapped() { unmap(); }
+
+    // unmap early. the range is empty afterwards
+    cl_int unmap()
+    {
+        cl_int status = CL_SUCCESS;
+        if (m_ptr)
+        {
+            status = cluEnqueueUnmapMemObject(m_queue, m_mem, m_ptr, 0, 0, 0);
+            m_ptr = 0;
+            m_count = 0;
+        }
+        return status;
+    }
+
+    T*       data()                       { return m_ptr; }
+    const T* data() const                 { return m_ptr; }
+    size_t   size() const                 { return m_count; }
+    bool     empty() const                { return 0 == m_count; }
+    T*       begin()                      { return m_ptr; }
+    T*       end()                        { return m_ptr + m_count; }
+    const T* begin() const                { return m_ptr; }
+    const T* end() const                  { return m_ptr + m_count; }
+    T&       operator[](size_t i)         { return m_ptr[i]; }
+    const T& operator[](size_t i) const   { return m_ptr[i]; }
+
+private:
+    mapped(const mapped&);            // not copyable: the range is unmapped once
+    mapped& operator=(const mapped&);
+
+    cl_command_queue m_queue;
+    cl_mem           m_mem;
+    T*               m_ptr;
+    size_t           m_count;
+};
+
+//==============================================================================
+// owns a buffer of count elements of T created with cluCreateAlignedBuffer
+//==============================================================================
+template <typename T>
+class buffer
+{
+public:
+    typedef T value_type;
+
+    buffer() : m_mem(0), m_pHost(0), m_count(0) {}
+
+    // flags as for cluCreateAlignedBuffer (0 = read/write)
+    explicit buffer(size_t in_count, cl_mem_flags in_flags = 0, cl_int* out_pStatus = 0)
+        : m_mem(0), m_pHost(0), m_count(0)
+    {
+        void* pHost = 0;
+        m_mem = cluCreateAlignedBuffer(in_flags, in_count * sizeof(T), &pHost, out_pStatus);
+        if (m_mem)
+        {
+            m_pHost = (T*)pHost;
+            m_count = in_count;
+        }
+    }
+
+    // create and fill from host memory, e.g. an array or a std::vector
+    buffer(const T* in_pSrc, size_t in_count, cl_mem_flags in_flags = 0, cl_int* out_pStatus = 0)
+        : m_mem(0), m_pHost(0), m_count(0)
+    {
+        buffer b(in_count, in_flags, out_pStatus);
+        if (b.m_mem)
+        {
+            for (size_t i = 0; i < in_count; i++)
+            {
+                b.m_pHost[i] = in_pSrc[i];
+            }
+        }
+        *this = static_cast<buffer&&>(b);
+    }
+
+    // take ownership of an existing buffer without retaining it
+    static buffer adopt(cl_mem in_mem, size_t in_count)
+    {
+        buffer b;
+        b.m_mem = in_mem;
+        b.m_count = in_count;
+        return b;
+    }
+
+    buffer(buffer&& in_other)
+        : m_mem(in_other.m_mem), m_pHost(in_other.m_pHost), m_count(in_other.m_count)
+    {
+        in_other.m_mem = 0;
+        in_other.m_pHost = 0;
+        in_other.m_count = 0;
+    }
+
+    buffer& operator=(buffer&& in_other)
+    {
+        if (this != &in_other)
+        {
+            reset();
+            m_mem = in_other.m_mem;
+            m_pHost = in_other.m_pHost;
+            m_count = in_other.m_count;
+            in_other.m_mem = 0;
+            in_other.m_pHost = 0;
+            in_other.m_count = 0;
+        }
+        return *this;
+    }
+
+    ~buffer() { reset(); }
+
+    // release the buffer now. the buffer is empty afterwards
+    void reset()
+    {
+        if (m_mem)
+        {
+            clReleaseMemObject(m_mem);
+        }
+        m_mem = 0;
+        m_pHost = 0;
+        m_count = 0;
+    }
+
+    // give up ownership without releasing, e.g. to hand the cl_mem to C code
+    cl_mem release()
+    {
+        cl_mem mem = m_mem;
+        m_mem = 0;
+        m_pHost = 0;
+        m_count = 0;
+        return mem;
+    }
+
+    // map elements [in_offset, in_offset + in_count), 0 = to the end. blocks until mapped.
+    // for aligned buffers the mapping is normally the host memory itself: no copy
+    mapped<T> map(cl_map_flags in_flags = CL_MAP_READ | CL_MAP_WRITE,
+                  size_t in_offset = 0, size_t in_count = 0,
+                  cl_command_queue in_queue = 0, /* 0 = default queue */
+                  cl_int* out_pStatus = 0) const
+    {
+        if (0 == in_count)
+        {
+            in_count = (in_offset < m_count) ? m_count - in_offset : 0;
+        }
+        return mapped<T>(in_queue, m_mem, in_flags, in_offset, in_count, out_pStatus);
+    }
+
+    // no retain: the buffer keeps ownership
+    const cl_mem& get() const   { return m_mem; }
+    operator cl_mem() const     { return m_mem; }
+
+    size_t size() const         { return m_count; }
+    size_t bytes() const        { return m_count * sizeof(T); }
+    bool   empty() const        { return 0 == m_count; }
+
+    // host memory backing the buffer, 0 for adopted buffers.
+    // only access it while mapped, or while no commands use the buffer
+    T*     host_ptr() const     { return m_pHost; }
+
+private:
+    buffer(const buffer&);            // not copyable: the buffer is released once
+    buffer& operator=(const buffer&);
+
+    cl_mem m_mem;
+    T*     m_pHost;
+    size_t m_count;
+};
+
+} // namespace clu
+
+#endif // __CLU_HPP
@@ -43,10 +43,23 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #include <assert.h>
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
 #include <malloc.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include <string.h> // gcc needs this for memset
 #include "clu.h"
@@ -69,6 +82,15 @@ void OCL_VALIDATE(cl_int in_status)
 // cpu, gpu, accelerator, custom
 #define CLU_MAX_NUM_DEVICES 4
 
+//==============================================================================
+// host timestamp in nanoseconds, for timing work as seen by the host
+//==============================================================================
+cl_ulong GetHostTimeNs()
+{
+    return (cl_ulong)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //==============================================================================
 // class to convert a cl_device_type to an index into internal array
 //==============================================================================
@@ -124,1110 +146,6312 @@ cl_device_id DeviceTypeToId::GetDevice(cl_device_type in_t)
 }
 
 //==============================================================================
-// class to maintain internal runtime state
+// class to release events in batches and count the event references clu holds
+// events handed to Recycle() are released once enough have collected
+// only references clu both takes and releases itself are counted; an event
+// the application hands back is counted on both sides (see Adopt)
 //==============================================================================
-class CLU_Runtime
+#define CLU_EVENT_RECYCLE_BATCH 64
+
+class EventRecycler
 {
 public:
-    static CLU_Runtime& Get() {return g_runtime;} // singleton pattern
-
-    // startup
-    cl_int       Initialize(const clu_initialize_params& in_params);
-
-    // manage the lifetime of an object
-    template<typename T> void AddObject(T o);
+    EventRecycler() : m_created(0), m_released(0) {}
+    void Created()                  {m_created++;}
+    void Adopt(cl_event in_event)   {m_created++; Recycle(in_event);} // from the application
+    void Recycle(cl_event in_event);
+    void Flush();
+    void GetStats(clu_event_stats& out_stats);
+private:
+    std::atomic<cl_ulong> m_created;
+    std::atomic<cl_ulong> m_released;
+    std::mutex            m_mutex;
+    std::vector<cl_event> m_pending;
+};
 
-    // common build function
-    cl_program   BuildProgram(cl_uint in_numSources,
-                              const char** in_sources, const size_t* in_source_lengths,
-                              const char* in_buildOptions, cl_int *out_pStatus);
-    cl_program   BuildProgram(cl_uint in_numBinaries,
-                              const size_t* in_binary_lengths, const unsigned char** in_binaries,
-                              const char* in_buildOptions, cl_int *out_pStatus);
-    const char*  GetBuildErrors(cl_program program);
+void EventRecycler::Recycle(cl_event in_event)
+{
+    std::vector<cl_event> batch;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(in_event);
+        if (m_pending.size() >= CLU_EVENT_RECYCLE_BATCH)
+        {
+            batch.reserve(CLU_EVENT_RECYCLE_BATCH);
+            batch.swap(m_pending);
+        }
+    }
+    // release outside the lock, other threads can keep recycling
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        clReleaseEvent(batch[i]);
+    }
+    m_released += batch.size();
+}
 
-    cl_platform_id GetPlatform()                 {return m_platform;}
-    cl_device_id GetDevice(cl_device_type in_clDeviceType);
-    cl_command_queue GetCommandQueue(cl_device_type in_clDeviceType, cl_int* out_status);
-    cl_context   GetContext()                    {return m_context;}
-    cl_bool      GetIsInitialized()              {if (m_isInitialized) return CL_TRUE; return CL_FALSE;}
-    const char*  GetBuildOptions()               {return m_buildOptions.c_str();}
+void EventRecycler::Flush()
+{
+    std::vector<cl_event> batch;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        batch.swap(m_pending);
+    }
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        clReleaseEvent(batch[i]);
+    }
+    m_released += batch.size();
+}
 
-    // max buffer alignment across all devices in context
-    cl_uint      GetBufferAlignment();
+void EventRecycler::GetStats(clu_event_stats& out_stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out_stats.created = m_created;
+    out_stats.released = m_released;
+    // the counters are read one after the other, while other threads recycle
+    out_stats.alive = (out_stats.created > out_stats.released) ? (out_stats.created - out_stats.released) : 0;
+    out_stats.pending_release = (cl_uint)m_pending.size();
+}
 
-    // used by code generator: build and has program on first call,
-    // subsequently return hashed program
-    // hashed programs always use default build options
-    cl_program   HashProgram(cl_uint in_numSources,
-                              const char** in_sources, const size_t* in_source_lengths,
-                              cl_int *out_pStatus);
+//==============================================================================
+// class to aggregate device execution times per kernel name
+// event callbacks add by name, under the lock, with the generation current when
+// the kernel was launched. Reset() starts a new generation, so callbacks still
+// pending from before it, e.g. on application queues, are ignored
+//==============================================================================
+#define CLU_PROFILE_SAMPLES 1024 // recent launches kept per kernel for percentiles
 
-    // return an array of image formats supported in a given CL context
-    const clu_image_format* GetImageFormats(cl_uint* out_pArraySize, cl_int* out_pStatus);
+class KernelProfiler
+{
+public:
+    struct Record
+    {
+        std::string           m_name;
+        cl_ulong              m_count;
+        cl_ulong              m_total;
+        cl_ulong              m_min;
+        cl_ulong              m_max;
+        cl_ulong              m_queued;
+        std::vector<cl_ulong> m_samples; // ring of recent execution times
+    };
 
-    void Reset(); // set everything to initial state, release all objects
+    KernelProfiler() : m_generation(1) {}
+    cl_ulong GetGeneration();
+    void    Add(const std::string& in_name, cl_ulong in_generation, const cl_ulong* in_times); // queued, submit, start, end
+    const clu_kernel_stats* GetStats(cl_uint* out_pArraySize);
+    void    Clear(); // zero the statistics
+    void    Reset(); // forget all kernels
 private:
-    CLU_Runtime();
-    ~CLU_Runtime();
+    std::mutex m_mutex;
+    cl_ulong   m_generation;
+    std::map<std::string, Record> m_records;
+    std::vector<clu_kernel_stats> m_stats; // returned by GetStats
+};
 
-    static CLU_Runtime g_runtime;
+cl_ulong KernelProfiler::GetGeneration()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
 
-    bool             m_isInitialized;
-    cl_platform_id   m_platform; // default platform
-    cl_context       m_context; // default context
-    cl_command_queue m_commandQueue[CLU_MAX_NUM_DEVICES];
-    cl_command_queue_properties m_queueProperties;
-    std::string      m_buildOptions;
-    cl_uint          m_bufferAlignment; // max buffer alignment across all devices in context
+void KernelProfiler::Add(const std::string& in_name, cl_ulong in_generation, const cl_ulong* in_times)
+{
+    cl_ulong executionTime = in_times[3] - in_times[2];
 
-    //---------------------------------------------------------------
-    // any object allocated by runtime is managed by the runtime
-    // Create a list of polymorphic objects:
-    class CLU_Object
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (in_generation != m_generation)
     {
-    public:
-        virtual ~CLU_Object() {}
-    };
-    typedef std::list<CLU_Object*> CluObjectList;
-    CluObjectList m_objects;
-    // Specific implementations of the object call CL Release methods:
-    template<typename T> class CLU_Specific : public CLU_Object
+        return; // launched before the last Reset()
+    }
+    std::map<std::string, Record>::iterator iter = m_records.find(in_name);
+    if (iter == m_records.end())
     {
-    protected:
-        T m_o;
-    public:
-        CLU_Specific(T o) : m_o(o) {}
-        virtual ~CLU_Specific() {assert(0);} // default destructor should never be called
-    };
-    //---------------------------------------------------------------
+        Record r;
+        r.m_name = in_name;
+        r.m_count = r.m_total = r.m_max = r.m_queued = 0;
+        r.m_min = ~(cl_ulong)0;
+        iter = m_records.insert(std::make_pair(r.m_name, r)).first;
+    }
+    Record& r = iter->second;
+    if (r.m_samples.size() < CLU_PROFILE_SAMPLES)
+    {
+        r.m_samples.push_back(executionTime);
+    }
+    else
+    {
+        r.m_samples[r.m_count % CLU_PROFILE_SAMPLES] = executionTime;
+    }
+    r.m_count++;
+    r.m_total += executionTime;
+    r.m_min = std::min(r.m_min, executionTime);
+    r.m_max = std::max(r.m_max, executionTime);
+    r.m_queued += in_times[2] - in_times[0];
+}
 
-    //---------------------------------------------------------------
-    // Devices and map of devices to device type
-    // support up to 4 queues (1 for each of 4 devices: cpu, gpu, accelerator, custom)
-    cl_uint          m_numDevices;
-    
-    // WARNING: do not try to access this array using cl_device_type as the index!
-    // it is filled in at context creation time
-    // it is used for building programs and returning build errors
-    cl_device_id     m_deviceIds[CLU_MAX_NUM_DEVICES];
+const clu_kernel_stats* KernelProfiler::GetStats(cl_uint* out_pArraySize)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.resize(0);
+    for (std::map<std::string, Record>::const_iterator i = m_records.begin(); i != m_records.end(); i++)
+    {
+        const Record& r = i->second;
+        if (0 == r.m_count)
+        {
+            continue;
+        }
+        clu_kernel_stats k;
+        memset(&k, 0, sizeof(k));
+        strncpy(k.kernel_name, r.m_name.c_str(), CLU_UTIL_MAX_STRING_LENGTH-1);
+        k.count = r.m_count;
+        k.total_ns = r.m_total;
+        k.min_ns = r.m_min;
+        k.max_ns = r.m_max;
+        k.queued_ns = r.m_queued;
+
+        std::vector<cl_ulong> sorted(r.m_samples);
+        std::sort(sorted.begin(), sorted.end());
+        k.p50_ns = sorted[(sorted.size() - 1) / 2];
+        k.p99_ns = sorted[((sorted.size() - 1) * 99) / 100];
+        m_stats.push_back(k);
+    }
+    *out_pArraySize = (cl_uint)m_stats.size();
+    return m_stats.size() ? &m_stats[0] : 0;
+}
 
-    DeviceTypeToId   m_device_type_to_id;
-    //---------------------------------------------------------------
+void KernelProfiler::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::map<std::string, Record>::iterator i = m_records.begin(); i != m_records.end(); i++)
+    {
+        Record& r = i->second;
+        r.m_count = r.m_total = r.m_max = r.m_queued = 0;
+        r.m_min = ~(cl_ulong)0;
+        r.m_samples.clear();
+    }
+}
 
-    // storage for objects created by generated code
-    std::map<const void* const, cl_program> m_programMap;
+void KernelProfiler::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    m_records.clear();
+    m_stats.clear();
+}
 
-    // storage for image format query results from cluGetSupportedImageFormats
-    std::vector<clu_image_format> m_imageFormats;
+// observers of api calls, see ApiScope
+#define CLU_OBSERVE_TRACE 1
+#define CLU_OBSERVE_HOOKS 2
 
-    // build log string from GetBuildErrors
-    std::string m_buildString;
+//==============================================================================
+// class to record a timeline of host calls and device commands
+// device timestamps are kept raw and moved to the host timebase when written:
+// a command's QUEUED time is taken while the host is inside the enqueue call,
+// so (host time before the call - QUEUED) bounds the clock offset from below.
+// the largest bound seen on each queue is the best estimate. queues that only
+// carry commands enqueued by the application get a marker to take the bound from;
+// spans of queues still without one are left out of the trace.
+//==============================================================================
+class Tracer
+{
+public:
+    Tracer() : m_enabled(false), m_origin(0) {}
+    bool   IsEnabled()                           {return m_enabled;}
+    void   Start();
+    void   AddHostSpan(const char* in_name, cl_ulong in_start, cl_ulong in_end);
+    // in_hostSubmit: host time just before the enqueue, 0 if unknown
+    void   AddDeviceSpan(const std::string& in_name, cl_command_queue in_queue,
+                         cl_ulong in_hostSubmit, const cl_ulong* in_times); // queued, submit, start, end
+    // in_hostSubmit: host time just before the marker was enqueued, 0 if the sample failed
+    void   AddClockSample(cl_command_queue in_queue, cl_ulong in_hostSubmit, cl_ulong in_queued);
+    bool   NeedsClockSample(cl_command_queue in_queue); // no offset yet and no sample in flight
+    cl_int Write(const char* in_fileName);
+    void   Reset();
+private:
+    struct Span
+    {
+        std::string      m_name;
+        cl_command_queue m_queue; // 0 for host spans
+        int              m_track;
+        cl_ulong         m_queued;
+        cl_ulong         m_start;
+        cl_ulong         m_end;
+    };
+    struct QueueTrack
+    {
+        int         m_track;
+        bool        m_hasOffset;
+        bool        m_sampling; // a clock sample is in flight
+        cl_long     m_offset;   // host time - device time
+        std::string m_name;
+    };
+    QueueTrack& GetTrack(cl_command_queue in_queue); // call with m_mutex held
+    void        AddOffset(QueueTrack& in_track, cl_ulong in_hostSubmit, cl_ulong in_queued);
+
+    std::atomic<bool> m_enabled; // read from event callbacks
+    cl_ulong   m_origin; // host time when tracing started
+    std::mutex m_mutex;
+    std::vector<Span> m_spans;
+    std::map<std::thread::id, int> m_threads;
+    std::map<cl_command_queue, QueueTrack> m_queues;
 };
 
-//-----------------------------------------------------------------------------
-// global object
-//-----------------------------------------------------------------------------
-CLU_Runtime CLU_Runtime::g_runtime;
-
-//-----------------------------------------------------------------------------
-// overloaded template definitions for the virtual destructors for
-// all the kinds of things that the runtime might hold internal references to:
-//-----------------------------------------------------------------------------
-template<> CLU_Runtime::CLU_Specific<cl_context>::~CLU_Specific()       {clReleaseContext(m_o);}
-template<> CLU_Runtime::CLU_Specific<cl_command_queue>::~CLU_Specific() {clReleaseCommandQueue(m_o);}
-template<> CLU_Runtime::CLU_Specific<cl_program>::~CLU_Specific()       {clReleaseProgram(m_o);}
+void SetApiObserver(unsigned in_observer, bool in_enable);
 
-//-----------------------------------------------------------------------------
-// add an object to the internal collection of objects
-//-----------------------------------------------------------------------------
-template<typename T> void CLU_Runtime::AddObject(T t)
+void Tracer::Start()
 {
-    CLU_Object* p = new CLU_Specific<T>(t);
-    m_objects.push_front(p);
+    m_origin = GetHostTimeNs();
+    m_enabled = true;
+    SetApiObserver(CLU_OBSERVE_TRACE, true);
 }
 
-//-----------------------------------------------------------------------------
-// set everything to initial state, release all objects
-//-----------------------------------------------------------------------------
-void CLU_Runtime::Reset()
+void Tracer::AddHostSpan(const char* in_name, cl_ulong in_start, cl_ulong in_end)
 {
-    m_platform=0;
-    m_context=0;
-    m_numDevices=0;
-    m_queueProperties = 0;
-    m_bufferAlignment = 0;
-    m_buildOptions.clear();
-    memset(m_commandQueue, 0, sizeof(m_commandQueue));
-    memset(m_deviceIds, 0, sizeof(m_deviceIds));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::thread::id thread = std::this_thread::get_id();
+    std::map<std::thread::id, int>::iterator iter = m_threads.find(thread);
+    if (iter == m_threads.end())
+    {
+        iter = m_threads.insert(std::make_pair(thread, (int)m_threads.size())).first;
+    }
+    Span span = {in_name, 0, iter->second, in_start, in_start, in_end};
+    m_spans.push_back(span);
+}
 
-    for (CluObjectList::iterator i = m_objects.begin(); i != m_objects.end(); i++)
+Tracer::QueueTrack& Tracer::GetTrack(cl_command_queue in_queue)
+{
+    std::map<cl_command_queue, QueueTrack>::iterator iter = m_queues.find(in_queue);
+    if (iter == m_queues.end())
     {
-        CLU_Object* p = *i;
-        delete(p);
+        // name the track now, the queue may be gone by the time the trace is written
+        QueueTrack t = {(int)m_queues.size(), false, false, 0, ""};
+        cl_device_id device = 0;
+        char deviceName[CLU_UTIL_MAX_STRING_LENGTH] = {0};
+        clGetCommandQueueInfo(in_queue, CL_QUEUE_DEVICE, sizeof(device), &device, 0);
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName)-1, deviceName, 0);
+        std::ostringstream name;
+        name << deviceName << " queue " << t.m_track;
+        t.m_name = name.str();
+        iter = m_queues.insert(std::make_pair(in_queue, t)).first;
     }
+    return iter->second;
+}
 
-    m_objects.clear();
-    m_programMap.clear();
-    m_imageFormats.clear();
-    m_buildString.clear();
+void Tracer::AddOffset(QueueTrack& in_track, cl_ulong in_hostSubmit, cl_ulong in_queued)
+{
+    cl_long offset = (cl_long)(in_hostSubmit - in_queued);
+    if ((!in_track.m_hasOffset) || (offset > in_track.m_offset))
+    {
+        in_track.m_offset = offset;
+        in_track.m_hasOffset = true;
+    }
+}
 
-    m_isInitialized = false;
+bool Tracer::NeedsClockSample(cl_command_queue in_queue)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    QueueTrack& t = GetTrack(in_queue);
+    if (t.m_hasOffset || t.m_sampling)
+    {
+        return false;
+    }
+    t.m_sampling = true;
+    return true;
 }
 
-//-----------------------------------------------------------------------------
-// constructor
-//-----------------------------------------------------------------------------
-CLU_Runtime::CLU_Runtime()
+void Tracer::AddClockSample(cl_command_queue in_queue, cl_ulong in_hostSubmit, cl_ulong in_queued)
 {
-    //_CrtSetBreakAlloc(237); // set this to # of leaked allocation
-    Reset();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    QueueTrack& t = GetTrack(in_queue);
+    t.m_sampling = false;
+    if (in_hostSubmit)
+    {
+        AddOffset(t, in_hostSubmit, in_queued);
+    }
 }
 
-//-----------------------------------------------------------------------------
-// shutdown clu. Release all internal objects
-//-----------------------------------------------------------------------------
-CLU_Runtime::~CLU_Runtime()
+void Tracer::AddDeviceSpan(const std::string& in_name, cl_command_queue in_queue,
+    cl_ulong in_hostSubmit, const cl_ulong* in_times)
 {
-    Reset();
-#if CLU_DETECT_MEMORY_LEAKS
-    _CrtDumpMemoryLeaks();
-#endif
+    std::lock_guard<std::mutex> lock(m_mutex);
+    QueueTrack& t = GetTrack(in_queue);
+    if (in_hostSubmit)
+    {
+        AddOffset(t, in_hostSubmit, in_times[0]);
+    }
+    Span span = {in_name, in_queue, t.m_track, in_times[0], in_times[2], in_times[3]};
+    m_spans.push_back(span);
 }
 
-//-----------------------------------------------------------------------------
-// internal method to return default platform
-// find the first platform that supports the requested device type(s)
-//-----------------------------------------------------------------------------
-cl_platform_id GetPlatformDefault(
-    int in_numPlatforms, const cl_platform_id* in_platforms,
-    cl_device_type in_device_type)
+// names are kernel and api names, but applications can add their own
+void WriteJsonString(std::ostream& out, const std::string& in_string)
 {
-    int i = 0;
-    for (; i < in_numPlatforms; i++)
+    out << '"';
+    for (size_t i = 0; i < in_string.size(); i++)
     {
-        cl_device_id unused = 0;
-        cl_uint numDevicesFound = 0;
-        clGetDeviceIDs(in_platforms[i], in_device_type, 1, &unused, &numDevicesFound);
-        if (0 != numDevicesFound)
+        char c = in_string[i];
+        if (('"' == c) || ('\\' == c))
         {
-            break; // found platform with requested device type
+            out << '\\' << c;
+        }
+        else if ((unsigned char)c >= ' ')
+        {
+            out << c;
         }
     }
-    cl_platform_id platformId = 0;
-    if (i < in_numPlatforms)
-    {
-        platformId = in_platforms[i];
-    }
-    return platformId;
+    out << '"';
 }
 
-//-----------------------------------------------------------------------------
-// internal method to get a platform by vendor name string
-// CASE INSENSITIVE
-//-----------------------------------------------------------------------------
-cl_platform_id GetPlatformByVendor(cl_uint in_numPlatforms, const cl_platform_id* in_platforms,
-    const char* in_vendorName, cl_device_type in_device_type, cl_int* out_pStatus)
+cl_int Tracer::Write(const char* in_fileName)
 {
-    const int BUFSIZE = 1024;
-    char pBuf[BUFSIZE];
-    cl_platform_id platform = 0;
-    std::string vendorName(in_vendorName);
-    std::transform(vendorName.begin(), vendorName.end(), vendorName.begin(), ::tolower);
-
-    cl_uint i = 0;
-    for (; i < in_numPlatforms; ++i)
+    std::ofstream out(in_fileName);
+    if (!out)
     {
-        cl_int status = clGetPlatformInfo(in_platforms[i], CL_PLATFORM_VENDOR, BUFSIZE, pBuf, 0);
-        OCL_VALIDATE(status);
-        *out_pStatus = status;
+        return CL_INVALID_VALUE;
+    }
 
-        if (CL_SUCCESS == status)
-        {
-            std::string platformVendor(pBuf);
-            std::transform(platformVendor.begin(), platformVendor.end(), platformVendor.begin(), ::tolower);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out.setf(std::ios::fixed);
+    out.precision(3); // microseconds, to the nanosecond
+
+    // chrome trace: pid 1 is the host, pid 2 the devices. tid is the track.
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"host\"}},\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"command queues\"}}";
+    for (std::map<std::thread::id, int>::const_iterator i = m_threads.begin(); i != m_threads.end(); i++)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i->second
+            << ",\"args\":{\"name\":\"thread " << i->second << "\"}}";
+    }
+    for (std::map<cl_command_queue, QueueTrack>::const_iterator i = m_queues.begin(); i != m_queues.end(); i++)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":" << i->second.m_track
+            << ",\"args\":{\"name\":";
+        WriteJsonString(out, i->second.m_name);
+        out << "}}";
+    }
+
+    for (size_t i = 0; i < m_spans.size(); i++)
+    {
+        const Span& span = m_spans[i];
+        cl_long offset = 0;
+        if (span.m_queue)
+        {
+            const QueueTrack& t = m_queues[span.m_queue];
+            if (!t.m_hasOffset)
+            {
+                continue; // device time only, it cannot be placed on the timeline
+            }
+            offset = t.m_offset;
+        }
+        double start = (double)(cl_long)(span.m_start + offset - m_origin) / 1000.0;
+        double duration = (double)(span.m_end - span.m_start) / 1000.0;
+        out << ",\n{\"name\":";
+        WriteJsonString(out, span.m_name);
+        out << ",\"cat\":\"" << (span.m_queue ? "device" : "host")
+            << "\",\"ph\":\"X\",\"pid\":" << (span.m_queue ? 2 : 1) << ",\"tid\":" << span.m_track
+            << ",\"ts\":" << start << ",\"dur\":" << duration;
+        if (span.m_queue)
+        {
+            out << ",\"args\":{\"queued_us\":" << (double)(span.m_start - span.m_queued) / 1000.0 << "}";
+        }
+        out << "}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    return out ? CL_SUCCESS : CL_INVALID_VALUE;
+}
+
+void Tracer::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SetApiObserver(CLU_OBSERVE_TRACE, false);
+    m_enabled = false;
+    m_spans.clear();
+    m_threads.clear();
+    m_queues.clear();
+}
+
+//==============================================================================
+// bounded lock-free ring, any number of producers and a single consumer
+// each cell carries a sequence number: producers claim a position with a CAS
+// and publish the cell by advancing its sequence; the consumer reads cells in order.
+// (D. Vyukov's bounded queue, with the consumer side simplified for one thread)
+//==============================================================================
+template<typename T> class MpscRing
+{
+public:
+    MpscRing(size_t in_capacity); // rounded up to a power of 2
+    bool Push(const T& in_value); // false if full
+    bool Pop(T& out_value);       // false if empty. single consumer only
+private:
+    struct Cell
+    {
+        std::atomic<size_t> m_sequence;
+        T                   m_value;
+    };
+    std::vector<Cell>   m_cells;
+    size_t              m_mask;
+    std::atomic<size_t> m_pushPosition;
+    size_t              m_popPosition; // only touched by the consumer
+};
+
+template<typename T> MpscRing<T>::MpscRing(size_t in_capacity) : m_pushPosition(0), m_popPosition(0)
+{
+    size_t capacity = 2;
+    while (capacity < in_capacity)
+    {
+        capacity *= 2;
+    }
+    m_cells = std::vector<Cell>(capacity);
+    for (size_t i = 0; i < capacity; i++)
+    {
+        m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+    }
+    m_mask = capacity - 1;
+}
+
+template<typename T> bool MpscRing<T>::Push(const T& in_value)
+{
+    size_t position = m_pushPosition.load(std::memory_order_relaxed);
+    Cell* pCell = 0;
+    for (;;)
+    {
+        pCell = &m_cells[position & m_mask];
+        size_t sequence = pCell->m_sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)position;
+        if (0 == diff)
+        {
+            if (m_pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false; // the consumer has not freed this cell yet
+        }
+        else
+        {
+            position = m_pushPosition.load(std::memory_order_relaxed);
+        }
+    }
+    pCell->m_value = in_value;
+    pCell->m_sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T> bool MpscRing<T>::Pop(T& out_value)
+{
+    Cell& cell = m_cells[m_popPosition & m_mask];
+    size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+    if (sequence != m_popPosition + 1)
+    {
+        return false; // not published yet
+    }
+    out_value = cell.m_value;
+    cell.m_sequence.store(m_popPosition + m_mask + 1, std::memory_order_release);
+    m_popPosition++;
+    return true;
+}
+
+//==============================================================================
+// class to choose how long cluWait polls before blocking
+// tracks the average time waits took to complete; polling for about twice that
+// catches most completions without sleeping. once that would pass the cap,
+// commands are long and waits block at once: spinning would only burn cpu
+//==============================================================================
+#define CLU_WAIT_MAX_SPIN_NS     100000 // 100us
+#define CLU_WAIT_INITIAL_SPIN_NS 20000
+
+class WaitTuner
+{
+public:
+    WaitTuner() : m_averageNs(CLU_WAIT_INITIAL_SPIN_NS / 2) {}
+    cl_ulong GetSpinNs()
+    {
+        cl_ulong spinNs = 2 * m_averageNs.load(std::memory_order_relaxed);
+        return (spinNs > CLU_WAIT_MAX_SPIN_NS) ? 0 : spinNs;
+    }
+    void     Add(cl_ulong in_waitNs)
+    {
+        // exponential moving average, weight 1/8. concurrent updates may be lost, that's ok
+        // long waits count as twice the cap: enough to stop spinning, few short waits to resume
+        cl_ulong waitNs = std::min(in_waitNs, (cl_ulong)(2 * CLU_WAIT_MAX_SPIN_NS));
+        cl_ulong average = m_averageNs.load(std::memory_order_relaxed);
+        m_averageNs.store(average - average / 8 + waitNs / 8, std::memory_order_relaxed);
+    }
+    void     Reset() {m_averageNs = CLU_WAIT_INITIAL_SPIN_NS / 2;}
+private:
+    std::atomic<cl_ulong> m_averageNs;
+};
+
+//==============================================================================
+// class to allocate the host memory of aligned buffers
+// keeps a record of each allocation, so it can be freed the way it was made
+// and reported by cluGetHostMemoryInfo
+//==============================================================================
+#define CLU_HUGE_PAGE_SIZE (2*1024*1024)
+
+class HostAllocator
+{
+public:
+    struct Allocation
+    {
+        void*   m_ptr;
+        size_t  m_size;
+        cl_uint m_backing; // CLU_HOST_MEMORY_*
+    };
+    Allocation* Allocate(size_t in_size, size_t in_alignment, bool in_hugePages); // 0 if out of memory
+    void        Free(Allocation* in_pAllocation);
+    bool        Find(void* in_ptr, Allocation& out_allocation);
+private:
+    std::mutex m_mutex;
+    std::map<void*, Allocation*> m_allocations;
+};
+
+HostAllocator::Allocation* HostAllocator::Allocate(size_t in_size, size_t in_alignment, bool in_hugePages)
+{
+    Allocation* pAllocation = new Allocation;
+    pAllocation->m_ptr = 0;
+    pAllocation->m_size = in_size;
+    pAllocation->m_backing = CLU_HOST_MEMORY_DEFAULT;
+
+#ifdef __linux__
+    // smaller allocations would waste most of a huge page
+    if (in_hugePages && (in_size >= CLU_HUGE_PAGE_SIZE / 2) && (in_alignment <= CLU_HUGE_PAGE_SIZE))
+    {
+        size_t size = (in_size + CLU_HUGE_PAGE_SIZE - 1) & ~(size_t)(CLU_HUGE_PAGE_SIZE - 1);
+
+        // pages reserved by the administrator (vm.nr_hugepages). fails if not enough are free
+        void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED != p)
+        {
+            pAllocation->m_ptr = p;
+            pAllocation->m_size = size;
+            pAllocation->m_backing = CLU_HOST_MEMORY_HUGETLB;
+        }
+        // otherwise transparent huge pages: fails if the kernel does not support them
+        else if (0 == posix_memalign(&p, CLU_HUGE_PAGE_SIZE, size))
+        {
+            pAllocation->m_ptr = p;
+            pAllocation->m_size = size;
+            if (0 == madvise(p, size, MADV_HUGEPAGE))
+            {
+                pAllocation->m_backing = CLU_HOST_MEMORY_TRANSPARENT_HUGE_PAGES;
+            }
+        }
+    }
+#else
+    in_hugePages = false; // unused, remove compiler warning
+#endif
+
+    if (0 == pAllocation->m_ptr)
+    {
+#if defined _WIN32
+        pAllocation->m_ptr = _aligned_malloc(in_size, in_alignment);
+#elif defined __linux__
+        pAllocation->m_ptr = memalign(in_alignment, in_size);
+#elif defined __MACH__
+        pAllocation->m_ptr = malloc(in_size);
+#else
+        pAllocation->m_ptr = valloc(in_size);
+#endif
+    }
+
+    if (0 == pAllocation->m_ptr)
+    {
+        delete pAllocation;
+        return 0;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_allocations[pAllocation->m_ptr] = pAllocation;
+    }
+    catch (...) // still usable, just cannot be described by cluGetHostMemoryInfo
+    {
+    }
+    return pAllocation;
+}
+
+void HostAllocator::Free(Allocation* in_pAllocation)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_allocations.erase(in_pAllocation->m_ptr);
+    }
+#ifdef __linux__
+    if (CLU_HOST_MEMORY_HUGETLB == in_pAllocation->m_backing)
+    {
+        munmap(in_pAllocation->m_ptr, in_pAllocation->m_size);
+    }
+    else
+#endif
+    {
+#if defined _WIN32
+        _aligned_free(in_pAllocation->m_ptr);
+#else
+        free(in_pAllocation->m_ptr);
+#endif
+    }
+    delete in_pAllocation;
+}
+
+bool HostAllocator::Find(void* in_ptr, Allocation& out_allocation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<void*, Allocation*>::const_iterator iter = m_allocations.find(in_ptr);
+    if (iter == m_allocations.end())
+    {
+        return false;
+    }
+    out_allocation = *iter->second;
+    return true;
+}
+
+//==============================================================================
+// class to keep the counters and warnings of CLU_RUNTIME_ZERO_COPY_CHECKS
+// each buffer is warned about once, the counters keep counting.
+// a buffer is forgotten by its destructor callback, its handle may be reused
+//==============================================================================
+class ZeroCopyChecker
+{
+public:
+    ZeroCopyChecker() {Reset();}
+    void  AddBufferCheck(cl_mem in_buffer, const char* in_pReason); // in_pReason: 0 if zero-copy
+    void  AddMap(cl_mem in_buffer, void* in_pMapped, size_t in_size, cl_map_flags in_flags, bool in_copied);
+    void  RemoveMap(void* in_pMapped); // counts the bytes copied back on unmap
+    void  Forget(cl_mem in_buffer);
+    void  GetStats(clu_zero_copy_stats& out_stats);
+    void  Reset();
+private:
+    void  Warn(cl_mem in_buffer, const std::string& in_message);
+
+    struct Mapping
+    {
+        size_t m_size;
+        bool   m_copyBack; // copied, and mapped for writing
+    };
+    std::mutex                m_mutex;
+    clu_zero_copy_stats       m_stats;
+    std::map<void*, Mapping>  m_mappings; // by mapped pointer
+    std::set<cl_mem>          m_warned;
+};
+
+void CL_CALLBACK CLU_ForgetZeroCopyWarningCallback(cl_mem in_mem, void* in_data);
+
+void ZeroCopyChecker::Warn(cl_mem in_buffer, const std::string& in_message)
+{
+    if (m_warned.insert(in_buffer).second)
+    {
+        clSetMemObjectDestructorCallback(in_buffer, CLU_ForgetZeroCopyWarningCallback, 0);
+        std::cerr << "clu: zero-copy: buffer " << in_buffer << ": " << in_message << std::endl;
+    }
+}
+
+void ZeroCopyChecker::Forget(cl_mem in_buffer)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_warned.erase(in_buffer);
+}
+
+void ZeroCopyChecker::AddBufferCheck(cl_mem in_buffer, const char* in_pReason)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.buffers_checked++;
+    if (in_pReason)
+    {
+        m_stats.buffers_copied++;
+        Warn(in_buffer, in_pReason);
+    }
+}
+
+void ZeroCopyChecker::AddMap(cl_mem in_buffer, void* in_pMapped, size_t in_size, cl_map_flags in_flags, bool in_copied)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.maps++;
+    if (in_copied)
+    {
+        m_stats.maps_copied++;
+        if (0 == (in_flags & CL_MAP_WRITE_INVALIDATE_REGION))
+        {
+            m_stats.bytes_copied += in_size;
+        }
+        Mapping mapping = {in_size, 0 != (in_flags & (CL_MAP_WRITE | CL_MAP_WRITE_INVALIDATE_REGION))};
+        m_mappings[in_pMapped] = mapping;
+        std::ostringstream message;
+        message << "map returned a copy of " << in_size << " bytes instead of the buffer's host memory";
+        Warn(in_buffer, message.str());
+    }
+}
+
+void ZeroCopyChecker::RemoveMap(void* in_pMapped)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<void*, Mapping>::iterator iter = m_mappings.find(in_pMapped);
+    if (iter != m_mappings.end())
+    {
+        if (iter->second.m_copyBack)
+        {
+            m_stats.bytes_copied += iter->second.m_size;
+        }
+        m_mappings.erase(iter);
+    }
+}
+
+void ZeroCopyChecker::GetStats(clu_zero_copy_stats& out_stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out_stats = m_stats;
+}
+
+void ZeroCopyChecker::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_mappings.clear();
+    m_warned.clear();
+}
+
+//==============================================================================
+// class to account for every cl_mem clu creates
+// each object carries a record, handed back by its destructor callback.
+// not reset: objects may outlive cluRelease
+//==============================================================================
+class MemoryTracker
+{
+public:
+    MemoryTracker();
+    bool  WithinLimit(size_t in_size); // reserves in_size bytes. false (and counted) if they would exceed the soft limit
+    void  Unreserve(size_t in_size);   // bytes reserved for an object that was not created
+    void  Add(cl_mem in_mem, size_t in_size, cl_mem_flags in_flags, const char* in_pSite); // takes over the reservation
+    void  SetThreadTag(const char* in_pTag); // 0 = none. threads must clear their tag before they exit
+    void  SetSoftLimit(size_t in_limit);
+    const clu_memory_tag_stats* GetStats(clu_memory_stats* out_pTotals, cl_uint* out_pArraySize);
+
+    struct TagStats
+    {
+        size_t   m_liveBytes;
+        size_t   m_peakBytes;
+        cl_ulong m_created;
+        cl_ulong m_released;
+        cl_ulong m_lifetimeNs;
+    };
+    struct Record
+    {
+        TagStats* m_pTag; // map entries never move
+        size_t    m_size;
+        bool      m_hostBacked;
+        cl_ulong  m_created;
+    };
+    void  Remove(Record* in_pRecord);
+private:
+    std::mutex                             m_mutex;
+    std::map<std::string, TagStats>        m_tags;
+    std::map<std::thread::id, std::string> m_threadTags; // ids are reused, a tag left behind would pass to a later thread
+    std::vector<clu_memory_tag_stats>      m_stats; // returned by GetStats
+    clu_memory_stats                       m_totals;
+    size_t                                 m_reservedBytes; // passed WithinLimit, not created yet
+};
+
+void CL_CALLBACK CLU_UntrackMemObjectCallback(cl_mem in_mem, void* in_pRecord);
+
+MemoryTracker::MemoryTracker()
+{
+    memset(&m_totals, 0, sizeof(m_totals));
+    m_reservedBytes = 0;
+}
+
+// reserved, so concurrent creations cannot all pass the check before any of them is added
+bool MemoryTracker::WithinLimit(size_t in_size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_totals.soft_limit && (m_totals.live_bytes + m_reservedBytes + in_size > m_totals.soft_limit))
+    {
+        m_totals.limit_failures++;
+        return false;
+    }
+    m_reservedBytes += in_size;
+    return true;
+}
+
+void MemoryTracker::Unreserve(size_t in_size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_reservedBytes -= std::min(in_size, m_reservedBytes);
+}
+
+void MemoryTracker::Add(cl_mem in_mem, size_t in_size, cl_mem_flags in_flags, const char* in_pSite)
+{
+    Record* pRecord = 0;
+    try
+    {
+        pRecord = new Record;
+    }
+    catch (...)
+    {
+        Unreserve(in_size); // the object is not tracked
+        throw;
+    }
+    pRecord->m_size = in_size;
+    pRecord->m_hostBacked = 0 != (in_flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR));
+    pRecord->m_created = GetHostTimeNs();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reservedBytes -= std::min(in_size, m_reservedBytes);
+        std::map<std::thread::id, std::string>::const_iterator threadTag = m_threadTags.find(std::this_thread::get_id());
+        TagStats& tag = m_tags[(threadTag != m_threadTags.end()) ? threadTag->second : std::string(in_pSite)];
+        tag.m_liveBytes += in_size;
+        tag.m_peakBytes = std::max(tag.m_peakBytes, tag.m_liveBytes);
+        tag.m_created++;
+        pRecord->m_pTag = &tag;
+
+        m_totals.live_bytes += in_size;
+        m_totals.peak_bytes = std::max(m_totals.peak_bytes, m_totals.live_bytes);
+        m_totals.live_objects++;
+        if (pRecord->m_hostBacked)
+        {
+            m_totals.host_backed_bytes += in_size;
+        }
+    }
+    if (CL_SUCCESS != clSetMemObjectDestructorCallback(in_mem, CLU_UntrackMemObjectCallback, pRecord))
+    {
+        Remove(pRecord);
+    }
+}
+
+void MemoryTracker::Remove(Record* in_pRecord)
+{
+    cl_ulong lifetime = GetHostTimeNs() - in_pRecord->m_created;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        TagStats& tag = *in_pRecord->m_pTag;
+        tag.m_liveBytes -= in_pRecord->m_size;
+        tag.m_released++;
+        tag.m_lifetimeNs += lifetime;
+
+        m_totals.live_bytes -= in_pRecord->m_size;
+        m_totals.live_objects--;
+        if (in_pRecord->m_hostBacked)
+        {
+            m_totals.host_backed_bytes -= in_pRecord->m_size;
+        }
+    }
+    delete in_pRecord;
+}
+
+void MemoryTracker::SetThreadTag(const char* in_pTag)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (in_pTag)
+    {
+        m_threadTags[std::this_thread::get_id()] = in_pTag;
+    }
+    else
+    {
+        m_threadTags.erase(std::this_thread::get_id());
+    }
+}
+
+void MemoryTracker::SetSoftLimit(size_t in_limit)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_totals.soft_limit = in_limit;
+}
+
+const clu_memory_tag_stats* MemoryTracker::GetStats(clu_memory_stats* out_pTotals, cl_uint* out_pArraySize)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.resize(0);
+    for (std::map<std::string, TagStats>::const_iterator i = m_tags.begin(); i != m_tags.end(); i++)
+    {
+        clu_memory_tag_stats t;
+        memset(&t, 0, sizeof(t));
+        strncpy(t.tag, i->first.c_str(), CLU_UTIL_MAX_STRING_LENGTH-1);
+        t.live_bytes = i->second.m_liveBytes;
+        t.peak_bytes = i->second.m_peakBytes;
+        t.created = i->second.m_created;
+        t.released = i->second.m_released;
+        t.lifetime_ns = i->second.m_lifetimeNs;
+        m_stats.push_back(t);
+    }
+    if (out_pTotals)
+    {
+        *out_pTotals = m_totals;
+    }
+    *out_pArraySize = (cl_uint)m_stats.size();
+    return m_stats.empty() ? 0 : &m_stats[0];
+}
+
+//==============================================================================
+// class to count the bytes cluMigrate moves between devices
+// remembers where each migrated buffer was last moved to. the host is device 0
+//==============================================================================
+class MigrationTracker
+{
+public:
+    void  NoteMigration(cl_mem in_mem, cl_device_id in_to, bool in_contentsMoved);
+    void  Forget(cl_mem in_mem); // the buffer is being destroyed
+    const clu_migration_stats* GetStats(cl_uint* out_pArraySize);
+    void  Reset();
+private:
+    typedef std::pair<cl_device_id, cl_device_id> DevicePair;
+    std::mutex                                 m_mutex;
+    std::map<cl_mem, cl_device_id>             m_residency;
+    std::map<DevicePair, clu_migration_stats>  m_pairs;
+    std::vector<clu_migration_stats>           m_stats; // returned by GetStats
+};
+
+void CL_CALLBACK CLU_ForgetResidencyCallback(cl_mem in_mem, void* in_data);
+
+void MigrationTracker::NoteMigration(cl_mem in_mem, cl_device_id in_to, bool in_contentsMoved)
+{
+    cl_device_id from = 0;
+    bool firstMove = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<cl_mem, cl_device_id>::iterator iter = m_residency.find(in_mem);
+        if (iter == m_residency.end())
+        {
+            if (0 == in_to)
+            {
+                return; // untracked buffers count as on the host, nothing moved or needs forgetting
+            }
+            firstMove = true;
+            m_residency[in_mem] = in_to;
+        }
+        else
+        {
+            from = iter->second;
+            iter->second = in_to;
+        }
+        if (from == in_to)
+        {
+            return; // already there
+        }
+    }
+
+    size_t size = 0;
+    if (in_contentsMoved)
+    {
+        clGetMemObjectInfo(in_mem, CL_MEM_SIZE, sizeof(size), &size, 0);
+    }
+    if (firstMove)
+    {
+        clSetMemObjectDestructorCallback(in_mem, CLU_ForgetResidencyCallback, 0);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    clu_migration_stats& stats = m_pairs[DevicePair(from, in_to)];
+    stats.from = from;
+    stats.to = in_to;
+    stats.migrations++;
+    stats.bytes += size;
+}
+
+void MigrationTracker::Forget(cl_mem in_mem)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_residency.erase(in_mem);
+}
+
+const clu_migration_stats* MigrationTracker::GetStats(cl_uint* out_pArraySize)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.resize(0);
+    for (std::map<DevicePair, clu_migration_stats>::const_iterator i = m_pairs.begin(); i != m_pairs.end(); i++)
+    {
+        m_stats.push_back(i->second);
+    }
+    *out_pArraySize = (cl_uint)m_stats.size();
+    return m_stats.empty() ? 0 : &m_stats[0];
+}
+
+void MigrationTracker::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_residency.clear(); // destructor callbacks of these buffers find nothing to erase
+    m_pairs.clear();
+    m_stats.clear();
+}
+
+//==============================================================================
+// class to cache shared virtual memory from cluSVMAlloc
+// allocations are reused by size class and flags; all of them are freed by
+// Release(), before the context they belong to goes away
+//==============================================================================
+class SvmCache
+{
+public:
+    SvmCache() : m_capabilities(0) {memset(&m_stats, 0, sizeof(m_stats));}
+    void*  Allocate(cl_context in_context, cl_svm_mem_flags in_flags, size_t in_size, cl_int* out_pStatus);
+    bool   Free(void* in_ptr); // false if in_ptr is not from Allocate
+    void   Trim(cl_context in_context, size_t in_maxCachedBytes);
+    void   GetStats(clu_svm_stats& out_stats);
+    void   Release(cl_context in_context); // free everything, in use or not
+private:
+    struct Allocation
+    {
+        cl_svm_mem_flags m_flags;
+        size_t           m_size; // size class
+    };
+    typedef std::pair<cl_svm_mem_flags, size_t> IdleKey;
+
+    std::mutex                          m_mutex;
+    std::map<void*, Allocation>         m_inUse;
+    std::map<IdleKey, std::vector<void*> > m_idle;
+    cl_bitfield                         m_capabilities; // CL_DEVICE_SVM_* common to all devices, 0 = not queried yet
+    clu_svm_stats                       m_stats;
+};
+
+//-----------------------------------------------------------------------------
+// size classes of the svm cache and the buffer pools: quarter steps between
+// powers of 2, from in_granularity (a power of 2) up
+// 0 if in_size is past the largest power of 2, the doubling would wrap
+//-----------------------------------------------------------------------------
+size_t GetSizeClass(size_t in_size, size_t in_granularity)
+{
+    const size_t largest = ((size_t)-1 >> 1) + 1;
+    if (in_size > largest)
+    {
+        return 0;
+    }
+    size_t size = in_granularity;
+    if (in_size > in_granularity)
+    {
+        size_t power = in_granularity;
+        while (power < in_size)
+        {
+            power *= 2;
+        }
+        size_t step = std::max(power / 8, in_granularity); // quarters of the range [power/2, power]
+        size = power / 2;
+        while (size < in_size)
+        {
+            size += step;
+        }
+    }
+    return size;
+}
+
+#define CLU_SVM_GRANULARITY 64 // a cache line
+
+void* SvmCache::Allocate(cl_context in_context, cl_svm_mem_flags in_flags, size_t in_size, cl_int* out_pStatus)
+{
+#ifdef CL_VERSION_2_0
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (0 == m_capabilities)
+    {
+        cl_uint numDevices = 0;
+        clGetContextInfo(in_context, CL_CONTEXT_NUM_DEVICES, sizeof(cl_uint), &numDevices, 0);
+        std::vector<cl_device_id> devices(numDevices);
+        if (numDevices)
+        {
+            clGetContextInfo(in_context, CL_CONTEXT_DEVICES, numDevices * sizeof(cl_device_id), &devices[0], 0);
+        }
+        m_capabilities = ~(cl_bitfield)0;
+        for (cl_uint i = 0; i < numDevices; i++)
+        {
+            cl_bitfield capabilities = 0;
+            clGetDeviceInfo(devices[i], CL_DEVICE_SVM_CAPABILITIES, sizeof(capabilities), &capabilities, 0);
+            m_capabilities &= capabilities;
+        }
+    }
+    cl_bitfield required = (in_flags & CL_MEM_SVM_FINE_GRAIN_BUFFER) ?
+        CL_DEVICE_SVM_FINE_GRAIN_BUFFER : CL_DEVICE_SVM_COARSE_GRAIN_BUFFER;
+    if (in_flags & CL_MEM_SVM_ATOMICS)
+    {
+        required |= CL_DEVICE_SVM_ATOMICS;
+    }
+    if ((m_capabilities & required) != required)
+    {
+        *out_pStatus = CL_INVALID_OPERATION;
+        return 0;
+    }
+
+    Allocation allocation = {in_flags, GetSizeClass(in_size, CLU_SVM_GRANULARITY)};
+    if (0 == allocation.m_size)
+    {
+        *out_pStatus = CL_INVALID_BUFFER_SIZE;
+        return 0;
+    }
+    void* p = 0;
+    std::vector<void*>& idle = m_idle[IdleKey(in_flags, allocation.m_size)];
+    if (!idle.empty())
+    {
+        p = idle.back();
+        idle.pop_back();
+        m_stats.hits++;
+        m_stats.bytes_cached -= allocation.m_size;
+    }
+    else
+    {
+        // 0 alignment: the largest type the devices support
+        p = clSVMAlloc(in_context, in_flags, allocation.m_size, 0);
+    }
+    if (0 == p)
+    {
+        *out_pStatus = CL_OUT_OF_RESOURCES;
+        return 0;
+    }
+    m_inUse[p] = allocation;
+    m_stats.allocs++;
+    m_stats.bytes_in_use += allocation.m_size;
+    *out_pStatus = CL_SUCCESS;
+    return p;
+#else
+    in_context = 0; in_flags = 0; in_size = 0; // unused, remove compiler warning
+    *out_pStatus = CL_INVALID_OPERATION;
+    return 0;
+#endif
+}
+
+bool SvmCache::Free(void* in_ptr)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<void*, Allocation>::iterator iter = m_inUse.find(in_ptr);
+    if (iter == m_inUse.end())
+    {
+        return false;
+    }
+    const Allocation& allocation = iter->second;
+    m_idle[IdleKey(allocation.m_flags, allocation.m_size)].push_back(in_ptr);
+    m_stats.frees++;
+    m_stats.bytes_in_use -= allocation.m_size;
+    m_stats.bytes_cached += allocation.m_size;
+    m_inUse.erase(iter);
+    return true;
+}
+
+void SvmCache::Trim(cl_context in_context, size_t in_maxCachedBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // largest classes first, they free the most memory per driver call
+    std::map<IdleKey, std::vector<void*> >::reverse_iterator iter = m_idle.rbegin();
+    for (; (iter != m_idle.rend()) && (m_stats.bytes_cached > in_maxCachedBytes); iter++)
+    {
+        std::vector<void*>& idle = iter->second;
+        while (!idle.empty() && (m_stats.bytes_cached > in_maxCachedBytes))
+        {
+#ifdef CL_VERSION_2_0
+            clSVMFree(in_context, idle.back());
+#endif
+            idle.pop_back();
+            m_stats.bytes_cached -= iter->first.second;
+        }
+    }
+}
+
+void SvmCache::GetStats(clu_svm_stats& out_stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out_stats = m_stats;
+}
+
+void SvmCache::Release(cl_context in_context)
+{
+    Trim(in_context, 0);
+    std::lock_guard<std::mutex> lock(m_mutex);
+#ifdef CL_VERSION_2_0
+    for (std::map<void*, Allocation>::iterator iter = m_inUse.begin(); iter != m_inUse.end(); iter++)
+    {
+        clSVMFree(in_context, iter->first);
+    }
+#endif
+    m_inUse.clear();
+    m_idle.clear();
+    m_capabilities = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+//==============================================================================
+// class to run cluReadAsync: a ring of staging buffers and a completion thread
+// event callbacks push completed slots into a lock-free ring; the thread pops
+// them, calls the application, unmaps and frees the slot.
+// methods are defined with cluReadAsync
+//==============================================================================
+class ReadbackRing
+{
+public:
+    ReadbackRing();
+    cl_int Read(cl_command_queue in_queue, cl_mem in_buffer, size_t in_offset, size_t in_size,
+                clu_read_callback in_callback, void* in_pUserData,
+                cl_uint in_numWaitEvents, const cl_event* in_waitEvents);
+    void   Reset(); // wait for pending callbacks, stop the thread, release the staging buffers
+
+    struct Slot
+    {
+        cl_mem            m_staging;
+        void*             m_pHostPtr;
+        size_t            m_capacity;
+        cl_event          m_unmapped; // the previous read's unmap, 0 if none. the next copy waits for it
+        cl_command_queue  m_queue; // retained while the read is in flight
+        void*             m_pMapped;
+        size_t            m_size;
+        cl_int            m_status;
+        clu_read_callback m_callback;
+        void*             m_pUserData;
+    };
+    void   Complete(Slot* in_pSlot, cl_int in_status); // from event callbacks
+private:
+    void   Run(); // completion thread
+    void   Deliver(Slot* in_pSlot);
+
+    std::mutex              m_mutex;
+    std::condition_variable m_slotFreed;
+    std::condition_variable m_wake;
+    std::vector<Slot>       m_slots; // reserved up front, never moves
+    std::vector<Slot*>      m_free;
+    MpscRing<Slot*>         m_completed;
+    std::atomic<bool>       m_threadSleeping;
+    std::thread             m_thread;
+    std::thread::id         m_threadId;
+    size_t                  m_pending; // reads enqueued, not yet delivered
+    bool                    m_stop;
+};
+
+//==============================================================================
+// class to maintain internal runtime state
+//==============================================================================
+class CLU_Runtime
+{
+public:
+    static CLU_Runtime& Get() {return g_runtime;} // singleton pattern
+
+    // startup
+    cl_int       Initialize(const clu_initialize_params& in_params);
+
+    // manage the lifetime of an object
+    template<typename T> void AddObject(T o);
+
+    // common build function
+    cl_program   BuildProgram(cl_uint in_numSources,
+                              const char** in_sources, const size_t* in_source_lengths,
+                              const char* in_buildOptions, cl_int *out_pStatus);
+    cl_program   BuildProgram(cl_uint in_numBinaries,
+                              const size_t* in_binary_lengths, const unsigned char** in_binaries,
+                              const char* in_buildOptions, cl_int *out_pStatus);
+    const char*  GetBuildErrors(cl_program program);
+
+    cl_platform_id GetPlatform()                 {return m_platform;}
+    cl_device_id GetDevice(cl_device_type in_clDeviceType);
+    cl_command_queue GetCommandQueue(cl_device_type in_clDeviceType, cl_int* out_status);
+    // a queue of clu's own, with profiling, for probes that must not wait behind the application's work
+    cl_command_queue GetProbeQueue(cl_device_type in_clDeviceType, cl_int* out_status);
+    // create a queue with clCreateCommandQueue or, on 2.x platforms, clCreateCommandQueueWithProperties
+    cl_command_queue CreateCommandQueue(cl_device_id in_device, cl_command_queue_properties in_properties, cl_int* out_status);
+    cl_context   GetContext()                    {return m_context;}
+    cl_bool      GetIsInitialized()              {if (m_isInitialized) return CL_TRUE; return CL_FALSE;}
+    bool         IsProfiling()                   {return 0 != (m_runtimeFlags & CLU_RUNTIME_PROFILING);}
+    const char*  GetBuildOptions()               {return m_buildOptions.c_str();}
+
+    // max buffer alignment across all devices in context
+    cl_uint      GetBufferAlignment();
+    // max CL_DEVICE_MEM_BASE_ADDR_ALIGN across all devices in context, in bytes. sub-buffer origins must be multiples
+    cl_uint      GetSubBufferAlignment();
+
+    // distinct device types in the context, one per clu queue
+    cl_uint      GetDeviceTypes(cl_device_type* out_types); // array of CLU_MAX_NUM_DEVICES
+
+    // relative weights for splitting a kernel across devices, from measured throughput
+    void         GetSplitWeights(cl_kernel in_kernel, cl_uint in_numDevices,
+                                 const cl_device_type* in_types, double* out_weights);
+    // record throughput (work items per second) of a slice that ran on a device
+    void         AddSplitThroughput(cl_kernel in_kernel, cl_device_type in_type, double in_itemsPerSecond);
+
+    // used by code generator: build and has program on first call,
+    // subsequently return hashed program
+    // hashed programs always use default build options
+    cl_program   HashProgram(cl_uint in_numSources,
+                              const char** in_sources, const size_t* in_source_lengths,
+                              cl_int *out_pStatus);
+
+    // return an array of image formats supported in a given CL context
+    const clu_image_format* GetImageFormats(cl_uint* out_pArraySize, cl_int* out_pStatus);
+    // can images of this type and format be created with these flags. queries formats on first call
+    bool         IsImageFormatSupported(const cl_image_format& in_format, cl_mem_object_type in_type, cl_mem_flags in_flags);
+    // max CL_DEVICE_IMAGE_PITCH_ALIGNMENT across all devices in context, in pixels
+    cl_uint      GetImagePitchAlignment();
+
+    // samplers are shared: one per combination of settings, released by Reset()
+    cl_sampler   GetSampler(cl_bool in_normalized, cl_addressing_mode in_addressing,
+                            cl_filter_mode in_filter, cl_int* out_pStatus);
+
+    // every event clu creates is counted here, and released through here
+    EventRecycler& GetEventRecycler()            {return m_eventRecycler;}
+
+    // per-kernel device times, collected when profiling
+    KernelProfiler& GetKernelProfiler()          {return m_kernelProfiler;}
+
+    // timeline of host calls and device commands, recorded when tracing
+    Tracer&      GetTracer()                     {return m_tracer;}
+
+    // polling budget for cluWait
+    WaitTuner&   GetWaitTuner()                  {return m_waitTuner;}
+
+    // host memory behind aligned buffers. not reset: buffers may outlive cluRelease
+    HostAllocator& GetHostAllocator()            {return m_hostAllocator;}
+    bool         UseHugePages()                  {return 0 != (m_runtimeFlags & CLU_RUNTIME_HUGE_PAGES);}
+
+    // diagnostics of buffers that should be zero-copy
+    ZeroCopyChecker& GetZeroCopyChecker()        {return m_zeroCopyChecker;}
+    bool         CheckZeroCopy()                 {return 0 != (m_runtimeFlags & CLU_RUNTIME_ZERO_COPY_CHECKS);}
+
+    // shared virtual memory from cluSVMAlloc
+    SvmCache&    GetSvmCache()                   {return m_svmCache;}
+
+    // every cl_mem clu creates. not reset: objects may outlive cluRelease
+    MemoryTracker& GetMemoryTracker()            {return m_memoryTracker;}
+
+    // staging buffers and completion thread of cluReadAsync
+    ReadbackRing& GetReadbackRing()              {return m_readbackRing;}
+
+    // bytes moved between devices by cluMigrate
+    MigrationTracker& GetMigrationTracker()      {return m_migrationTracker;}
+
+    void Reset(); // set everything to initial state, release all objects
+private:
+    CLU_Runtime();
+    ~CLU_Runtime();
+
+    static CLU_Runtime g_runtime;
+
+    bool             m_isInitialized;
+    cl_platform_id   m_platform; // default platform
+    cl_context       m_context; // default context
+    cl_command_queue m_commandQueue[CLU_MAX_NUM_DEVICES];
+    cl_command_queue m_probeQueue[CLU_MAX_NUM_DEVICES]; // see GetProbeQueue
+    cl_command_queue_properties m_queueProperties;
+    cl_bitfield      m_runtimeFlags;
+    std::string      m_buildOptions;
+    std::string      m_traceFile; // written by Reset() when tracing
+    cl_uint          m_bufferAlignment; // max buffer alignment across all devices in context
+    cl_uint          m_subBufferAlignment;
+
+    //---------------------------------------------------------------
+    // any object allocated by runtime is managed by the runtime
+    // Create a list of polymorphic objects:
+    class CLU_Object
+    {
+    public:
+        virtual ~CLU_Object() {}
+    };
+    typedef std::list<CLU_Object*> CluObjectList;
+    CluObjectList m_objects;
+    // Specific implementations of the object call CL Release methods:
+    template<typename T> class CLU_Specific : public CLU_Object
+    {
+    protected:
+        T m_o;
+    public:
+        CLU_Specific(T o) : m_o(o) {}
+        virtual ~CLU_Specific() {assert(0);} // default destructor should never be called
+    };
+    //---------------------------------------------------------------
+
+    //---------------------------------------------------------------
+    // Devices and map of devices to device type
+    // support up to 4 queues (1 for each of 4 devices: cpu, gpu, accelerator, custom)
+    cl_uint          m_numDevices;
+    
+    // WARNING: do not try to access this array using cl_device_type as the index!
+    // it is filled in at context creation time
+    // it is used for building programs and returning build errors
+    cl_device_id     m_deviceIds[CLU_MAX_NUM_DEVICES];
+
+    DeviceTypeToId   m_device_type_to_id;
+    //---------------------------------------------------------------
+
+    // storage for objects created by generated code
+    std::map<const void* const, cl_program> m_programMap;
+
+    // storage for image format query results from cluGetSupportedImageFormats
+    std::vector<clu_image_format> m_imageFormats;
+
+    // formats supported for exactly these flags, by image type. filled by IsImageFormatSupported
+    typedef std::pair<cl_mem_object_type, cl_mem_flags> ImageQuery;
+    std::map<ImageQuery, std::vector<cl_image_format> > m_supportedImageFormats;
+
+    // samplers from cluGetSampler, by settings. also in m_objects, which releases them
+    std::map<cl_ulong, cl_sampler> m_samplers;
+
+    // build log string from GetBuildErrors
+    std::string m_buildString;
+
+    // guards runtime state that is touched from OpenCL event callbacks or filled lazily by any thread
+    std::mutex m_mutex;
+
+    // measured throughput per kernel, indexed like the command queues
+    struct SplitThroughput
+    {
+        double m_itemsPerSecond[CLU_MAX_NUM_DEVICES];
+    };
+    std::map<cl_kernel, SplitThroughput> m_splitThroughput;
+
+    EventRecycler  m_eventRecycler;
+    KernelProfiler m_kernelProfiler;
+    Tracer         m_tracer;
+    WaitTuner      m_waitTuner;
+    HostAllocator  m_hostAllocator;
+    ZeroCopyChecker m_zeroCopyChecker;
+    SvmCache       m_svmCache;
+    MemoryTracker  m_memoryTracker;
+    ReadbackRing   m_readbackRing;
+    MigrationTracker m_migrationTracker;
+};
+
+//-----------------------------------------------------------------------------
+// global object
+//-----------------------------------------------------------------------------
+CLU_Runtime CLU_Runtime::g_runtime;
+
+//-----------------------------------------------------------------------------
+// every event reference clu creates or retains for itself is counted,
+// and given back to the recycler rather than released directly.
+// references returned to the application are not counted
+//-----------------------------------------------------------------------------
+void NoteEventCreated()
+{
+    CLU_Runtime::Get().GetEventRecycler().Created();
+}
+
+void RecycleEvent(cl_event in_event)
+{
+    CLU_Runtime::Get().GetEventRecycler().Recycle(in_event);
+}
+
+//-----------------------------------------------------------------------------
+// every cl_mem clu creates is checked against the soft limit, then tracked
+// in_pSite names the clu call, for objects created without a tag
+//-----------------------------------------------------------------------------
+bool WithinMemoryLimit(size_t in_size, cl_int* out_pStatus)
+{
+    if (CLU_Runtime::Get().GetMemoryTracker().WithinLimit(in_size))
+    {
+        return true;
+    }
+    *out_pStatus = CLU_MEMORY_LIMIT_EXCEEDED;
+    return false;
+}
+
+// for objects that passed WithinMemoryLimit but were not created
+void ReleaseMemoryReservation(size_t in_size)
+{
+    CLU_Runtime::Get().GetMemoryTracker().Unreserve(in_size);
+}
+
+void TrackMemObject(cl_mem in_mem, size_t in_size, cl_mem_flags in_flags, const char* in_pSite)
+{
+    CLU_Runtime::Get().GetMemoryTracker().Add(in_mem, in_size, in_flags, in_pSite);
+}
+
+void CL_CALLBACK CLU_UntrackMemObjectCallback(cl_mem in_mem, void* in_pRecord)
+{
+    in_mem = 0; // unused, fixes compile warning about unused param.
+    CLU_Runtime::Get().GetMemoryTracker().Remove((MemoryTracker::Record*)in_pRecord);
+}
+
+//-----------------------------------------------------------------------------
+// observers of api calls: tracing and application hooks
+// one word, so an unobserved call costs a single branch on entry and exit
+//-----------------------------------------------------------------------------
+std::atomic<unsigned> g_apiObservers(0);
+clu_hooks g_hooks; // valid while CLU_OBSERVE_HOOKS is set
+
+void SetApiObserver(unsigned in_observer, bool in_enable)
+{
+    if (in_enable)
+    {
+        g_apiObservers |= in_observer;
+    }
+    else
+    {
+        g_apiObservers &= ~in_observer;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// wraps a public api call: a span on the calling thread's trace track,
+// and the pre/post application hooks
+// in_pStatus may be NULL, and must outlive the scope
+//-----------------------------------------------------------------------------
+class ApiScope
+{
+public:
+    ApiScope(cl_uint in_call, const char* in_name, const cl_int* in_pStatus,
+             cl_kernel in_kernel = 0, const clu_nd_range* in_range = 0,
+             cl_command_queue in_queue = 0, size_t in_bytes = 0)
+        : m_observers(g_apiObservers.load(std::memory_order_relaxed)), m_pStatus(in_pStatus)
+    {
+        if (m_observers)
+        {
+            Begin(in_call, in_name, in_kernel, in_range, in_queue, in_bytes);
+        }
+    }
+    ~ApiScope()
+    {
+        if (m_observers)
+        {
+            End();
+        }
+    }
+private:
+    void Begin(cl_uint in_call, const char* in_name, cl_kernel in_kernel,
+               const clu_nd_range* in_range, cl_command_queue in_queue, size_t in_bytes);
+    void End();
+
+    unsigned      m_observers; // sampled on entry, so pre and post hooks come in pairs
+    const cl_int* m_pStatus;
+    clu_call_info m_info;
+    char          m_kernelName[CLU_UTIL_MAX_STRING_LENGTH];
+    cl_ulong      m_start;
+};
+
+void ApiScope::Begin(cl_uint in_call, const char* in_name, cl_kernel in_kernel,
+    const clu_nd_range* in_range, cl_command_queue in_queue, size_t in_bytes)
+{
+    memset(&m_info, 0, sizeof(m_info));
+    m_info.call = in_call;
+    m_info.api_name = in_name;
+    m_info.nd_range = in_range;
+    m_info.queue = in_queue;
+    m_info.bytes = in_bytes;
+    if (in_kernel && (m_observers & CLU_OBSERVE_HOOKS))
+    {
+        m_kernelName[0] = 0;
+        clGetKernelInfo(in_kernel, CL_KERNEL_FUNCTION_NAME, sizeof(m_kernelName)-1, m_kernelName, 0);
+        m_kernelName[sizeof(m_kernelName)-1] = 0;
+        m_info.kernel_name = m_kernelName;
+    }
+    if ((m_observers & CLU_OBSERVE_HOOKS) && g_hooks.pre)
+    {
+        g_hooks.pre(&m_info, g_hooks.user_data);
+    }
+    m_start = GetHostTimeNs();
+}
+
+void ApiScope::End()
+{
+    cl_ulong end = GetHostTimeNs();
+    m_info.status = m_pStatus ? *m_pStatus : CL_SUCCESS;
+    m_info.duration_ns = end - m_start;
+    if (m_observers & CLU_OBSERVE_TRACE)
+    {
+        try
+        {
+            Tracer& tracer = CLU_Runtime::Get().GetTracer();
+            if (tracer.IsEnabled()) // cluRelease stops tracing
+            {
+                tracer.AddHostSpan(m_info.api_name, m_start, end);
+            }
+        }
+        catch (...) // internal error, e.g. thrown by STL
+        {
+        }
+    }
+    if ((m_observers & CLU_OBSERVE_HOOKS) && g_hooks.post)
+    {
+        g_hooks.post(&m_info, g_hooks.user_data);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// overloaded template definitions for the virtual destructors for
+// all the kinds of things that the runtime might hold internal references to:
+//-----------------------------------------------------------------------------
+template<> CLU_Runtime::CLU_Specific<cl_context>::~CLU_Specific()       {clReleaseContext(m_o);}
+template<> CLU_Runtime::CLU_Specific<cl_command_queue>::~CLU_Specific() {clReleaseCommandQueue(m_o);}
+template<> CLU_Runtime::CLU_Specific<cl_program>::~CLU_Specific()       {clReleaseProgram(m_o);}
+template<> CLU_Runtime::CLU_Specific<cl_sampler>::~CLU_Specific()       {clReleaseSampler(m_o);}
+
+//-----------------------------------------------------------------------------
+// add an object to the internal collection of objects
+//-----------------------------------------------------------------------------
+template<typename T> void CLU_Runtime::AddObject(T t)
+{
+    CLU_Object* p = new CLU_Specific<T>(t);
+    m_objects.push_front(p);
+}
+
+//-----------------------------------------------------------------------------
+// set everything to initial state, release all objects
+//-----------------------------------------------------------------------------
+void CLU_Runtime::Reset()
+{
+    // let profiling and tracing callbacks on clu queues finish, so their times are recorded.
+    // callbacks on application queues may still be pending, see KernelProfiler
+    if (IsProfiling() || m_tracer.IsEnabled())
+    {
+        for (int i = 0; i < CLU_MAX_NUM_DEVICES; i++)
+        {
+            if (m_commandQueue[i]) clFinish(m_commandQueue[i]);
+        }
+    }
+    if (m_tracer.IsEnabled() && !m_traceFile.empty())
+    {
+        m_tracer.Write(m_traceFile.c_str());
+    }
+    m_readbackRing.Reset(); // calls back into the application, and recycles events
+    m_eventRecycler.Flush(); // before the context goes away
+    m_kernelProfiler.Reset();
+    m_tracer.Reset();
+    m_traceFile.clear();
+    m_waitTuner.Reset();
+    m_zeroCopyChecker.Reset();
+    m_migrationTracker.Reset();
+    if (m_context)
+    {
+        m_svmCache.Release(m_context); // SVM belongs to the context
+    }
+
+    m_platform=0;
+    m_context=0;
+    m_numDevices=0;
+    m_queueProperties = 0;
+    m_runtimeFlags = 0;
+    m_bufferAlignment = 0;
+    m_subBufferAlignment = 0;
+    m_buildOptions.clear();
+    memset(m_commandQueue, 0, sizeof(m_commandQueue));
+    memset(m_probeQueue, 0, sizeof(m_probeQueue));
+    memset(m_deviceIds, 0, sizeof(m_deviceIds));
+
+    for (CluObjectList::iterator i = m_objects.begin(); i != m_objects.end(); i++)
+    {
+        CLU_Object* p = *i;
+        delete(p);
+    }
+
+    m_objects.clear();
+    m_programMap.clear();
+    m_imageFormats.clear();
+    m_supportedImageFormats.clear();
+    m_samplers.clear();
+    m_buildString.clear();
+    m_splitThroughput.clear();
+
+    m_isInitialized = false;
+}
+
+//-----------------------------------------------------------------------------
+// constructor
+//-----------------------------------------------------------------------------
+CLU_Runtime::CLU_Runtime()
+{
+    //_CrtSetBreakAlloc(237); // set this to # of leaked allocation
+    m_runtimeFlags = 0; // read by Reset()
+    Reset();
+}
+
+//-----------------------------------------------------------------------------
+// shutdown clu. Release all internal objects
+//-----------------------------------------------------------------------------
+CLU_Runtime::~CLU_Runtime()
+{
+    Reset();
+#if CLU_DETECT_MEMORY_LEAKS
+    _CrtDumpMemoryLeaks();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// internal method to return default platform
+// find the first platform that supports the requested device type(s)
+//-----------------------------------------------------------------------------
+cl_platform_id GetPlatformDefault(
+    int in_numPlatforms, const cl_platform_id* in_platforms,
+    cl_device_type in_device_type)
+{
+    int i = 0;
+    for (; i < in_numPlatforms; i++)
+    {
+        cl_device_id unused = 0;
+        cl_uint numDevicesFound = 0;
+        clGetDeviceIDs(in_platforms[i], in_device_type, 1, &unused, &numDevicesFound);
+        if (0 != numDevicesFound)
+        {
+            break; // found platform with requested device type
+        }
+    }
+    cl_platform_id platformId = 0;
+    if (i < in_numPlatforms)
+    {
+        platformId = in_platforms[i];
+    }
+    return platformId;
+}
+
+//-----------------------------------------------------------------------------
+// internal method to get a platform by vendor name string
+// CASE INSENSITIVE
+//-----------------------------------------------------------------------------
+cl_platform_id GetPlatformByVendor(cl_uint in_numPlatforms, const cl_platform_id* in_platforms,
+    const char* in_vendorName, cl_device_type in_device_type, cl_int* out_pStatus)
+{
+    const int BUFSIZE = 1024;
+    char pBuf[BUFSIZE];
+    cl_platform_id platform = 0;
+    std::string vendorName(in_vendorName);
+    std::transform(vendorName.begin(), vendorName.end(), vendorName.begin(), ::tolower);
+
+    cl_uint i = 0;
+    for (; i < in_numPlatforms; ++i)
+    {
+        cl_int status = clGetPlatformInfo(in_platforms[i], CL_PLATFORM_VENDOR, BUFSIZE, pBuf, 0);
+        OCL_VALIDATE(status);
+        *out_pStatus = status;
+
+        if (CL_SUCCESS == status)
+        {
+            std::string platformVendor(pBuf);
+            std::transform(platformVendor.begin(), platformVendor.end(), platformVendor.begin(), ::tolower);
 
             // just get part of the vendor string right
             if (std::string::npos != platformVendor.find(vendorName))
             {
-                platform = in_platforms[i];
-                if ((CL_DEVICE_TYPE_ALL != in_device_type) && (0 != GetPlatformDefault(1, &platform, in_device_type)))
-                {
-                    break;
-                }
+                platform = in_platforms[i];
+                if ((CL_DEVICE_TYPE_ALL != in_device_type) && (0 != GetPlatformDefault(1, &platform, in_device_type)))
+                {
+                    break;
+                }
+            }
+        }
+    }
+    return platform;
+}
+
+//-----------------------------------------------------------------------------
+// Initialize (start) clu
+//-----------------------------------------------------------------------------
+cl_int CLU_Runtime::Initialize(const clu_initialize_params& in_params)
+{
+    // if already initialized, do nothing.
+    if (GetIsInitialized())
+    {
+        return CL_INVALID_OPERATION;
+    }
+
+    Reset();
+    cl_platform_id* platforms = 0;
+
+    m_queueProperties = in_params.default_queue_props;
+    //m_queueProperties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    m_runtimeFlags = in_params.runtime_flags;
+    if (m_runtimeFlags & CLU_RUNTIME_TRACING)
+    {
+        m_tracer.Start();
+        if (in_params.trace_file)
+        {
+            m_traceFile = in_params.trace_file;
+        }
+    }
+    if (IsProfiling() || m_tracer.IsEnabled())
+    {
+        m_queueProperties |= CL_QUEUE_PROFILING_ENABLE;
+    }
+    m_buildOptions = in_params.compile_options ? in_params.compile_options : "";
+    m_context = in_params.existing_context;
+    cl_device_type deviceType = in_params.preferred_device_type;
+    if (0 == deviceType)
+    {
+        deviceType = CL_DEVICE_TYPE_ALL;
+    }
+
+    cl_int status = 0;
+    if (0 == m_context)
+    {
+        // create default context and default queues (per device)
+        // find an OCL device on this platform
+        cl_uint numPlatforms;
+        status = clGetPlatformIDs(0, 0, &numPlatforms);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+
+        assert(0 != numPlatforms); // if it's 0, we should have gotten an error above.
+
+        // get the number of platforms
+        platforms = new cl_platform_id[numPlatforms];
+        if (0 == platforms)
+        {
+            status = CL_OUT_OF_HOST_MEMORY;
+            goto exit;
+        }
+        // get the platform ids
+        status = clGetPlatformIDs(numPlatforms, platforms, 0);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+
+        if (in_params.vendor_name)
+        {
+            m_platform = GetPlatformByVendor(numPlatforms, platforms, in_params.vendor_name, deviceType, &status);
+            OCL_VALIDATE(status);
+            if (CL_SUCCESS != status) goto exit;
+        }
+
+        if (0 == m_platform)
+        {
+            m_platform = GetPlatformDefault(numPlatforms, platforms, deviceType);
+        }
+
+        // should have a platform now.
+        if (0 == m_platform)
+        {
+            status = CL_DEVICE_NOT_FOUND;
+            goto exit;
+        }
+
+        // get # of devices & device Ids
+        // here we have a platform, no context yet
+        status = clGetDeviceIDs(m_platform, deviceType, 0, 0, &m_numDevices);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+
+        // get device IDs
+        // clamp to CLU_MAX_NUM_DEVICES
+        if (m_numDevices > CLU_MAX_NUM_DEVICES)
+        {
+            m_numDevices = CLU_MAX_NUM_DEVICES;
+        }
+        status = clGetDeviceIDs(m_platform, deviceType, m_numDevices, m_deviceIds, 0);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+
+        // NOTE: GCC complains if we use array initialisers combined with goto,
+        //       so do element-wise assignment instead
+        cl_context_properties properties[CLU_MAXPROPERTYCOUNT];
+        int propNum = 0;
+
+        // append any user-provided context properties
+        if (in_params.default_context_props)
+        {
+            // leave room for platform # and trailing 0
+            int maxPropertyCount = CLU_MAXPROPERTYCOUNT - 3;
+            while (propNum < maxPropertyCount)
+            {
+                cl_context_properties prop = in_params.default_context_props[propNum];
+                if (0 == prop)
+                {
+                    break;
+                }
+                else
+                {
+                    properties[propNum] = prop;
+                    ++propNum;
+                    properties[propNum] = in_params.default_context_props[propNum];
+                    ++propNum;
+                }
+            } // end loop over input properties
+        } // end if there are default context properties
+        properties[propNum] = CL_CONTEXT_PLATFORM;
+        ++propNum;
+        properties[propNum] = (cl_context_properties)m_platform;
+        ++propNum;
+        properties[propNum] = (cl_context_properties)0;
+
+        m_context = clCreateContext(properties, m_numDevices, m_deviceIds,
+            0 /* callback */, 0 /* callback data */, &status);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+    }
+    else
+    {
+        clRetainContext(in_params.existing_context); // add a reference to the provided context
+
+        // get # of devices & device Ids
+        // here, we have the context, not the platform
+        cl_int status = clGetContextInfo(m_context, CL_CONTEXT_NUM_DEVICES, sizeof(m_numDevices), &m_numDevices, 0);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+
+        // clamp to CLU_MAX_NUM_DEVICES
+        if (m_numDevices > CLU_MAX_NUM_DEVICES)
+        {
+            m_numDevices = CLU_MAX_NUM_DEVICES;
+        }
+        status = clGetContextInfo(m_context, CL_CONTEXT_DEVICES, m_numDevices * sizeof(cl_device_id), m_deviceIds, 0);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) goto exit;
+    }
+
+    // construct a map from clu device order (cpu, gpu, accelerator, custom) into platform device order
+    for (cl_uint d = 0; d < m_numDevices; d++)
+    {
+        cl_device_type deviceType;
+        status = clGetDeviceInfo(m_deviceIds[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &deviceType, 0);
+        OCL_VALIDATE(status);
+
+        // usually device 0 is the default, but maybe this runtime explicitly sets this bit:
+        if ((0 == d) || (deviceType & CL_DEVICE_TYPE_DEFAULT))
+        {
+            deviceType &= ~CL_DEVICE_TYPE_DEFAULT; // clear the bit
+            m_device_type_to_id.SetDefault(deviceType);
+        }
+
+        m_device_type_to_id.SetDevice(deviceType, m_deviceIds[d]);
+    }
+
+    AddObject(m_context);
+
+    m_isInitialized = true;
+
+exit:
+    delete [] platforms;
+    return status;
+}
+
+//------------------------------------------------------------------------
+// return cl_device from in_clDeviceType
+//------------------------------------------------------------------------
+cl_device_id CLU_Runtime::GetDevice(cl_device_type in_clDeviceType)
+{
+    return m_device_type_to_id.GetDevice(in_clDeviceType);
+}
+
+//-----------------------------------------------------------------------------
+// return command queue based on device type
+//-----------------------------------------------------------------------------
+cl_command_queue CLU_Runtime::GetCommandQueue(cl_device_type in_clDeviceType, cl_int* out_status)
+{
+    cl_int status = CL_SUCCESS;
+    int index = m_device_type_to_id.GetIndexFromType(in_clDeviceType);
+    cl_command_queue q = m_commandQueue[index];
+    if (0 == q)
+    {
+        cl_device_id deviceId = m_device_type_to_id.GetDevice(in_clDeviceType);
+        q = CreateCommandQueue(deviceId, m_queueProperties, &status);
+        if (q)
+        {
+            m_commandQueue[index] = q;
+            AddObject(q);
+        }
+    }
+
+    if (out_status)
+    {
+        *out_status = status;
+    }
+    return q;
+}
+
+//-----------------------------------------------------------------------------
+// return clu's private profiling queue for a device type
+//-----------------------------------------------------------------------------
+cl_command_queue CLU_Runtime::GetProbeQueue(cl_device_type in_clDeviceType, cl_int* out_status)
+{
+    cl_int status = CL_SUCCESS;
+    int index = m_device_type_to_id.GetIndexFromType(in_clDeviceType);
+    std::lock_guard<std::mutex> lock(m_mutex); // probes run on any thread
+    cl_command_queue q = m_probeQueue[index];
+    if (0 == q)
+    {
+        cl_device_id deviceId = m_device_type_to_id.GetDevice(in_clDeviceType);
+        q = CreateCommandQueue(deviceId, CL_QUEUE_PROFILING_ENABLE, &status);
+        if (q)
+        {
+            m_probeQueue[index] = q;
+            AddObject(q);
+        }
+    }
+
+    if (out_status)
+    {
+        *out_status = status;
+    }
+    return q;
+}
+
+//-----------------------------------------------------------------------------
+// create a command queue in the clu context, the caller owns it
+//-----------------------------------------------------------------------------
+cl_command_queue CLU_Runtime::CreateCommandQueue(cl_device_id in_device, cl_command_queue_properties in_properties,
+    cl_int* out_status)
+{
+    cl_int status = CL_SUCCESS;
+    cl_command_queue q = 0;
+#ifdef CL_API_SUFFIX__VERSION_2_0
+    // clCreateCommandQueue was deprecated in 2.0
+    // We still need to check if the current platform only supports 1.x, though.
+    clu_platform_info info = cluGetPlatformInfo(m_platform, &status);
+    OCL_VALIDATE(status);
+
+    if (info.version && strstr(info.version, "OpenCL 1.")) {
+        q = clCreateCommandQueue(m_context, in_device, in_properties, &status);
+    } else {
+        cl_queue_properties propertyList[3] = {CL_QUEUE_PROPERTIES, in_properties, 0};
+        q = clCreateCommandQueueWithProperties(m_context, in_device, propertyList, &status);
+    }
+#else
+    q = clCreateCommandQueue(m_context, in_device, in_properties, &status);
+#endif
+
+    OCL_VALIDATE(status);
+
+    if (out_status)
+    {
+        *out_status = status;
+    }
+    return q;
+}
+
+//-----------------------------------------------------------------------------
+// return build errors
+// NOT THREAD SAFE: this uses an internal char* for convenience
+//-----------------------------------------------------------------------------
+const char* CLU_Runtime::GetBuildErrors(cl_program in_program)
+{
+    m_buildString.clear();
+    for (cl_uint d = 0; d < m_numDevices; d++)
+    {
+        // get build log size
+        size_t buildLogSize = 0;
+        cl_int status = clGetProgramBuildInfo(
+            in_program, m_deviceIds[d], CL_PROGRAM_BUILD_LOG,
+            0, 0, &buildLogSize);
+        OCL_VALIDATE(status);
+
+        char* buildLog = new char[buildLogSize+1];
+        assert(buildLog);
+
+        // get the build log
+        status = clGetProgramBuildInfo(
+            in_program, m_deviceIds[d], CL_PROGRAM_BUILD_LOG, 
+            buildLogSize, buildLog, 0);
+        OCL_VALIDATE(status);
+
+        buildLog[buildLogSize] = 0;
+        m_buildString.append(buildLog);
+        delete [] buildLog;
+    }
+    return m_buildString.c_str();
+}
+
+//-----------------------------------------------------------------------------
+// Build a program, called by generated code
+//-----------------------------------------------------------------------------
+cl_program CLU_Runtime::HashProgram(
+    cl_uint in_numSources,
+    const char** in_sources,
+    const size_t* in_source_lengths,
+    cl_int*     out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+
+    // because this is called by generated code, we can be confident that the
+    // source passed in is at an address that is constant for the lifetime of
+    // the application. Hence, it's suitable for use as a hash key:
+    const void* hashKey = in_sources;
+
+    cl_program program = m_programMap[hashKey]; // find program in hash
+    if (0 == program) // hasn't been built yet?
+    {
+        // programs hashed by CLU always use the default build options
+        const char* buildOptions = 0;
+        program = BuildProgram(in_numSources, in_sources, in_source_lengths, buildOptions, &status);
+        if (program) // if successful
+        {
+            AddObject(program); // manage lifetime
+            m_programMap[hashKey] = program; // add to hash
+        }
+    }
+
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// Build a program
+//-----------------------------------------------------------------------------
+cl_program CLU_Runtime::BuildProgram(
+    cl_uint in_numSources,
+    const char** in_sources,
+    const size_t* in_source_lengths,
+    const char* in_buildOptions,
+    cl_int*     out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_BUILD_PROGRAM, "BuildProgram", &status);
+
+    cl_context context = GetContext();
+    cl_program program = clCreateProgramWithSource(context, in_numSources, in_sources, in_source_lengths, &status);
+    OCL_VALIDATE(status);
+
+    // no build options? use default.
+    if (0 == in_buildOptions)
+    {
+        in_buildOptions = GetBuildOptions();
+    }
+    status = clBuildProgram(program, m_numDevices, m_deviceIds, in_buildOptions, 0, 0);
+
+    OCL_VALIDATE(status);
+
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+
+    return program;
+}
+
+cl_program CLU_Runtime::BuildProgram(
+    cl_uint in_numBinaries,
+    const size_t* in_binary_lengths,
+    const unsigned char** in_binaries,
+    const char* in_buildOptions,
+    cl_int*     out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_BUILD_PROGRAM, "BuildProgram", &status);
+
+    // FIXME: how do we know which binary goes to which device?
+    // CLU abstracts the device array internally. Recommend using device type.
+    // Note CLU does not really handle having more than 1 device of the same type, that is an advanced move.
+    // for "advanced" context moves, initialize CLU with an existing context.
+
+    // FIXME: just protect from obvious crashes for now
+    if (in_numBinaries > m_numDevices)
+    {
+        in_numBinaries = m_numDevices;
+    }
+
+    cl_context context = GetContext();
+    cl_program program = clCreateProgramWithBinary(context, in_numBinaries, m_deviceIds, in_binary_lengths, (const unsigned char **) in_binaries, 0, &status);
+    OCL_VALIDATE(status);
+
+    status = clBuildProgram(program, m_numDevices, m_deviceIds, in_buildOptions, 0, 0);
+    OCL_VALIDATE(status);
+
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// find max buffer alignment across all devices in context
+//-----------------------------------------------------------------------------
+cl_uint CLU_Runtime::GetBufferAlignment()
+{
+    if (0 == m_bufferAlignment)
+    {
+        // Some architectures require at least 4KB alignment, in base and size,
+        // for 0-copy to work. As of OpenCL 2.0, there is no query for preferred alignment
+        // that would reveal this.
+        m_bufferAlignment = 4096;
+        m_subBufferAlignment = 1;
+
+        cl_uint numDevices = 0;
+        clGetContextInfo(CLU_CONTEXT, CL_CONTEXT_NUM_DEVICES, sizeof(cl_uint), &numDevices, 0);
+        cl_device_id* pDevices = new cl_device_id[numDevices];
+        clGetContextInfo(CLU_CONTEXT, CL_CONTEXT_DEVICES, sizeof(cl_device_id)*numDevices, pDevices, 0);
+        for (cl_uint i = 0; i < numDevices; i++)
+        {
+            cl_uint deviceAlign = 0;
+            clGetDeviceInfo(pDevices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &deviceAlign, 0);
+            deviceAlign /= 8; // returns bits! want bytes.
+            if (deviceAlign > m_bufferAlignment)
+            {
+                m_bufferAlignment = deviceAlign;
+            }
+            if (deviceAlign > m_subBufferAlignment)
+            {
+                m_subBufferAlignment = deviceAlign;
+            }
+        }
+        delete [] pDevices;
+    }
+
+    return m_bufferAlignment;
+}
+
+cl_uint CLU_Runtime::GetSubBufferAlignment()
+{
+    GetBufferAlignment(); // computes both
+    return m_subBufferAlignment;
+}
+
+//-----------------------------------------------------------------------------
+// distinct device types in the context
+// CLU keeps one queue per device type, so this is also one entry per queue
+//-----------------------------------------------------------------------------
+cl_uint CLU_Runtime::GetDeviceTypes(cl_device_type* out_types)
+{
+    cl_uint numTypes = 0;
+    for (cl_uint d = 0; d < m_numDevices; d++)
+    {
+        cl_device_type deviceType = 0;
+        clGetDeviceInfo(m_deviceIds[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &deviceType, 0);
+        deviceType &= ~CL_DEVICE_TYPE_DEFAULT;
+        if (out_types + numTypes == std::find(out_types, out_types + numTypes, deviceType))
+        {
+            out_types[numTypes++] = deviceType;
+        }
+    }
+    return numTypes;
+}
+
+//-----------------------------------------------------------------------------
+// relative weights for splitting a kernel across devices
+//   before a kernel has been measured on a device, guess from compute units * clock,
+//   scaled to items/sec by the devices that were measured.
+//   every device keeps a small share, so it is measured again as loads change
+//-----------------------------------------------------------------------------
+#define CLU_SPLIT_MIN_SHARE 0.02
+
+void CLU_Runtime::GetSplitWeights(cl_kernel in_kernel, cl_uint in_numDevices,
+    const cl_device_type* in_types, double* out_weights)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<cl_kernel, SplitThroughput>::const_iterator iter = m_splitThroughput.find(in_kernel);
+    double guesses[CLU_MAX_NUM_DEVICES];
+    double measured = 0;        // items/sec of the measured devices
+    double measuredGuesses = 0; // and their guesses
+    for (cl_uint i = 0; i < in_numDevices; i++)
+    {
+        cl_uint computeUnits = 1;
+        cl_uint clockFrequency = 1;
+        cl_device_id deviceId = m_device_type_to_id.GetDevice(in_types[i]);
+        clGetDeviceInfo(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, 0);
+        clGetDeviceInfo(deviceId, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clockFrequency, 0);
+        guesses[i] = (double)computeUnits * (double)clockFrequency;
+
+        int index = m_device_type_to_id.GetIndexFromType(in_types[i]);
+        out_weights[i] = (iter != m_splitThroughput.end()) ? iter->second.m_itemsPerSecond[index] : 0;
+        if (out_weights[i] > 0)
+        {
+            measured += out_weights[i];
+            measuredGuesses += guesses[i];
+        }
+    }
+
+    double scale = (measuredGuesses > 0) ? (measured / measuredGuesses) : 1.0;
+    double total = 0;
+    for (cl_uint i = 0; i < in_numDevices; i++)
+    {
+        if (0 == out_weights[i])
+        {
+            out_weights[i] = guesses[i] * scale;
+        }
+        total += out_weights[i];
+    }
+    for (cl_uint i = 0; i < in_numDevices; i++)
+    {
+        out_weights[i] = std::max(out_weights[i], total * CLU_SPLIT_MIN_SHARE);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// record the throughput of a slice
+//   a moving average, so the split adapts as the load on each device changes
+//-----------------------------------------------------------------------------
+void CLU_Runtime::AddSplitThroughput(cl_kernel in_kernel, cl_device_type in_type, double in_itemsPerSecond)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int index = m_device_type_to_id.GetIndexFromType(in_type);
+    std::map<cl_kernel, SplitThroughput>::iterator iter = m_splitThroughput.find(in_kernel);
+    if (iter == m_splitThroughput.end())
+    {
+        SplitThroughput t;
+        memset(&t, 0, sizeof(t));
+        iter = m_splitThroughput.insert(std::make_pair(in_kernel, t)).first;
+    }
+    double& tp = iter->second.m_itemsPerSecond[index];
+    tp = (0 == tp) ? in_itemsPerSecond : (0.75 * tp + 0.25 * in_itemsPerSecond);
+}
+
+//**********************************************************************************
+// clu API (extern "C")
+//**********************************************************************************
+
+//-----------------------------------------------------------------------------
+// Start using clu
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluInitialize(clu_initialize_params* params)
+{
+    try
+    {
+        clu_initialize_params defaultParams = {0, 0, 0, 0, 0, CL_DEVICE_TYPE_ALL, 0, 0};
+        if (params)
+        {
+            clu_initialize_params temp = {
+                params->vendor_name, params->existing_context,
+                params->compile_options, params->default_queue_props,
+                params->default_context_props, params->preferred_device_type,
+                params->runtime_flags, params->trace_file};
+            defaultParams = temp;
+        }
+        return CLU_Runtime::Get().Initialize(defaultParams);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        return CL_DEVICE_NOT_FOUND;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// has clu been initialized?
+//-----------------------------------------------------------------------------
+cl_bool CLU_API_CALL
+    cluIsInitialized(void)
+{
+    try
+    {
+        return CLU_Runtime::Get().GetIsInitialized();
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        return false;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// release all memory associated with clu
+//-----------------------------------------------------------------------------
+void CLU_API_CALL
+cluRelease(void)
+{
+    ApiScope scope(CLU_CALL_RELEASE, "cluRelease", 0);
+    try
+    {
+        CLU_Runtime::Get().Reset();
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {}
+}
+
+//-----------------------------------------------------------------------------
+// return the runtime context
+//   may have been created by the runtime, or provided with cluInitialize
+//-----------------------------------------------------------------------------
+cl_context CLU_API_CALL cluGetContext()
+{
+    return CLU_Runtime::Get().GetContext();
+}
+
+//-----------------------------------------------------------------------------
+// return cl device associated with device type
+//-----------------------------------------------------------------------------
+cl_device_id CLU_API_CALL
+cluGetDevice(cl_device_type in_clDeviceType)
+{
+    return CLU_Runtime::Get().GetDevice(in_clDeviceType);
+}
+
+//-----------------------------------------------------------------------------
+// Return cl_platform_id
+//   may have been chosen by the runtime, or provided with cluInitialize
+//-----------------------------------------------------------------------------
+cl_platform_id CLU_API_CALL cluGetPlatform()
+{
+    return CLU_Runtime::Get().GetPlatform();
+}
+
+//-----------------------------------------------------------------------------
+// Return cl_command_queue associated with cl_device_id
+//-----------------------------------------------------------------------------
+cl_command_queue CLU_API_CALL
+cluGetCommandQueue(cl_device_type in_clDeviceType,
+                  cl_int * errcode_ret)
+{
+    return CLU_Runtime::Get().GetCommandQueue(in_clDeviceType, errcode_ret);
+}
+
+//-----------------------------------------------------------------------------
+// profiling and tracing: read the timestamps of a completed command
+//-----------------------------------------------------------------------------
+struct ProfiledCommand
+{
+    cl_ulong    m_generation; // of the kernel profiler at launch, 0 if not profiled
+    std::string m_name;
+    cl_ulong    m_hostSubmit; // host time just before the enqueue, 0 if unknown
+};
+
+void CL_CALLBACK CLU_ProfileCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+{
+    ProfiledCommand* pCommand = (ProfiledCommand*)in_data;
+    cl_ulong times[4] = {0};
+    const cl_profiling_info info[4] = {
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    cl_int status = (CL_COMPLETE == in_eventStatus) ? CL_SUCCESS : in_eventStatus; // failed, nothing to measure
+    for (int i = 0; (i < 4) && (CL_SUCCESS == status); i++)
+    {
+        // fails e.g. if the queue was created without CL_QUEUE_PROFILING_ENABLE
+        status = clGetEventProfilingInfo(in_event, info[i], sizeof(cl_ulong), &times[i], 0);
+    }
+
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+        if ((CL_SUCCESS == status) && pCommand->m_generation)
+        {
+            runtime.GetKernelProfiler().Add(pCommand->m_name, pCommand->m_generation, times);
+        }
+        if ((CL_SUCCESS == status) && runtime.GetTracer().IsEnabled())
+        {
+            cl_command_queue queue = 0;
+            clGetEventInfo(in_event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, 0);
+            runtime.GetTracer().AddDeviceSpan(pCommand->m_name, queue, pCommand->m_hostSubmit, times);
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+    }
+    delete pCommand;
+}
+
+//-----------------------------------------------------------------------------
+// internal: measure a command when it completes. takes ownership of in_pCommand
+//-----------------------------------------------------------------------------
+void WatchProfiledCommand(cl_event in_event, ProfiledCommand* in_pCommand)
+{
+    cl_int status = clSetEventCallback(in_event, CL_COMPLETE, CLU_ProfileCallback, in_pCommand);
+    if (CL_SUCCESS != status)
+    {
+        delete in_pCommand;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// internal: align the clock of a queue that carries only commands clu did not enqueue
+// a marker is timed like a launch: host time before the enqueue against its QUEUED time
+//-----------------------------------------------------------------------------
+void CL_CALLBACK CLU_TraceClockCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+{
+    cl_ulong* pHostSubmit = (cl_ulong*)in_data;
+    cl_command_queue queue = 0;
+    cl_ulong queued = 0;
+    clGetEventInfo(in_event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, 0);
+    if ((CL_COMPLETE != in_eventStatus) ||
+        (CL_SUCCESS != clGetEventProfilingInfo(in_event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, 0)))
+    {
+        *pHostSubmit = 0; // failed, a later command may sample again
+    }
+    try
+    {
+        CLU_Runtime::Get().GetTracer().AddClockSample(queue, *pHostSubmit, queued);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+    }
+    delete pHostSubmit;
+}
+
+void SampleQueueClock(cl_command_queue in_queue)
+{
+    Tracer& tracer = CLU_Runtime::Get().GetTracer();
+    cl_ulong* pHostSubmit = 0;
+    try
+    {
+        pHostSubmit = new cl_ulong(GetHostTimeNs());
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        tracer.AddClockSample(in_queue, 0, 0);
+        return;
+    }
+    cl_event marker = 0;
+    cl_int status = clEnqueueMarkerWithWaitList(in_queue, 0, 0, &marker);
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        status = clSetEventCallback(marker, CL_COMPLETE, CLU_TraceClockCallback, pHostSubmit);
+        RecycleEvent(marker); // the callback keeps the event alive until it is called
+        clFlush(in_queue);
+    }
+    if (CL_SUCCESS != status)
+    {
+        delete pHostSubmit;
+        tracer.AddClockSample(in_queue, 0, 0);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// internal: enqueue a kernel over an nd range
+// all kernel launches made by clu go through here
+//-----------------------------------------------------------------------------
+cl_int EnqueueRange(cl_command_queue in_queue, cl_kernel in_kernel, const clu_nd_range& in_range,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents, cl_event* out_pEvent)
+{
+    const size_t * offset = (!in_range.offset[0] && !in_range.offset[1] && !in_range.offset[2]) ? 0 : in_range.offset;
+    const size_t * local  = (!in_range.local[0]  && !in_range.local[1]  && !in_range.local[2])  ? 0 : in_range.local;
+
+    CLU_Runtime& runtime = CLU_Runtime::Get();
+    if (!runtime.IsProfiling() && !runtime.GetTracer().IsEnabled())
+    {
+        return clEnqueueNDRangeKernel(in_queue, in_kernel, in_range.dim, offset, in_range.global, local,
+            in_numWaitEvents, in_waitEvents, out_pEvent);
+    }
+
+    // profiling and tracing need an event, even if the caller did not ask for one
+    cl_event e = 0;
+    cl_ulong hostSubmit = GetHostTimeNs();
+    cl_int status = clEnqueueNDRangeKernel(in_queue, in_kernel, in_range.dim, offset, in_range.global, local,
+        in_numWaitEvents, in_waitEvents, &e);
+    if (CL_SUCCESS == status)
+    {
+        try
+        {
+            char name[CLU_UTIL_MAX_STRING_LENGTH] = {0};
+            clGetKernelInfo(in_kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name)-1, name, 0);
+            ProfiledCommand* pCommand = new ProfiledCommand;
+            pCommand->m_generation = runtime.IsProfiling() ? runtime.GetKernelProfiler().GetGeneration() : 0;
+            pCommand->m_name = name;
+            pCommand->m_hostSubmit = hostSubmit;
+            WatchProfiledCommand(e, pCommand);
+        }
+        catch (...) // internal error, e.g. thrown by STL. The launch itself succeeded.
+        {
+        }
+        if (out_pEvent)
+        {
+            *out_pEvent = e;
+        }
+        else
+        {
+            NoteEventCreated();
+            RecycleEvent(e);
+        }
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// move buffers to a device (or the host) on that device's clu queue, and count the move
+//-----------------------------------------------------------------------------
+void CL_CALLBACK CLU_ForgetResidencyCallback(cl_mem in_mem, void* in_data)
+{
+    in_data = 0; // unused, fixes compile warning about unused param.
+    CLU_Runtime::Get().GetMigrationTracker().Forget(in_mem);
+}
+
+cl_int Migrate(const cl_mem* in_buffers, cl_uint in_numBuffers, cl_device_type in_device, cl_bitfield in_flags,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents, cl_event* out_pEvent)
+{
+#ifdef CL_VERSION_1_2
+    cl_int status = CL_SUCCESS;
+    cl_command_queue queue = cluGetCommandQueue(in_device ? in_device : CL_DEVICE_TYPE_DEFAULT, &status);
+    if (CL_SUCCESS == status)
+    {
+        status = clEnqueueMigrateMemObjects(queue, in_numBuffers, in_buffers, (cl_mem_migration_flags)in_flags,
+            in_numWaitEvents, in_waitEvents, out_pEvent);
+        OCL_VALIDATE(status);
+    }
+    if (CL_SUCCESS == status)
+    {
+        cl_device_id to = 0;
+        if (0 == (in_flags & CL_MIGRATE_MEM_OBJECT_HOST))
+        {
+            clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(to), &to, 0);
+        }
+        bool contentsMoved = (0 == (in_flags & CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED));
+        MigrationTracker& tracker = CLU_Runtime::Get().GetMigrationTracker();
+        for (cl_uint i = 0; i < in_numBuffers; i++)
+        {
+            tracker.NoteMigration(in_buffers[i], to, contentsMoved);
+        }
+    }
+    return status;
+#else
+    in_buffers = 0; in_numBuffers = 0; in_device = 0; in_flags = 0;       // unused
+    in_numWaitEvents = 0; in_waitEvents = 0; out_pEvent = 0;              // unused
+    return CL_INVALID_OPERATION; // clEnqueueMigrateMemObjects is OpenCL 1.2
+#endif
+}
+
+cl_int CLU_API_CALL
+cluMigrate(const cl_mem* in_buffers, cl_uint in_numBuffers, cl_device_type in_device, cl_bitfield in_flags,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents, cl_event* out_pEvent)
+{
+    if ((0 == in_buffers) || (0 == in_numBuffers))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        status = Migrate(in_buffers, in_numBuffers, in_device, in_flags, in_numWaitEvents, in_waitEvents, out_pEvent);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// enqueue a kernel
+//   prefetch buffers are migrated once the launch completes
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluEnqueue(cl_kernel kern, clu_enqueue_params* params)
+{
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_ENQUEUE, "cluEnqueue", &status, kern, &params->nd_range, params->queue);
+    cl_command_queue q = params->queue;
+    if (0 == q)
+    {
+        q = CLU_DEFAULT_Q;
+    }
+    bool prefetch = (0 != params->num_prefetch_buffers) && (0 != params->prefetch_buffers);
+    cl_event launched = 0;
+    status = EnqueueRange(q, kern, params->nd_range,
+        params->num_events_in_wait_list, params->event_wait_list,
+        prefetch ? &launched : params->out_event);
+    if (prefetch && (CL_SUCCESS == status))
+    {
+        try
+        {
+            Migrate(params->prefetch_buffers, params->num_prefetch_buffers, params->prefetch_device, 0,
+                1, &launched, 0); // a hint: the launch succeeded even if the prefetch did not
+        }
+        catch (...) // internal error, e.g. thrown by STL
+        {
+        }
+        if (params->out_event)
+        {
+            *params->out_event = launched;
+        }
+        else
+        {
+            NoteEventCreated();
+            RecycleEvent(launched);
+        }
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// default tile size for cluEnqueueTiled: split only the slowest-varying
+// dimension, into tiles of roughly this many work items
+//-----------------------------------------------------------------------------
+#define CLU_DEFAULT_TILE_WORK_ITEMS (1024*1024)
+
+//-----------------------------------------------------------------------------
+// enqueue a kernel as a sequence of tiles
+//   each tile is a sub-range of the original range, positioned with the offset
+//   tiles are enqueued in order, fastest-varying dimension first
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluEnqueueTiled(cl_kernel kern, clu_enqueue_params* params, const clu_tile_params* tile_params)
+{
+    if ((0 == kern) || (0 == params) || (params->nd_range.dim < 1) || (params->nd_range.dim > 3))
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_ENQUEUE, "cluEnqueueTiled", &status, kern, &params->nd_range, params->queue);
+    try
+    {
+        cl_command_queue q = params->queue;
+        if (0 == q)
+        {
+            q = CLU_DEFAULT_Q;
+        }
+        const clu_nd_range& range = params->nd_range;
+        const cl_uint dim = range.dim;
+
+        clu_tile_params tiling = {{0, 0, 0}, 0, 0, 0};
+        if (tile_params)
+        {
+            tiling = *tile_params;
+        }
+
+        // no tile size at all? split the slowest-varying dimension
+        if ((0 == tiling.tile[0]) && (0 == tiling.tile[1]) && (0 == tiling.tile[2]))
+        {
+            size_t rowItems = 1;
+            for (cl_uint d = 0; d < (dim-1); d++)
+            {
+                rowItems *= range.global[d];
+            }
+            size_t rows = CLU_DEFAULT_TILE_WORK_ITEMS / (rowItems ? rowItems : 1);
+            tiling.tile[dim-1] = rows ? rows : 1;
+        }
+
+        // tile sizes must be multiples of the work group size, if there is one
+        size_t tileSize[3] = {1, 1, 1};
+        size_t numTilesPerDim[3] = {1, 1, 1};
+        cl_uint numTiles = 1;
+        for (cl_uint d = 0; d < dim; d++)
+        {
+            size_t t = tiling.tile[d];
+            if ((0 == t) || (t > range.global[d]))
+            {
+                t = range.global[d];
+            }
+            if (range.local[d])
+            {
+                t -= (t % range.local[d]);
+                if (0 == t)
+                {
+                    t = range.local[d];
+                }
+            }
+            tileSize[d] = t ? t : 1;
+            numTilesPerDim[d] = (range.global[d] + tileSize[d] - 1) / tileSize[d];
+            numTiles *= (cl_uint)numTilesPerDim[d];
+        }
+
+        // tile events are only needed to report completion or to bound the tiles in flight
+        const bool keepEvents = (0 != params->out_event) || (0 != tiling.max_in_flight);
+        std::vector<cl_event> tileEvents;
+
+        for (cl_uint t = 0; t < numTiles; t++)
+        {
+            // position of this tile within the original range
+            clu_nd_range tile = range;
+            size_t index = t;
+            for (cl_uint d = 0; d < dim; d++)
+            {
+                size_t start = (index % numTilesPerDim[d]) * tileSize[d];
+                index /= numTilesPerDim[d];
+                tile.global[d] = std::min(tileSize[d], range.global[d] - start);
+                tile.offset[d] = range.offset[d] + start;
+            }
+
+            // bound the number of tiles in flight
+            if (tiling.max_in_flight && (t >= tiling.max_in_flight))
+            {
+                status = clWaitForEvents(1, &tileEvents[t - tiling.max_in_flight]);
+                OCL_VALIDATE(status);
+                if (CL_SUCCESS != status) break;
+            }
+
+            cl_event tileEvent = 0;
+            status = EnqueueRange(q, kern, tile,
+                params->num_events_in_wait_list, params->event_wait_list, keepEvents ? &tileEvent : 0);
+            OCL_VALIDATE(status);
+            if (CL_SUCCESS != status) break;
+            if (keepEvents)
+            {
+                NoteEventCreated();
+                tileEvents.push_back(tileEvent);
+            }
+
+            // submit this tile now, so the device makes progress while we enqueue the next
+            clFlush(q);
+
+            if (tiling.callback && (CL_FALSE == tiling.callback(&tile, t, numTiles, tiling.user_data)))
+            {
+                break; // cancelled by the application
+            }
+        }
+
+        // report completion of every tile that was enqueued
+        if (params->out_event)
+        {
+            *params->out_event = 0;
+            if ((CL_SUCCESS == status) && tileEvents.size())
+            {
+                status = clEnqueueMarkerWithWaitList(q, (cl_uint)tileEvents.size(), &tileEvents[0], params->out_event);
+                OCL_VALIDATE(status);
+            }
+        }
+        for (size_t i = 0; i < tileEvents.size(); i++)
+        {
+            RecycleEvent(tileEvents[i]);
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// bookkeeping for cluEnqueueSplit
+//   one SplitLaunch is shared by all the slices of a call
+//   each slice reports its throughput from an event callback
+//-----------------------------------------------------------------------------
+struct SplitLaunch
+{
+    std::atomic<cl_uint> m_remaining; // slices in flight, +1 while still enqueueing
+    std::atomic<cl_int>  m_status;    // error reported by any slice
+    cl_event             m_doneEvent; // user event, may be 0
+};
+
+struct SplitSlice
+{
+    SplitLaunch*   m_pLaunch;
+    cl_kernel      m_kernel;
+    cl_device_type m_deviceType;
+    size_t         m_numItems;
+    cl_ulong       m_submitTime;
+};
+
+void FinishSplitSlice(SplitLaunch* in_pLaunch)
+{
+    if (1 == in_pLaunch->m_remaining--)
+    {
+        if (in_pLaunch->m_doneEvent)
+        {
+            cl_int status = in_pLaunch->m_status;
+            clSetUserEventStatus(in_pLaunch->m_doneEvent, (status < 0) ? status : CL_COMPLETE);
+            RecycleEvent(in_pLaunch->m_doneEvent);
+        }
+        delete in_pLaunch;
+    }
+}
+
+void CL_CALLBACK CLU_SplitSliceCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+{
+    in_event = 0; // unused, remove compiler warning
+    SplitSlice* pSlice = (SplitSlice*)in_data;
+    if (CL_COMPLETE == in_eventStatus)
+    {
+        double seconds = (double)(GetHostTimeNs() - pSlice->m_submitTime) * 1e-9;
+        if (seconds > 0)
+        {
+            CLU_Runtime::Get().AddSplitThroughput(pSlice->m_kernel, pSlice->m_deviceType,
+                (double)pSlice->m_numItems / seconds);
+        }
+    }
+    else
+    {
+        pSlice->m_pLaunch->m_status = in_eventStatus;
+    }
+    FinishSplitSlice(pSlice->m_pLaunch);
+    delete pSlice;
+}
+
+//-----------------------------------------------------------------------------
+// enqueue a kernel across several devices
+//   the slowest-varying dimension is cut into one slice per device,
+//   sized by the weights. Slice boundaries are multiples of the work group size.
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluEnqueueSplit(cl_kernel kern, clu_enqueue_params* params,
+    cl_uint num_devices, const cl_device_type* devices, const float* weights)
+{
+    if ((0 == kern) || (0 == params) || (params->nd_range.dim < 1) || (params->nd_range.dim > 3))
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int status = CL_SUCCESS;
+    SplitLaunch* pLaunch = 0;
+    ApiScope scope(CLU_CALL_ENQUEUE, "cluEnqueueSplit", &status, kern, &params->nd_range, params->queue);
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+
+        // which devices?
+        cl_device_type deviceTypes[CLU_MAX_NUM_DEVICES];
+        if (devices)
+        {
+            if ((0 == num_devices) || (num_devices > CLU_MAX_NUM_DEVICES))
+            {
+                return CL_INVALID_VALUE;
+            }
+            std::copy(devices, devices + num_devices, deviceTypes);
+        }
+        else
+        {
+            num_devices = runtime.GetDeviceTypes(deviceTypes);
+        }
+
+        // how much of the range does each device get?
+        double w[CLU_MAX_NUM_DEVICES];
+        if (weights)
+        {
+            std::copy(weights, weights + num_devices, w);
+        }
+        else
+        {
+            runtime.GetSplitWeights(kern, num_devices, deviceTypes, w);
+        }
+        double totalWeight = 0;
+        for (cl_uint i = 0; i < num_devices; i++)
+        {
+            w[i] = std::max(w[i], 0.0);
+            totalWeight += w[i];
+        }
+        if (0 == totalWeight)
+        {
+            return CL_INVALID_VALUE;
+        }
+
+        const clu_nd_range& range = params->nd_range;
+        const cl_uint splitDim = range.dim - 1;
+        const size_t granularity = range.local[splitDim] ? range.local[splitDim] : 1;
+        const size_t numUnits = (range.global[splitDim] + granularity - 1) / granularity;
+        size_t otherItems = 1;
+        for (cl_uint d = 0; d < splitDim; d++)
+        {
+            otherItems *= range.global[d];
+        }
+
+        pLaunch = new SplitLaunch;
+        pLaunch->m_remaining = 1;
+        pLaunch->m_status = CL_SUCCESS;
+        pLaunch->m_doneEvent = 0;
+        if (params->out_event)
+        {
+            pLaunch->m_doneEvent = clCreateUserEvent(runtime.GetContext(), &status);
+            OCL_VALIDATE(status);
+            if (CL_SUCCESS != status)
+            {
+                delete pLaunch;
+                return status;
+            }
+            NoteEventCreated();
+            clRetainEvent(pLaunch->m_doneEvent); // one reference for the application
+            *params->out_event = pLaunch->m_doneEvent;
+        }
+
+        double cumulativeWeight = 0;
+        size_t unitStart = 0;
+        for (cl_uint i = 0; (i < num_devices) && (CL_SUCCESS == status); i++)
+        {
+            cumulativeWeight += w[i];
+            size_t unitEnd = (i == (num_devices-1)) ? numUnits :
+                (size_t)((double)numUnits * cumulativeWeight / totalWeight);
+            if (unitEnd <= unitStart)
+            {
+                continue; // this device gets nothing
+            }
+
+            clu_nd_range slice = range;
+            size_t start = unitStart * granularity;
+            slice.global[splitDim] = std::min(unitEnd * granularity, range.global[splitDim]) - start;
+            slice.offset[splitDim] = range.offset[splitDim] + start;
+            unitStart = unitEnd;
+
+            cl_command_queue q = runtime.GetCommandQueue(deviceTypes[i], &status);
+            if (CL_SUCCESS != status) break;
+
+            SplitSlice* pSlice = new SplitSlice;
+            pSlice->m_pLaunch = pLaunch;
+            pSlice->m_kernel = kern;
+            pSlice->m_deviceType = deviceTypes[i];
+            pSlice->m_numItems = otherItems * slice.global[splitDim];
+            pSlice->m_submitTime = GetHostTimeNs();
+
+            cl_event sliceEvent = 0;
+            status = EnqueueRange(q, kern, slice,
+                params->num_events_in_wait_list, params->event_wait_list, &sliceEvent);
+            OCL_VALIDATE(status);
+            if (CL_SUCCESS == status)
+            {
+                NoteEventCreated();
+                pLaunch->m_remaining++;
+                status = clSetEventCallback(sliceEvent, CL_COMPLETE, CLU_SplitSliceCallback, pSlice);
+                OCL_VALIDATE(status);
+                if (CL_SUCCESS != status)
+                {
+                    pLaunch->m_remaining--;
+                }
+                RecycleEvent(sliceEvent); // callbacks keep the event alive until they are called
+                clFlush(q);
+            }
+            if (CL_SUCCESS != status)
+            {
+                delete pSlice;
+            }
+        }
+
+        if (CL_SUCCESS != status)
+        {
+            pLaunch->m_status = status;
+        }
+        FinishSplitSlice(pLaunch); // done enqueueing
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// bookkeeping for cluEnqueueDynamic
+//   one DynamicLaunch is shared by all the chunks of a call
+//   each in-flight chunk occupies a slot belonging to one queue.
+//   when the chunk completes, its event callback reuses the slot for the next chunk.
+//-----------------------------------------------------------------------------
+struct DynamicLaunch;
+struct DynamicSlot
+{
+    DynamicLaunch* m_pLaunch;
+    cl_uint        m_queueIndex;
+};
+
+struct DynamicLaunch
+{
+    cl_kernel              m_kernel;
+    clu_nd_range           m_range;
+    size_t                 m_chunkSize;    // in the slowest-varying dimension
+    size_t                 m_numChunks;
+    std::atomic<size_t>    m_nextChunk;    // next chunk to be taken by a queue
+    std::atomic<size_t>    m_remaining;    // chunks not yet complete, +1 while still starting up
+    std::atomic<cl_int>    m_status;       // error reported by any chunk
+    cl_event               m_doneEvent;
+    std::vector<cl_event>         m_waitEvents;
+    std::vector<cl_command_queue> m_queues;
+    std::atomic<cl_uint>*         m_chunkCounts; // per queue
+    std::vector<DynamicSlot>      m_slots;
+    cl_uint*                      m_pOutChunkCounts;
+};
+
+void CL_CALLBACK CLU_DynamicChunkCallback(cl_event in_event, cl_int in_eventStatus, void* in_data);
+
+void FinishDynamicChunks(DynamicLaunch* in_pLaunch, size_t in_numChunks)
+{
+    if (in_numChunks == in_pLaunch->m_remaining.fetch_sub(in_numChunks))
+    {
+        if (in_pLaunch->m_pOutChunkCounts)
+        {
+            for (size_t q = 0; q < in_pLaunch->m_queues.size(); q++)
+            {
+                in_pLaunch->m_pOutChunkCounts[q] = in_pLaunch->m_chunkCounts[q];
+            }
+        }
+        for (size_t i = 0; i < in_pLaunch->m_waitEvents.size(); i++)
+        {
+            RecycleEvent(in_pLaunch->m_waitEvents[i]);
+        }
+        cl_int status = in_pLaunch->m_status;
+        clSetUserEventStatus(in_pLaunch->m_doneEvent, (status < 0) ? status : CL_COMPLETE);
+        RecycleEvent(in_pLaunch->m_doneEvent);
+        delete [] in_pLaunch->m_chunkCounts;
+        delete in_pLaunch;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// take the next chunk (if any) and enqueue it on the slot's queue
+// returns false if there was nothing left to take
+//-----------------------------------------------------------------------------
+bool EnqueueDynamicChunk(DynamicSlot* in_pSlot)
+{
+    DynamicLaunch* pLaunch = in_pSlot->m_pLaunch;
+    size_t chunk = pLaunch->m_nextChunk++;
+    if (chunk >= pLaunch->m_numChunks)
+    {
+        return false;
+    }
+
+    const clu_nd_range& range = pLaunch->m_range;
+    const cl_uint splitDim = range.dim - 1;
+    clu_nd_range sub = range;
+    size_t start = chunk * pLaunch->m_chunkSize;
+    sub.global[splitDim] = std::min(pLaunch->m_chunkSize, range.global[splitDim] - start);
+    sub.offset[splitDim] = range.offset[splitDim] + start;
+
+    cl_command_queue q = pLaunch->m_queues[in_pSlot->m_queueIndex];
+    cl_event chunkEvent = 0;
+    cl_int status = EnqueueRange(q, pLaunch->m_kernel, sub, (cl_uint)pLaunch->m_waitEvents.size(),
+        pLaunch->m_waitEvents.size() ? &pLaunch->m_waitEvents[0] : 0, &chunkEvent);
+    OCL_VALIDATE(status);
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        status = clSetEventCallback(chunkEvent, CL_COMPLETE, CLU_DynamicChunkCallback, in_pSlot);
+        OCL_VALIDATE(status);
+        RecycleEvent(chunkEvent); // callbacks keep the event alive until they are called
+        clFlush(q);
+    }
+
+    if (CL_SUCCESS != status)
+    {
+        // give up: retire this chunk and every chunk nobody has taken yet
+        pLaunch->m_status = status;
+        size_t next = pLaunch->m_nextChunk.exchange(pLaunch->m_numChunks);
+        size_t untaken = (next < pLaunch->m_numChunks) ? (pLaunch->m_numChunks - next) : 0;
+        FinishDynamicChunks(pLaunch, untaken + 1);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// a chunk completed: count it, and have the same queue take the next chunk
+// NOTE: this enqueues from an event callback, which only ever makes
+//       non-blocking OpenCL calls
+//-----------------------------------------------------------------------------
+void CL_CALLBACK CLU_DynamicChunkCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+{
+    in_event = 0; // unused, remove compiler warning
+    DynamicSlot* pSlot = (DynamicSlot*)in_data;
+    DynamicLaunch* pLaunch = pSlot->m_pLaunch;
+    if (CL_COMPLETE == in_eventStatus)
+    {
+        pLaunch->m_chunkCounts[pSlot->m_queueIndex]++;
+        EnqueueDynamicChunk(pSlot);
+    }
+    else
+    {
+        // this queue stops taking chunks: retire every chunk nobody has taken yet,
+        // or the launch never completes
+        pLaunch->m_status = in_eventStatus;
+        size_t next = pLaunch->m_nextChunk.exchange(pLaunch->m_numChunks);
+        size_t untaken = (next < pLaunch->m_numChunks) ? (pLaunch->m_numChunks - next) : 0;
+        FinishDynamicChunks(pLaunch, untaken + 1);
+        return;
+    }
+    FinishDynamicChunks(pLaunch, 1);
+}
+
+//-----------------------------------------------------------------------------
+// enqueue a kernel as chunks shared dynamically between queues
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluEnqueueDynamic(cl_kernel kern, clu_enqueue_params* params, const clu_dynamic_params* dynamic_params)
+{
+    if ((0 == kern) || (0 == params) || (params->nd_range.dim < 1) || (params->nd_range.dim > 3))
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_ENQUEUE, "cluEnqueueDynamic", &status, kern, &params->nd_range, params->queue);
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+        clu_dynamic_params dyn = {0, 0, 0, 0, 0};
+        if (dynamic_params)
+        {
+            dyn = *dynamic_params;
+        }
+        if (0 == dyn.max_in_flight)
+        {
+            dyn.max_in_flight = 2;
+        }
+
+        // which queues?
+        std::vector<cl_command_queue> queues;
+        if (dyn.queues)
+        {
+            queues.assign(dyn.queues, dyn.queues + dyn.num_queues);
+        }
+        else
+        {
+            cl_device_type deviceTypes[CLU_MAX_NUM_DEVICES];
+            cl_uint numTypes = runtime.GetDeviceTypes(deviceTypes);
+            for (cl_uint i = 0; (i < numTypes) && (CL_SUCCESS == status); i++)
+            {
+                queues.push_back(runtime.GetCommandQueue(deviceTypes[i], &status));
+            }
+        }
+        if (CL_SUCCESS != status) return status;
+        if (queues.empty()) return CL_INVALID_COMMAND_QUEUE;
+
+        // chunk size is a multiple of the work group size.
+        // automatic: enough chunks that each queue takes several
+        const clu_nd_range& range = params->nd_range;
+        const cl_uint splitDim = range.dim - 1;
+        const size_t granularity = range.local[splitDim] ? range.local[splitDim] : 1;
+        size_t chunkSize = dyn.chunk_size;
+        if (0 == chunkSize)
+        {
+            chunkSize = range.global[splitDim] / (queues.size() * dyn.max_in_flight * 8);
+        }
+        chunkSize -= (chunkSize % granularity);
+        if (0 == chunkSize)
+        {
+            chunkSize = granularity;
+        }
+        const size_t numChunks = (range.global[splitDim] + chunkSize - 1) / chunkSize;
+
+        cl_event doneEvent = clCreateUserEvent(runtime.GetContext(), &status);
+        OCL_VALIDATE(status);
+        if (CL_SUCCESS != status) return status;
+        NoteEventCreated();
+
+        DynamicLaunch* pLaunch = new DynamicLaunch;
+        pLaunch->m_kernel = kern;
+        pLaunch->m_range = range;
+        pLaunch->m_chunkSize = chunkSize;
+        pLaunch->m_numChunks = numChunks;
+        pLaunch->m_nextChunk = 0;
+        pLaunch->m_remaining = numChunks + 1;
+        pLaunch->m_status = CL_SUCCESS;
+        pLaunch->m_doneEvent = doneEvent;
+        pLaunch->m_queues = queues;
+        pLaunch->m_chunkCounts = new std::atomic<cl_uint>[queues.size()];
+        pLaunch->m_pOutChunkCounts = dyn.out_chunk_counts;
+        for (size_t q = 0; q < queues.size(); q++)
+        {
+            pLaunch->m_chunkCounts[q] = 0;
+        }
+        // chunks are enqueued after this returns, so hold on to the wait list
+        for (cl_uint i = 0; i < params->num_events_in_wait_list; i++)
+        {
+            clRetainEvent(params->event_wait_list[i]);
+            NoteEventCreated();
+            pLaunch->m_waitEvents.push_back(params->event_wait_list[i]);
+        }
+        pLaunch->m_slots.resize(queues.size() * dyn.max_in_flight);
+        for (size_t i = 0; i < pLaunch->m_slots.size(); i++)
+        {
+            pLaunch->m_slots[i].m_pLaunch = pLaunch;
+            pLaunch->m_slots[i].m_queueIndex = (cl_uint)(i % queues.size());
+        }
+
+        clRetainEvent(doneEvent); // keep our own reference until we are done with it
+        NoteEventCreated();
+        if (params->out_event)
+        {
+            clRetainEvent(doneEvent); // one reference for the application
+            *params->out_event = doneEvent;
+        }
+
+        // fill every slot; from here on, completing chunks take more work
+        for (size_t i = 0; i < pLaunch->m_slots.size(); i++)
+        {
+            if (!EnqueueDynamicChunk(&pLaunch->m_slots[i]))
+            {
+                break;
+            }
+        }
+        FinishDynamicChunks(pLaunch, 1); // done starting up. NOTE: pLaunch may be gone now
+
+        // no event requested? the kernel arguments may change as soon as we return, so wait
+        if (0 == params->out_event)
+        {
+            status = clWaitForEvents(1, &doneEvent);
+        }
+        RecycleEvent(doneEvent);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// cluStream
+//   chunks cycle through a ring of slots. each slot has host staging memory
+//   and device buffers for one chunk. a slot is busy until its download
+//   completes: reusing it waits for that, and hands the output to the
+//   consumer first, which throttles the producer to the device's pace.
+//-----------------------------------------------------------------------------
+cl_int WaitForEvents(const cl_event* in_events, cl_uint in_numEvents, const clu_wait_policy* in_pPolicy);
+
+struct StreamSlot
+{
+    HostAllocator::Allocation* m_pInput;
+    HostAllocator::Allocation* m_pOutput;
+    cl_mem   m_input;
+    cl_mem   m_output;
+    cl_event m_downloaded; // 0 if the slot is free
+    cl_uint  m_chunk;
+    size_t   m_outputBytes;
+};
+
+// wait for a slot's download and consume its output. returns false to stop the stream
+bool RetireStreamSlot(StreamSlot& in_slot, const clu_stream_params& in_params, bool in_consume,
+    cl_int& out_status, clu_stream_stats& out_stats)
+{
+    if (0 == in_slot.m_downloaded)
+    {
+        return true;
+    }
+    cl_int status = WaitForEvents(&in_slot.m_downloaded, 1, 0);
+    RecycleEvent(in_slot.m_downloaded);
+    in_slot.m_downloaded = 0;
+
+    if (CL_SUCCESS != status)
+    {
+        out_status = status;
+        return false;
+    }
+    out_stats.output_bytes += in_slot.m_outputBytes;
+    if (in_consume && in_params.consumer)
+    {
+        return CL_FALSE != in_params.consumer(in_slot.m_pOutput->m_ptr, in_slot.m_outputBytes,
+            in_slot.m_chunk, in_params.user_data);
+    }
+    return true;
+}
+
+cl_int EnqueueStreamChunk(StreamSlot& in_slot, const clu_stream_params& in_params, size_t in_inputBytes,
+    cl_command_queue in_upload, cl_command_queue in_compute, cl_command_queue in_download)
+{
+    clu_enqueue_params enqueueParams = cluGetDefaultParams();
+    in_slot.m_outputBytes = in_params.output_chunk_size;
+    cl_int status = in_params.launch(in_params.kernel, in_slot.m_input, in_slot.m_output, in_inputBytes,
+        in_slot.m_chunk, &enqueueParams, &in_slot.m_outputBytes, in_params.user_data);
+    if (CL_SUCCESS != status)
+    {
+        return status;
+    }
+    if ((enqueueParams.nd_range.dim < 1) || (enqueueParams.nd_range.dim > 3) ||
+        (in_slot.m_outputBytes > in_params.output_chunk_size))
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_event uploaded = 0;
+    cl_event computed = 0;
+    status = clEnqueueWriteBuffer(in_upload, in_slot.m_input, CL_FALSE, 0, in_inputBytes,
+        in_slot.m_pInput->m_ptr, 0, 0, &uploaded);
+    OCL_VALIDATE(status);
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        status = EnqueueRange(in_compute, in_params.kernel, enqueueParams.nd_range, 1, &uploaded, &computed);
+        OCL_VALIDATE(status);
+        RecycleEvent(uploaded);
+    }
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        if (in_slot.m_outputBytes)
+        {
+            status = clEnqueueReadBuffer(in_download, in_slot.m_output, CL_FALSE, 0, in_slot.m_outputBytes,
+                in_slot.m_pOutput->m_ptr, 1, &computed, &in_slot.m_downloaded);
+        }
+        else
+        {
+            status = clEnqueueMarkerWithWaitList(in_download, 1, &computed, &in_slot.m_downloaded);
+        }
+        OCL_VALIDATE(status);
+        RecycleEvent(computed);
+    }
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        clFlush(in_upload);
+        clFlush(in_compute);
+        clFlush(in_download);
+    }
+    else
+    {
+        in_slot.m_downloaded = 0;
+        if (uploaded)
+        {
+            // nothing left to wait on, but the upload may still read the staging memory the caller frees
+            clFinish(in_upload);
+            clFinish(in_compute);
+            clFinish(in_download);
+        }
+    }
+    return status;
+}
+
+cl_int CLU_API_CALL
+cluStream(const clu_stream_params* params, clu_stream_stats* out_stats)
+{
+    if ((0 == params) || (0 == params->kernel) || (0 == params->producer) || (0 == params->launch) ||
+        (0 == params->input_chunk_size))
+    {
+        return CL_INVALID_VALUE;
+    }
+
+    cl_int status = CL_SUCCESS;
+    clu_stream_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    const cl_uint numSlots = params->num_buffers ? params->num_buffers : 3;
+    std::vector<StreamSlot> slots;
+    cl_command_queue ownedQueues[2] = {0, 0};
+    cl_ulong start = GetHostTimeNs();
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+        HostAllocator& allocator = runtime.GetHostAllocator();
+
+        // upload and download get queues of their own, so they overlap with compute
+        cl_command_queue compute = params->compute_queue ? params->compute_queue : CLU_DEFAULT_Q;
+        cl_command_queue upload = params->upload_queue;
+        cl_command_queue download = params->download_queue;
+        cl_device_id device = 0;
+        status = clGetCommandQueueInfo(compute, CL_QUEUE_DEVICE, sizeof(device), &device, 0);
+        if ((CL_SUCCESS == status) && (0 == upload))
+        {
+            upload = ownedQueues[0] = runtime.CreateCommandQueue(device, 0, &status);
+        }
+        if ((CL_SUCCESS == status) && (0 == download))
+        {
+            download = ownedQueues[1] = runtime.CreateCommandQueue(device, 0, &status);
+        }
+
+        StreamSlot emptySlot = {0, 0, 0, 0, 0, 0, 0};
+        slots.resize(numSlots, emptySlot);
+        const cl_uint alignment = runtime.GetBufferAlignment();
+        const size_t outputSize = params->output_chunk_size ? params->output_chunk_size : 1;
+        for (cl_uint i = 0; (i < numSlots) && (CL_SUCCESS == status); i++)
+        {
+            StreamSlot& slot = slots[i];
+            slot.m_pInput = allocator.Allocate(params->input_chunk_size, alignment, false);
+            slot.m_pOutput = allocator.Allocate(outputSize, alignment, false);
+            if ((0 == slot.m_pInput) || (0 == slot.m_pOutput))
+            {
+                status = CL_OUT_OF_HOST_MEMORY;
+                break;
+            }
+            if (!WithinMemoryLimit(params->input_chunk_size + outputSize, &status))
+            {
+                break;
+            }
+            slot.m_input = clCreateBuffer(CLU_CONTEXT, CL_MEM_READ_ONLY, params->input_chunk_size, 0, &status);
+            if (CL_SUCCESS == status)
+            {
+                TrackMemObject(slot.m_input, params->input_chunk_size, CL_MEM_READ_ONLY, "cluStream");
+                slot.m_output = clCreateBuffer(CLU_CONTEXT, CL_MEM_WRITE_ONLY, outputSize, 0, &status);
+            }
+            else
+            {
+                ReleaseMemoryReservation(params->input_chunk_size);
+            }
+            if (CL_SUCCESS == status)
+            {
+                TrackMemObject(slot.m_output, outputSize, CL_MEM_WRITE_ONLY, "cluStream");
+            }
+            else
+            {
+                ReleaseMemoryReservation(outputSize);
+            }
+        }
+
+        // produce into the oldest slot once it is free, until input runs out
+        bool consume = true; // until the consumer stops the stream
+        for (cl_uint chunk = 0; CL_SUCCESS == status; chunk++)
+        {
+            StreamSlot& slot = slots[chunk % numSlots];
+            cl_ulong waitStart = GetHostTimeNs();
+            consume = RetireStreamSlot(slot, *params, true, status, stats);
+            stats.stall_ns += GetHostTimeNs() - waitStart;
+            if (!consume)
+            {
+                break;
+            }
+            size_t inputBytes = params->producer(slot.m_pInput->m_ptr, params->input_chunk_size, chunk, params->user_data);
+            if (0 == inputBytes)
+            {
+                break;
+            }
+            if (inputBytes > params->input_chunk_size)
+            {
+                status = CL_INVALID_VALUE;
+                break;
+            }
+            slot.m_chunk = chunk;
+            status = EnqueueStreamChunk(slot, *params, inputBytes, upload, compute, download);
+            if (CL_SUCCESS != status)
+            {
+                break;
+            }
+            stats.chunks++;
+            stats.input_bytes += inputBytes;
+        }
+
+        // drain the chunks still in flight, oldest first
+        consume = consume && (CL_SUCCESS == status);
+        for (cl_uint i = 0; i < numSlots; i++)
+        {
+            StreamSlot& slot = slots[(stats.chunks + i) % numSlots];
+            consume = RetireStreamSlot(slot, *params, consume, status, stats) && consume;
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        StreamSlot& slot = slots[i];
+        if (slot.m_downloaded)
+        {
+            clWaitForEvents(1, &slot.m_downloaded);
+            RecycleEvent(slot.m_downloaded);
+        }
+        if (slot.m_input) clReleaseMemObject(slot.m_input);
+        if (slot.m_output) clReleaseMemObject(slot.m_output);
+        if (slot.m_pInput) CLU_Runtime::Get().GetHostAllocator().Free(slot.m_pInput);
+        if (slot.m_pOutput) CLU_Runtime::Get().GetHostAllocator().Free(slot.m_pOutput);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (ownedQueues[i]) clReleaseCommandQueue(ownedQueues[i]);
+    }
+
+    if (out_stats)
+    {
+        stats.elapsed_ns = GetHostTimeNs() - start;
+        stats.bytes_per_second = stats.elapsed_ns ? (double)stats.input_bytes * 1e9 / (double)stats.elapsed_ns : 0.0;
+        *out_stats = stats;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// enqueue a marker, so the application can synchronize without asking
+// every launch for an event
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluEnqueueMarker(cl_command_queue queue, cl_event* out_event)
+{
+    if (0 == out_event)
+    {
+        return CL_INVALID_VALUE;
+    }
+    if (0 == queue)
+    {
+        queue = CLU_DEFAULT_Q;
+    }
+    cl_int status = clEnqueueMarkerWithWaitList(queue, 0, 0, out_event);
+    OCL_VALIDATE(status);
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// hand an event to clu to be released in a batch
+// the application's reference becomes clu's: counted as created and released
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluRecycleEvent(cl_event event)
+{
+    if (0 == event)
+    {
+        return CL_INVALID_EVENT;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        CLU_Runtime::Get().GetEventRecycler().Adopt(event);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// release all recycled events now
+//-----------------------------------------------------------------------------
+void CLU_API_CALL
+cluFlushRecycledEvents(void)
+{
+    try
+    {
+        CLU_Runtime::Get().GetEventRecycler().Flush();
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {}
+}
+
+//-----------------------------------------------------------------------------
+// return event counters
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluGetEventStats(clu_event_stats* out_stats)
+{
+    if (0 == out_stats)
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        CLU_Runtime::Get().GetEventRecycler().GetStats(*out_stats);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// get build errors (as a string) from a cl_program
+//-----------------------------------------------------------------------------
+const char * CLU_API_CALL cluGetBuildErrors(cl_program in_program)
+{
+    const char* errors = 0;
+    try
+    {
+        errors = CLU_Runtime::Get().GetBuildErrors(in_program);
+    }
+    catch (...)
+    {
+    }
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+// Build a program for all current devices from source
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildSource(const char* in_source,
+              size_t source_length, /* may be zero */
+              const char* in_buildOptions, /* may be NULL */
+              cl_int * errcode_ret) /* may be NULL */
+{
+    cl_program program = 0;
+    cl_int status = CL_INVALID_VALUE;
+
+    size_t* pLength = 0;
+    if (0 != source_length)
+    {
+        pLength = &source_length;
+    }
+
+    try
+    {
+        program = CLU_Runtime::Get().BuildProgram(1, &in_source, pLength, in_buildOptions, &status);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// Build a program for all current devices from binary
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildBinary(size_t binary_length,
+              const unsigned char* in_binary,
+              const char* in_buildOptions, /* may be NULL */
+              cl_int * errcode_ret) /* may be NULL */
+{
+    cl_program program = 0;
+    cl_int status = CL_INVALID_VALUE;
+
+    size_t* pLength = 0;
+    if (0 != binary_length)
+    {
+        pLength = &binary_length;
+    }
+
+    try
+    {
+        program = CLU_Runtime::Get().BuildProgram(1, pLength, &in_binary, in_buildOptions, &status);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// Build a program for all current devices from source
+//   can override global build options
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildSourceArray(cl_uint num_sources,
+                   const char** sources,
+                   const size_t* source_lengths, /* may be NULL */
+                   const char*  in_buildOptions, /* may be NULL */
+                   cl_int * errcode_ret)         /* may be NULL */
+{
+    cl_program program = 0;
+    cl_int status = CL_INVALID_VALUE;
+    try
+    {
+        // was this build called by the clu code generator?
+        // if so, we should be smart about handling the program object
+        if (0 == strncmp(CLU_MAGIC_BUILD_FLAG, in_buildOptions, strlen(CLU_MAGIC_BUILD_FLAG)))
+        {
+            // this will retrieve it from a hash or build it if it's not there:
+            program = CLU_Runtime::Get().HashProgram(num_sources, sources, source_lengths, &status);
+        }
+        else
+        {
+            program = CLU_Runtime::Get().BuildProgram(num_sources, sources, source_lengths,
+                in_buildOptions, &status);
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// Build a program for all current devices from binary
+//   can override global build options
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildBinaryArray(cl_uint num_binaries,
+                   const size_t* binary_lengths,
+                   const unsigned char** binaries,
+                   const char*  in_buildOptions, /* may be NULL */
+                   cl_int * errcode_ret)         /* may be NULL */
+{
+    cl_program program = 0;
+    cl_int status = CL_INVALID_VALUE;
+    try
+    {
+        program = CLU_Runtime::Get().BuildProgram(num_binaries, binary_lengths, binaries,
+            in_buildOptions, &status);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// convert a source file into a cl_program
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildSourceFromFile(const char* in_pFileName,
+                       const char* in_buildOptions, /* may be NULL */
+                       cl_int * errcode_ret) /* may be NULL */
+{
+    cl_int status = CL_INVALID_VALUE;
+    cl_program program = 0;
+    try
+    {
+        if (in_pFileName)
+        {
+            std::ifstream ifs(in_pFileName, std::ios::in);
+            if (ifs.is_open())
+            {
+                std::string s((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                program = cluBuildSource((const char *) s.c_str(), s.size(), in_buildOptions, &status);
+                ifs.close();
+            }
+        } // end if non-null file name string
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// convert a binary file into a cl_program
+//-----------------------------------------------------------------------------
+cl_program CLU_API_CALL
+cluBuildBinaryFromFile(const char* in_pFileName,
+                       const char* in_buildOptions, /* may be NULL */
+                       cl_int * errcode_ret) /* may be NULL */
+{
+    cl_int status = CL_INVALID_VALUE;
+    cl_program program = 0;
+    try
+    {
+        if (in_pFileName)
+        {
+            std::ifstream ifs(in_pFileName, std::ios::in | std::ios::binary);
+            if (ifs.is_open())
+            {
+                std::string s((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                program = cluBuildBinary(s.size(), (const unsigned char *) s.c_str(), in_buildOptions, &status);
+                ifs.close();
+            }
+        } // end if non-null file name string
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    if (errcode_ret)
+    {
+        *errcode_ret = status;
+    }
+    return program;
+}
+
+//-----------------------------------------------------------------------------
+// release a buffer and its aligned host memory
+// (expects created with cluCreateAlignedBuffer)
+//-----------------------------------------------------------------------------
+void CL_CALLBACK CLU_ReleaseAlignedBufferCallback(cl_mem in_buffer, void* in_pAllocation)
+{
+    in_buffer = 0; // unused, fixes compile warning about unused param.
+    CLU_Runtime::Get().GetHostAllocator().Free((HostAllocator::Allocation*)in_pAllocation);
+}
+
+//-----------------------------------------------------------------------------
+// internal: allocate host memory aligned for optimal access and create a buffer using it
+// in_size is rounded up to the alignment
+//-----------------------------------------------------------------------------
+bool BindToNumaNode(void* in_ptr, size_t in_size, cl_int in_numaNode, bool in_move);
+void CheckZeroCopy(cl_mem in_buffer, void* in_pHostPtr, size_t in_size);
+
+cl_mem CreateAlignedBuffer(
+    cl_mem_flags in_flags,
+    size_t in_size,
+    void** out_pPtr,
+    cl_int* out_pStatus,
+    const char* in_pSite, // clu call, for memory accounting
+    cl_int in_numaNode = CLU_NUMA_NODE_ANY)
+{
+    cl_int status = CL_INVALID_VALUE;
+    cl_mem mem = 0;
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+        HostAllocator::Allocation* pAllocation = 0;
+        bool reserved = false; // against the soft limit
+        bool hugePages = (0 != (in_flags & CLU_MEM_HUGE_PAGES)) || runtime.UseHugePages();
+        in_flags &= ~CLU_MEM_HUGE_PAGES;
+
+        // create aligned host memory
+        if (in_size)
+        {
+            cl_uint alignment = runtime.GetBufferAlignment();
+
+            // round size up to the alignment.
+            // some architectures require aligned size for 0-copy to work properly.
+            in_size += (alignment - 1);
+            in_size &= ~(alignment - 1);
+
+            if (WithinMemoryLimit(in_size, &status))
+            {
+                reserved = true;
+                pAllocation = runtime.GetHostAllocator().Allocate(in_size, alignment, hugePages);
+            }
+        }
+
+        // before the pages are first touched, by clCreateBuffer or by the application.
+        // if binding fails, the pages land wherever they are touched, as usual
+        if (pAllocation && (CLU_NUMA_NODE_ANY != in_numaNode))
+        {
+            BindToNumaNode(pAllocation->m_ptr, pAllocation->m_size, in_numaNode, true);
+        }
+
+        // wrap aligned host memory in an OpenCL buffer
+        if (pAllocation)
+        {
+            mem = clCreateBuffer(CLU_CONTEXT, in_flags | CL_MEM_USE_HOST_PTR, in_size, pAllocation->m_ptr, &status);
+        }
+
+        // set a callback to automatically free the host memory when the OpenCL buffer is destroyed
+        if (mem)
+        {
+            status = clSetMemObjectDestructorCallback(mem, CLU_ReleaseAlignedBufferCallback, pAllocation);
+            TrackMemObject(mem, in_size, in_flags | CL_MEM_USE_HOST_PTR, in_pSite);
+            if (out_pPtr)
+            {
+                *out_pPtr = pAllocation->m_ptr;
+            }
+            if (runtime.CheckZeroCopy())
+            {
+                CheckZeroCopy(mem, pAllocation->m_ptr, in_size);
+            }
+        }
+        else
+        {
+            if (CL_SUCCESS == status)
+            {
+                status = CL_OUT_OF_HOST_MEMORY;
+            }
+            if (pAllocation)
+            {
+                runtime.GetHostAllocator().Free(pAllocation);
+            }
+            if (reserved)
+            {
+                ReleaseMemoryReservation(in_size);
+            }
+        }
+    }
+    catch (...)
+    {
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+//-----------------------------------------------------------------------------
+// allocate host memory aligned for optimal access and create a buffer using it
+//-----------------------------------------------------------------------------
+cl_mem CLU_API_CALL cluCreateAlignedBuffer(
+    cl_mem_flags in_flags,
+    size_t in_size,
+    void** out_pPtr,
+    cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateAlignedBuffer", &status, 0, 0, 0, in_size);
+    cl_mem mem = CreateAlignedBuffer(in_flags, in_size, out_pPtr, &status, "cluCreateAlignedBuffer");
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+//-----------------------------------------------------------------------------
+// NUMA placement
+//   system calls rather than libnuma, so clu has no extra dependency.
+//   mbind applies to pages not yet touched, and with MPOL_MF_MOVE, moves the
+//   ones already touched. move_pages with no target nodes reports page locations.
+//-----------------------------------------------------------------------------
+#define CLU_MPOL_BIND    2
+#define CLU_MPOL_MF_MOVE (1 << 1)
+#define CLU_MAX_NUMA_NODES 1024
+#define CLU_NUMA_SAMPLE_PAGES 64 // pages sampled to find where a buffer is
+
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+#define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+typedef struct
+{
+    cl_uint pci_domain;
+    cl_uint pci_bus;
+    cl_uint pci_device;
+    cl_uint pci_function;
+} cl_device_pci_bus_info_khr;
+#endif
+
+bool BindToNumaNode(void* in_ptr, size_t in_size, cl_int in_numaNode, bool in_move)
+{
+#ifdef __linux__
+    if ((in_numaNode < 0) || (in_numaNode >= CLU_MAX_NUMA_NODES))
+    {
+        return false;
+    }
+    unsigned long nodeMask[CLU_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    nodeMask[in_numaNode / (8 * sizeof(unsigned long))] = 1UL << (in_numaNode % (8 * sizeof(unsigned long)));
+    long result = syscall(SYS_mbind, in_ptr, in_size, CLU_MPOL_BIND, nodeMask,
+        (unsigned long)CLU_MAX_NUMA_NODES + 1, in_move ? CLU_MPOL_MF_MOVE : 0);
+    return 0 == result;
+#else
+    in_ptr = 0; in_size = 0; in_numaNode = 0; in_move = false; // unused, remove compiler warning
+    return false;
+#endif
+}
+
+// the node most of the sampled pages are on
+cl_int GetNumaNode(const void* in_ptr, size_t in_size)
+{
+    cl_int node = CLU_NUMA_NODE_ANY;
+#ifdef __linux__
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t numPages = (in_size + pageSize - 1) / pageSize;
+    size_t numSamples = std::min(numPages, (size_t)CLU_NUMA_SAMPLE_PAGES);
+    if (0 == numSamples)
+    {
+        return node;
+    }
+    void* pages[CLU_NUMA_SAMPLE_PAGES];
+    int status[CLU_NUMA_SAMPLE_PAGES];
+    for (size_t i = 0; i < numSamples; i++)
+    {
+        pages[i] = (char*)in_ptr + (i * numPages / numSamples) * pageSize;
+    }
+    if (0 != syscall(SYS_move_pages, 0, numSamples, pages, 0, status, 0))
+    {
+        return node;
+    }
+    std::map<int, size_t> counts;
+    size_t most = 0;
+    for (size_t i = 0; i < numSamples; i++)
+    {
+        if (status[i] >= 0) // negative: not resident, or an error
+        {
+            size_t count = ++counts[status[i]];
+            if (count > most)
+            {
+                most = count;
+                node = status[i];
+            }
+        }
+    }
+#else
+    in_ptr = 0; in_size = 0; // unused, remove compiler warning
+#endif
+    return node;
+}
+
+// the allocation behind a buffer or sub-buffer
+bool FindHostAllocation(cl_mem in_buffer, HostAllocator::Allocation& out_allocation)
+{
+    cl_mem parent = 0;
+    cl_int status = clGetMemObjectInfo(in_buffer, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, 0);
+    void* pHostPtr = 0;
+    if (CL_SUCCESS == status)
+    {
+        status = clGetMemObjectInfo(parent ? parent : in_buffer, CL_MEM_HOST_PTR, sizeof(pHostPtr), &pHostPtr, 0);
+    }
+    return (CL_SUCCESS == status) && CLU_Runtime::Get().GetHostAllocator().Find(pHostPtr, out_allocation);
+}
+
+// the host pages of a buffer: its whole allocation, or for a sub-buffer the pages its range touches.
+// pages at either end of a sub-buffer may be shared with its neighbours
+bool FindHostPages(cl_mem in_buffer, char*& out_ptr, size_t& out_size)
+{
+    HostAllocator::Allocation allocation;
+    if (!FindHostAllocation(in_buffer, allocation))
+    {
+        return false;
+    }
+    out_ptr = (char*)allocation.m_ptr;
+    out_size = allocation.m_size;
+
+    cl_mem parent = 0;
+    clGetMemObjectInfo(in_buffer, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(parent), &parent, 0);
+    if (parent)
+    {
+        size_t offset = 0;
+        size_t size = 0;
+        if ((CL_SUCCESS != clGetMemObjectInfo(in_buffer, CL_MEM_OFFSET, sizeof(offset), &offset, 0)) ||
+            (CL_SUCCESS != clGetMemObjectInfo(in_buffer, CL_MEM_SIZE, sizeof(size), &size, 0)))
+        {
+            return false;
+        }
+#ifdef __linux__
+        const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#else
+        const size_t pageSize = 4096;
+#endif
+        size_t begin = (size_t)(out_ptr + offset) & ~(pageSize - 1);
+        size_t end = ((size_t)(out_ptr + offset + size) + pageSize - 1) & ~(pageSize - 1);
+        out_ptr = (char*)begin;
+        out_size = end - begin;
+    }
+    return true;
+}
+
+cl_int CLU_API_CALL cluGetDeviceNumaNode(cl_device_id in_device, cl_int* out_pNumaNode)
+{
+    if (0 == out_pNumaNode)
+    {
+        return CL_INVALID_VALUE;
+    }
+    *out_pNumaNode = CLU_NUMA_NODE_ANY;
+    cl_device_pci_bus_info_khr pci = {0};
+    cl_int status = clGetDeviceInfo(in_device, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(pci), &pci, 0);
+    if (CL_INVALID_DEVICE == status)
+    {
+        return status;
+    }
+#ifdef __linux__
+    if (CL_SUCCESS == status)
+    {
+        char path[CLU_UTIL_MAX_STRING_LENGTH];
+        sprintf(path, "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+            pci.pci_domain, pci.pci_bus, pci.pci_device, pci.pci_function);
+        std::ifstream file(path);
+        cl_int node = CLU_NUMA_NODE_ANY;
+        if (file >> node)
+        {
+            *out_pNumaNode = node; // -1 if the platform does not know
+        }
+    }
+#endif
+    return CL_SUCCESS; // the device is not on the PCI bus, or the extension is not supported
+}
+
+cl_mem CLU_API_CALL cluCreateAlignedBufferOnNode(cl_mem_flags in_flags, size_t in_size, cl_int in_numaNode,
+    void** out_pPtr, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateAlignedBufferOnNode", &status, 0, 0, 0, in_size);
+    cl_mem mem = CreateAlignedBuffer(in_flags, in_size, out_pPtr, &status, "cluCreateAlignedBufferOnNode", in_numaNode);
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+cl_mem CLU_API_CALL cluCreateAlignedBufferForDevice(cl_mem_flags in_flags, size_t in_size, cl_device_id in_device,
+    void** out_pPtr, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateAlignedBufferForDevice", &status, 0, 0, 0, in_size);
+    cl_int node = CLU_NUMA_NODE_ANY;
+    cl_mem mem = 0;
+    status = cluGetDeviceNumaNode(in_device, &node);
+    if (CL_SUCCESS == status)
+    {
+        mem = CreateAlignedBuffer(in_flags, in_size, out_pPtr, &status, "cluCreateAlignedBufferForDevice", node);
+    }
+    if (mem && (CLU_NUMA_NODE_ANY == node))
+    {
+        // first touch by the device itself. the device must be in the clu context
+        cl_command_queue queue = CLU_Runtime::Get().CreateCommandQueue(in_device, 0, &status);
+        if (queue)
+        {
+            cl_uint zero = 0;
+            size_t size = 0;
+            clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size, 0);
+            status = clEnqueueFillBuffer(queue, mem, &zero, sizeof(zero), 0, size, 0, 0, 0);
+            if (CL_SUCCESS == status)
+            {
+                status = clFinish(queue);
+            }
+            clReleaseCommandQueue(queue);
+        }
+        if (CL_SUCCESS != status)
+        {
+            clReleaseMemObject(mem);
+            mem = 0;
+        }
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+cl_int CLU_API_CALL cluGetBufferNumaNode(cl_mem in_buffer, cl_int* out_pNumaNode)
+{
+    if ((0 == in_buffer) || (0 == out_pNumaNode))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        char* ptr = 0;
+        size_t size = 0;
+        if (FindHostPages(in_buffer, ptr, size))
+        {
+            *out_pNumaNode = GetNumaNode(ptr, size);
+        }
+        else
+        {
+            status = CL_INVALID_MEM_OBJECT;
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+cl_int CLU_API_CALL cluMigrateBufferToNode(cl_mem in_buffer, cl_int in_numaNode)
+{
+    if ((0 == in_buffer) || (in_numaNode < 0))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        char* ptr = 0;
+        size_t size = 0;
+        if (!FindHostPages(in_buffer, ptr, size))
+        {
+            status = CL_INVALID_MEM_OBJECT;
+        }
+        else if (!BindToNumaNode(ptr, size, in_numaNode, true))
+        {
+            status = CL_INVALID_OPERATION; // not Linux, no such node, or pages pinned by the driver
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// file buffers
+//   the file is mapped from the page containing in_offset. the buffer starts
+//   at in_offset inside the mapping, and the mapping is released by the
+//   buffer's destructor callback.
+//-----------------------------------------------------------------------------
+#ifdef __linux__
+struct FileMapping
+{
+    void*  m_ptr;
+    size_t m_size;
+};
+
+void CL_CALLBACK CLU_ReleaseFileBufferCallback(cl_mem in_buffer, void* in_pMapping)
+{
+    in_buffer = 0; // unused, fixes compile warning about unused param.
+    FileMapping* pMapping = (FileMapping*)in_pMapping;
+    munmap(pMapping->m_ptr, pMapping->m_size);
+    delete pMapping;
+}
+
+cl_mem CreateBufferFromFile(const char* in_pFileName, size_t in_offset, size_t in_size,
+    cl_mem_flags in_flags, cl_int* out_pStatus)
+{
+    *out_pStatus = CL_INVALID_VALUE;
+    // allocated first: nothing may throw once the file is open or mapped
+    FileMapping* pMapping = new FileMapping;
+    int fd = open(in_pFileName, O_RDONLY);
+    if (fd < 0)
+    {
+        delete pMapping;
+        return 0;
+    }
+    struct stat fileStat;
+    if ((0 != fstat(fd, &fileStat)) || (in_offset >= (size_t)fileStat.st_size) ||
+        (in_size > (size_t)fileStat.st_size - in_offset))
+    {
+        close(fd);
+        delete pMapping;
+        return 0;
+    }
+    if (0 == in_size)
+    {
+        in_size = (size_t)fileStat.st_size - in_offset;
+    }
+
+    if (!WithinMemoryLimit(in_size, out_pStatus))
+    {
+        close(fd);
+        delete pMapping;
+        return 0;
+    }
+
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapOffset = in_offset & ~(pageSize - 1);
+    size_t mapSize = in_size + (in_offset - mapOffset);
+
+    // private and writable: kernels and maps may write, copies are made per page only when they do
+    void* p = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)mapOffset);
+    close(fd); // the mapping keeps the file open
+    if (MAP_FAILED == p)
+    {
+        *out_pStatus = CL_OUT_OF_HOST_MEMORY;
+        ReleaseMemoryReservation(in_size);
+        delete pMapping;
+        return 0;
+    }
+    if (in_flags & CLU_MEM_PREFETCH)
+    {
+        madvise(p, mapSize, MADV_WILLNEED);
+    }
+
+    pMapping->m_ptr = p;
+    pMapping->m_size = mapSize;
+
+    in_flags &= ~(CLU_MEM_PREFETCH | CLU_MEM_HUGE_PAGES);
+    cl_mem mem = clCreateBuffer(CLU_CONTEXT, in_flags | CL_MEM_USE_HOST_PTR, in_size,
+        (char*)p + (in_offset - mapOffset), out_pStatus);
+    if (mem)
+    {
+        *out_pStatus = clSetMemObjectDestructorCallback(mem, CLU_ReleaseFileBufferCallback, pMapping);
+        TrackMemObject(mem, in_size, in_flags | CL_MEM_USE_HOST_PTR, "cluCreateBufferFromFile");
+    }
+    else
+    {
+        munmap(p, mapSize);
+        ReleaseMemoryReservation(in_size);
+        delete pMapping;
+    }
+    return mem;
+}
+#else
+// no mmap: read the range into an aligned buffer
+cl_mem CreateBufferFromFile(const char* in_pFileName, size_t in_offset, size_t in_size,
+    cl_mem_flags in_flags, cl_int* out_pStatus)
+{
+    *out_pStatus = CL_INVALID_VALUE;
+    std::ifstream ifs(in_pFileName, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs.is_open())
+    {
+        return 0;
+    }
+    size_t fileSize = (size_t)ifs.tellg();
+    if ((in_offset >= fileSize) || (in_size > fileSize - in_offset))
+    {
+        return 0;
+    }
+    if (0 == in_size)
+    {
+        in_size = fileSize - in_offset;
+    }
+
+    void* p = 0;
+    cl_mem mem = CreateAlignedBuffer(in_flags & ~CLU_MEM_PREFETCH, in_size, &p, out_pStatus, "cluCreateBufferFromFile");
+    if (mem)
+    {
+        ifs.seekg(in_offset);
+        ifs.read((char*)p, in_size);
+        if (!ifs)
+        {
+            clReleaseMemObject(mem);
+            mem = 0;
+            *out_pStatus = CL_INVALID_VALUE;
+        }
+    }
+    return mem;
+}
+#endif
+
+cl_mem CLU_API_CALL cluCreateBufferFromFile(const char* in_pFileName, size_t in_offset, size_t in_size,
+    cl_mem_flags in_flags, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateBufferFromFile", &status, 0, 0, 0, in_size);
+    cl_mem mem = 0;
+    try
+    {
+        if (in_pFileName)
+        {
+            mem = CreateBufferFromFile(in_pFileName, in_offset, in_size, in_flags, &status);
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+//-----------------------------------------------------------------------------
+// aligned images
+//   like aligned buffers, but the row pitch is padded so every row starts
+//   aligned: to CL_DEVICE_IMAGE_PITCH_ALIGNMENT pixels of every device, and to
+//   a cache line. slices are whole rows, so they are aligned too.
+//-----------------------------------------------------------------------------
+#define CLU_IMAGE_ROW_ALIGNMENT 64 // bytes
+
+// bytes per pixel, 0 if the format is unknown
+size_t GetImageElementSize(const cl_image_format& in_format)
+{
+    switch (in_format.image_channel_data_type)
+    {
+    case CL_UNORM_SHORT_565:
+    case CL_UNORM_SHORT_555:
+        return 2;
+    case CL_UNORM_INT_101010:
+        return 4;
+    default:
+        break;
+    }
+
+    size_t channelSize = 0;
+    switch (in_format.image_channel_data_type)
+    {
+    case CL_SNORM_INT8:
+    case CL_UNORM_INT8:
+    case CL_SIGNED_INT8:
+    case CL_UNSIGNED_INT8:
+        channelSize = 1; break;
+    case CL_SNORM_INT16:
+    case CL_UNORM_INT16:
+    case CL_SIGNED_INT16:
+    case CL_UNSIGNED_INT16:
+    case CL_HALF_FLOAT:
+        channelSize = 2; break;
+    case CL_SIGNED_INT32:
+    case CL_UNSIGNED_INT32:
+    case CL_FLOAT:
+        channelSize = 4; break;
+    default:
+        return 0;
+    }
+
+    size_t numChannels = 0;
+    switch (in_format.image_channel_order)
+    {
+    case CL_R:
+    case CL_A:
+    case CL_INTENSITY:
+    case CL_LUMINANCE:
+    case CL_Rx:
+        numChannels = 1; break;
+    case CL_RG:
+    case CL_RA:
+    case CL_RGx:
+        numChannels = 2; break;
+    case CL_RGB:
+    case CL_RGBx:
+        numChannels = 3; break;
+    case CL_RGBA:
+    case CL_BGRA:
+    case CL_ARGB:
+        numChannels = 4; break;
+    default:
+        return 0;
+    }
+    return channelSize * numChannels;
+}
+
+size_t GreatestCommonDivisor(size_t a, size_t b)
+{
+    while (b)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+cl_mem CreateAlignedImage(
+    cl_mem_object_type in_type,
+    cl_mem_flags in_flags,
+    const cl_image_format* in_pFormat,
+    size_t in_width, size_t in_height, size_t in_depth,
+    size_t* out_pRowPitch, size_t* out_pSlicePitch,
+    void** out_pPtr,
+    cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    cl_mem mem = 0;
+    try
+    {
+        CLU_Runtime& runtime = CLU_Runtime::Get();
+        HostAllocator::Allocation* pAllocation = 0;
+        bool hugePages = (0 != (in_flags & CLU_MEM_HUGE_PAGES)) || runtime.UseHugePages();
+        in_flags &= ~CLU_MEM_HUGE_PAGES;
+
+        size_t elementSize = in_pFormat ? GetImageElementSize(*in_pFormat) : 0;
+        if (0 == elementSize)
+        {
+            status = CL_INVALID_IMAGE_FORMAT_DESCRIPTOR;
+        }
+        else if ((0 == in_width) || (0 == in_height) || (0 == in_depth))
+        {
+            status = CL_INVALID_IMAGE_SIZE;
+        }
+        else if (!runtime.IsImageFormatSupported(*in_pFormat, in_type, in_flags | CL_MEM_USE_HOST_PTR))
+        {
+            status = CL_IMAGE_FORMAT_NOT_SUPPORTED;
+        }
+        else
+        {
+            // row alignment: a whole number of pixels, satisfying both the device and the cache line
+            size_t pitchAlignment = elementSize * runtime.GetImagePitchAlignment();
+            pitchAlignment = pitchAlignment / GreatestCommonDivisor(pitchAlignment, CLU_IMAGE_ROW_ALIGNMENT) * CLU_IMAGE_ROW_ALIGNMENT;
+
+            size_t rowPitch = (in_width * elementSize + pitchAlignment - 1) / pitchAlignment * pitchAlignment;
+            size_t slicePitch = rowPitch * in_height;
+            size_t size = slicePitch * in_depth;
+
+            cl_uint alignment = runtime.GetBufferAlignment();
+            size += (alignment - 1);
+            size &= ~(size_t)(alignment - 1);
+
+            bool reserved = WithinMemoryLimit(size, &status); // against the soft limit
+            if (reserved)
+            {
+                pAllocation = runtime.GetHostAllocator().Allocate(size, alignment, hugePages);
+            }
+            if (pAllocation)
+            {
+                cl_image_desc desc;
+                memset(&desc, 0, sizeof(desc));
+                desc.image_type = in_type;
+                desc.image_width = in_width;
+                desc.image_height = in_height;
+                desc.image_depth = (CL_MEM_OBJECT_IMAGE3D == in_type) ? in_depth : 0;
+                desc.image_row_pitch = rowPitch;
+                desc.image_slice_pitch = (CL_MEM_OBJECT_IMAGE3D == in_type) ? slicePitch : 0;
+                mem = clCreateImage(CLU_CONTEXT, in_flags | CL_MEM_USE_HOST_PTR, in_pFormat, &desc, pAllocation->m_ptr, &status);
+            }
+
+            if (mem)
+            {
+                status = clSetMemObjectDestructorCallback(mem, CLU_ReleaseAlignedBufferCallback, pAllocation);
+                TrackMemObject(mem, size, in_flags | CL_MEM_USE_HOST_PTR,
+                    (CL_MEM_OBJECT_IMAGE2D == in_type) ? "cluCreateAlignedImage2D" : "cluCreateAlignedImage3D");
+                if (out_pPtr)        *out_pPtr = pAllocation->m_ptr;
+                if (out_pRowPitch)   *out_pRowPitch = rowPitch;
+                if (out_pSlicePitch) *out_pSlicePitch = slicePitch;
+            }
+            else
+            {
+                if (CL_SUCCESS == status)
+                {
+                    status = CL_OUT_OF_HOST_MEMORY;
+                }
+                if (pAllocation)
+                {
+                    runtime.GetHostAllocator().Free(pAllocation);
+                }
+                if (reserved)
+                {
+                    ReleaseMemoryReservation(size);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+cl_mem CLU_API_CALL cluCreateAlignedImage2D(cl_mem_flags in_flags, const cl_image_format* in_pFormat,
+    size_t in_width, size_t in_height, size_t* out_pRowPitch, void** out_pPtr, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateAlignedImage2D", &status);
+    cl_mem mem = CreateAlignedImage(CL_MEM_OBJECT_IMAGE2D, in_flags, in_pFormat, in_width, in_height, 1,
+        out_pRowPitch, 0, out_pPtr, &status);
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+cl_mem CLU_API_CALL cluCreateAlignedImage3D(cl_mem_flags in_flags, const cl_image_format* in_pFormat,
+    size_t in_width, size_t in_height, size_t in_depth,
+    size_t* out_pRowPitch, size_t* out_pSlicePitch, void** out_pPtr, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateAlignedImage3D", &status);
+    cl_mem mem = CreateAlignedImage(CL_MEM_OBJECT_IMAGE3D, in_flags, in_pFormat, in_width, in_height, in_depth,
+        out_pRowPitch, out_pSlicePitch, out_pPtr, &status);
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return mem;
+}
+
+//-----------------------------------------------------------------------------
+// shared samplers
+//-----------------------------------------------------------------------------
+cl_sampler CLU_Runtime::GetSampler(cl_bool in_normalized, cl_addressing_mode in_addressing,
+    cl_filter_mode in_filter, cl_int* out_pStatus)
+{
+    cl_ulong key = ((cl_ulong)(in_normalized ? 1 : 0) << 32) | ((cl_ulong)in_addressing << 16) | (cl_ulong)in_filter;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<cl_ulong, cl_sampler>::const_iterator iter = m_samplers.find(key);
+    if (iter != m_samplers.end())
+    {
+        *out_pStatus = CL_SUCCESS;
+        return iter->second;
+    }
+    cl_sampler sampler = clCreateSampler(m_context, in_normalized, in_addressing, in_filter, out_pStatus);
+    if (sampler)
+    {
+        AddObject(sampler);
+        m_samplers[key] = sampler;
+    }
+    return sampler;
+}
+
+cl_sampler CLU_API_CALL cluGetSampler(cl_bool in_normalized, cl_addressing_mode in_addressing,
+    cl_filter_mode in_filter, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    cl_sampler sampler = 0;
+    try
+    {
+        sampler = CLU_Runtime::Get().GetSampler(in_normalized, in_addressing, in_filter, &status);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return sampler;
+}
+
+//-----------------------------------------------------------------------------
+// zero-copy diagnostics
+//   a new aligned buffer is mapped once for each clu device, on a private
+//   profiling queue so the probe neither waits for nor is timed with the
+//   application's work. if the map does not return the buffer's host memory,
+//   or the device takes about as long as copying the buffer would, the driver
+//   is copying. the reason is guessed from the device.
+//-----------------------------------------------------------------------------
+void CL_CALLBACK CLU_ForgetZeroCopyWarningCallback(cl_mem in_mem, void* in_data)
+{
+    in_data = 0; // unused, fixes compile warning about unused param.
+    CLU_Runtime::Get().GetZeroCopyChecker().Forget(in_mem);
+}
+
+#define CLU_ZERO_COPY_MIN_SUSPECT_NS 100000 // maps faster than this are never suspect
+#define CLU_ZERO_COPY_COPY_BYTES_PER_NS 20  // ~20 GB/s: maps slower than copying at this rate are suspect
+
+std::string GetZeroCopyReason(cl_device_id in_device, const void* in_pHostPtr, size_t in_size)
+{
+    std::ostringstream reason;
+    char deviceName[CLU_UTIL_MAX_STRING_LENGTH] = {0};
+    clGetDeviceInfo(in_device, CL_DEVICE_NAME, sizeof(deviceName)-1, deviceName, 0);
+    cl_bool unified = CL_TRUE;
+    clGetDeviceInfo(in_device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, 0);
+    cl_uint baseAlign = 0;
+    clGetDeviceInfo(in_device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(baseAlign), &baseAlign, 0);
+    baseAlign /= 8; // bits
+    cl_uint cacheLine = 0;
+    clGetDeviceInfo(in_device, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, sizeof(cacheLine), &cacheLine, 0);
+
+    reason << deviceName << ": ";
+    if (!unified)
+    {
+        reason << "the device does not share memory with the host";
+    }
+    else if (baseAlign && ((size_t)in_pHostPtr % baseAlign))
+    {
+        reason << "host memory is not aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN (" << baseAlign << " bytes)";
+    }
+    else if (cacheLine && (in_size % cacheLine))
+    {
+        reason << "size " << in_size << " is not a multiple of a cache line (" << cacheLine << " bytes)";
+    }
+    else
+    {
+        reason << "the driver does not use the host memory directly";
+    }
+    return reason.str();
+}
+
+void CheckZeroCopy(cl_mem in_buffer, void* in_pHostPtr, size_t in_size)
+{
+    CLU_Runtime& runtime = CLU_Runtime::Get();
+    cl_device_type types[CLU_MAX_NUM_DEVICES];
+    cl_uint numTypes = runtime.GetDeviceTypes(types);
+    for (cl_uint i = 0; i < numTypes; i++)
+    {
+        cl_int status = CL_SUCCESS;
+        cl_command_queue queue = runtime.GetProbeQueue(types[i], &status);
+        if (0 == queue)
+        {
+            continue;
+        }
+        cl_event mapped = 0;
+        void* p = clEnqueueMapBuffer(queue, in_buffer, CL_TRUE, CL_MAP_READ, 0, in_size, 0, 0, &mapped, &status);
+        if (CL_SUCCESS != status)
+        {
+            continue;
+        }
+        NoteEventCreated();
+        cl_event unmapped = 0;
+        status = clEnqueueUnmapMemObject(queue, in_buffer, p, 0, 0, &unmapped);
+        cl_ulong start = 0;
+        cl_ulong end = 0;
+        if (CL_SUCCESS == status)
+        {
+            NoteEventCreated();
+            status = clWaitForEvents(1, &unmapped);
+            clGetEventProfilingInfo(mapped, CL_PROFILING_COMMAND_START, sizeof(start), &start, 0);
+            clGetEventProfilingInfo(unmapped, CL_PROFILING_COMMAND_END, sizeof(end), &end, 0);
+            RecycleEvent(unmapped);
+        }
+        RecycleEvent(mapped);
+        cl_ulong elapsed = (end > start) ? (end - start) : 0; // device time of the map and unmap
+
+        std::string reason;
+        if (p != in_pHostPtr)
+        {
+            reason = GetZeroCopyReason(runtime.GetDevice(types[i]), in_pHostPtr, in_size);
+        }
+        else if ((elapsed > CLU_ZERO_COPY_MIN_SUSPECT_NS) && (elapsed > in_size / CLU_ZERO_COPY_COPY_BYTES_PER_NS))
+        {
+            std::ostringstream message;
+            message << "map and unmap of " << in_size << " bytes took " << elapsed / 1000 << "us, the driver may be copying";
+            reason = message.str();
+        }
+        runtime.GetZeroCopyChecker().AddBufferCheck(in_buffer, reason.empty() ? 0 : reason.c_str());
+    }
+}
+
+void* CLU_API_CALL cluEnqueueMapBuffer(cl_command_queue in_queue, cl_mem in_buffer, cl_bool in_blocking,
+    cl_map_flags in_flags, size_t in_offset, size_t in_size,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents, cl_event* out_pEvent, cl_int* out_pStatus)
+{
+    if (0 == in_queue)
+    {
+        in_queue = CLU_DEFAULT_Q;
+    }
+    cl_int status = CL_SUCCESS;
+    void* p = clEnqueueMapBuffer(in_queue, in_buffer, in_blocking, in_flags, in_offset, in_size,
+        in_numWaitEvents, in_waitEvents, out_pEvent, &status);
+
+    CLU_Runtime& runtime = CLU_Runtime::Get();
+    if ((CL_SUCCESS == status) && runtime.CheckZeroCopy())
+    {
+        try
+        {
+            cl_mem_flags memFlags = 0;
+            char* pHostPtr = 0;
+            clGetMemObjectInfo(in_buffer, CL_MEM_FLAGS, sizeof(memFlags), &memFlags, 0);
+            clGetMemObjectInfo(in_buffer, CL_MEM_HOST_PTR, sizeof(pHostPtr), &pHostPtr, 0);
+            if (memFlags & CL_MEM_USE_HOST_PTR)
+            {
+                runtime.GetZeroCopyChecker().AddMap(in_buffer, p, in_size, in_flags, p != pHostPtr + in_offset);
             }
         }
+        catch (...) // internal error, e.g. thrown by STL
+        {
+        }
     }
-    return platform;
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return p;
+}
+
+cl_int CLU_API_CALL cluEnqueueUnmapMemObject(cl_command_queue in_queue, cl_mem in_memobj, void* in_pMapped,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents, cl_event* out_pEvent)
+{
+    if (0 == in_queue)
+    {
+        in_queue = CLU_DEFAULT_Q;
+    }
+    cl_int status = clEnqueueUnmapMemObject(in_queue, in_memobj, in_pMapped, in_numWaitEvents, in_waitEvents, out_pEvent);
+    CLU_Runtime& runtime = CLU_Runtime::Get();
+    if ((CL_SUCCESS == status) && runtime.CheckZeroCopy())
+    {
+        try
+        {
+            runtime.GetZeroCopyChecker().RemoveMap(in_pMapped);
+        }
+        catch (...) // internal error, e.g. thrown by STL
+        {
+        }
+    }
+    return status;
+}
+
+cl_int CLU_API_CALL cluGetZeroCopyStats(clu_zero_copy_stats* out_pStats)
+{
+    if (0 == out_pStats)
+    {
+        return CL_INVALID_VALUE;
+    }
+    CLU_Runtime::Get().GetZeroCopyChecker().GetStats(*out_pStats);
+    return CL_SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
-// Initialize (start) clu
+// asynchronous readback
+//   copy into an aligned (zero-copy) staging buffer, then map it without blocking.
+//   when the map completes, its event callback hands the slot to the completion
+//   thread, which calls the application, then unmaps. the next read into the slot
+//   waits for that unmap on the device instead of on the host.
 //-----------------------------------------------------------------------------
-cl_int CLU_Runtime::Initialize(const clu_initialize_params& in_params)
+void CL_CALLBACK CLU_ReadbackCallback(cl_event in_event, cl_int in_eventStatus, void* in_pSlot)
 {
-    // if already initialized, do nothing.
-    if (GetIsInitialized())
+    in_event = 0; // unused, remove compiler warning
+    CLU_Runtime::Get().GetReadbackRing().Complete((ReadbackRing::Slot*)in_pSlot, in_eventStatus);
+}
+
+ReadbackRing::ReadbackRing() : m_completed(CLU_READ_ASYNC_MAX_STAGING), m_threadSleeping(false), m_pending(0), m_stop(false)
+{
+    m_slots.resize(CLU_READ_ASYNC_MAX_STAGING);
+    memset(&m_slots[0], 0, m_slots.size() * sizeof(Slot));
+    for (size_t i = 0; i < m_slots.size(); i++)
     {
-        return CL_INVALID_OPERATION;
+        m_free.push_back(&m_slots[i]);
     }
+}
 
-    Reset();
-    cl_platform_id* platforms = 0;
+cl_int ReadbackRing::Read(cl_command_queue in_queue, cl_mem in_buffer, size_t in_offset, size_t in_size,
+    clu_read_callback in_callback, void* in_pUserData,
+    cl_uint in_numWaitEvents, const cl_event* in_waitEvents)
+{
+    // take a free slot, starting the completion thread on first use
+    Slot* pSlot = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable())
+        {
+            m_stop = false;
+            m_thread = std::thread(&ReadbackRing::Run, this);
+            m_threadId = m_thread.get_id();
+        }
+        while (m_free.empty())
+        {
+            if (std::this_thread::get_id() == m_threadId)
+            {
+                return CL_OUT_OF_RESOURCES; // only the completion thread frees slots
+            }
+            m_slotFreed.wait(lock);
+        }
+        pSlot = m_free.back();
+        m_free.pop_back();
+        m_pending++;
+    }
 
-    m_queueProperties = in_params.default_queue_props;
-    //m_queueProperties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
-    m_buildOptions = in_params.compile_options ? in_params.compile_options : "";
-    m_context = in_params.existing_context;
-    cl_device_type deviceType = in_params.preferred_device_type;
-    if (0 == deviceType)
+    cl_int status = CL_SUCCESS;
+    if (pSlot->m_capacity < in_size)
     {
-        deviceType = CL_DEVICE_TYPE_ALL;
+        if (pSlot->m_staging)
+        {
+            clReleaseMemObject(pSlot->m_staging); // freed once its pending unmap completes
+        }
+        pSlot->m_staging = CreateAlignedBuffer(CL_MEM_READ_WRITE, in_size, &pSlot->m_pHostPtr, &status, "cluReadAsync");
+        pSlot->m_capacity = pSlot->m_staging ? in_size : 0;
     }
 
-    cl_int status = 0;
-    if (0 == m_context)
+    // the copy waits for the application's events and for the slot's previous unmap
+    cl_event copied = 0;
+    cl_event mapped = 0;
+    if (CL_SUCCESS == status)
     {
-        // create default context and default queues (per device)
-        // find an OCL device on this platform
-        cl_uint numPlatforms;
-        status = clGetPlatformIDs(0, 0, &numPlatforms);
+        std::vector<cl_event> waitEvents(in_waitEvents, in_waitEvents + in_numWaitEvents);
+        if (pSlot->m_unmapped)
+        {
+            waitEvents.push_back(pSlot->m_unmapped);
+        }
+        status = clEnqueueCopyBuffer(in_queue, in_buffer, pSlot->m_staging, in_offset, 0, in_size,
+            (cl_uint)waitEvents.size(), waitEvents.empty() ? 0 : &waitEvents[0], &copied);
         OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
+    }
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        if (pSlot->m_unmapped)
+        {
+            RecycleEvent(pSlot->m_unmapped);
+            pSlot->m_unmapped = 0;
+        }
+        clRetainCommandQueue(in_queue); // Deliver unmaps on it, the application may release it before
+        pSlot->m_queue = in_queue;
+        pSlot->m_size = in_size;
+        pSlot->m_callback = in_callback;
+        pSlot->m_pUserData = in_pUserData;
+        pSlot->m_pMapped = cluEnqueueMapBuffer(in_queue, pSlot->m_staging, CL_FALSE, CL_MAP_READ, 0, in_size,
+            1, &copied, &mapped, &status);
+        RecycleEvent(copied);
+    }
+    if (CL_SUCCESS == status)
+    {
+        NoteEventCreated();
+        status = clSetEventCallback(mapped, CL_COMPLETE, CLU_ReadbackCallback, pSlot);
+        if (CL_SUCCESS != status)
+        {
+            // cannot be delivered: wait for the map here and undo it
+            WaitForEvents(&mapped, 1, 0);
+            cluEnqueueUnmapMemObject(in_queue, pSlot->m_staging, pSlot->m_pMapped, 0, 0, &pSlot->m_unmapped);
+            if (pSlot->m_unmapped) NoteEventCreated();
+        }
+        RecycleEvent(mapped); // the callback keeps the event alive until it is called
+        clFlush(in_queue);
+    }
+    if (CL_SUCCESS != status)
+    {
+        if (pSlot->m_queue)
+        {
+            clReleaseCommandQueue(pSlot->m_queue);
+            pSlot->m_queue = 0;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(pSlot);
+        m_pending--;
+        m_slotFreed.notify_one();
+    }
+    return status;
+}
 
-        assert(0 != numPlatforms); // if it's 0, we should have gotten an error above.
+void ReadbackRing::Complete(Slot* in_pSlot, cl_int in_status)
+{
+    in_pSlot->m_status = in_status;
+    if (!m_completed.Push(in_pSlot))
+    {
+        assert(0); // never more slots in flight than the ring holds
+    }
 
-        // get the number of platforms
-        platforms = new cl_platform_id[numPlatforms];
-        if (0 == platforms)
+    // pairs with the fence in Run: either the thread sees the pushed slot,
+    // or this thread sees the completion thread is going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_threadSleeping.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wake.notify_one();
+    }
+}
+
+void ReadbackRing::Run()
+{
+    for (;;)
+    {
+        Slot* pSlot = 0;
+        if (!m_completed.Pop(pSlot))
         {
-            status = CL_OUT_OF_HOST_MEMORY;
-            goto exit;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_threadSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!m_completed.Pop(pSlot))
+            {
+                if (m_stop && (0 == m_pending))
+                {
+                    m_threadSleeping.store(false, std::memory_order_relaxed);
+                    return;
+                }
+                m_wake.wait(lock);
+            }
+            m_threadSleeping.store(false, std::memory_order_relaxed);
         }
-        // get the platform ids
-        status = clGetPlatformIDs(numPlatforms, platforms, 0);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
+        Deliver(pSlot);
+    }
+}
 
-        if (in_params.vendor_name)
+void ReadbackRing::Deliver(Slot* in_pSlot)
+{
+    bool succeeded = (CL_COMPLETE == in_pSlot->m_status);
+    if (in_pSlot->m_callback)
+    {
+        try
         {
-            m_platform = GetPlatformByVendor(numPlatforms, platforms, in_params.vendor_name, deviceType, &status);
-            OCL_VALIDATE(status);
-            if (CL_SUCCESS != status) goto exit;
+            in_pSlot->m_callback(succeeded ? in_pSlot->m_pMapped : 0, in_pSlot->m_size,
+                succeeded ? CL_SUCCESS : in_pSlot->m_status, in_pSlot->m_pUserData);
+        }
+        catch (...) // do not let the application's exceptions stop the thread
+        {
+        }
+    }
+    if (succeeded)
+    {
+        if (CL_SUCCESS == cluEnqueueUnmapMemObject(in_pSlot->m_queue, in_pSlot->m_staging, in_pSlot->m_pMapped,
+            0, 0, &in_pSlot->m_unmapped))
+        {
+            NoteEventCreated();
         }
+        clFlush(in_pSlot->m_queue);
+    }
+    clReleaseCommandQueue(in_pSlot->m_queue);
+    in_pSlot->m_queue = 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(in_pSlot);
+    m_pending--;
+    m_slotFreed.notify_one();
+}
 
-        if (0 == m_platform)
+void ReadbackRing::Reset()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable())
         {
-            m_platform = GetPlatformDefault(numPlatforms, platforms, deviceType);
+            return;
         }
+        m_stop = true;
+        m_wake.notify_one();
+    }
+    m_thread.join();
+    m_thread = std::thread();
+    m_threadId = std::thread::id();
 
-        // should have a platform now.
-        if (0 == m_platform)
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        Slot& slot = m_slots[i];
+        if (slot.m_unmapped)
         {
-            status = CL_DEVICE_NOT_FOUND;
-            goto exit;
+            WaitForEvents(&slot.m_unmapped, 1, 0);
+            RecycleEvent(slot.m_unmapped);
         }
+        if (slot.m_staging)
+        {
+            clReleaseMemObject(slot.m_staging);
+        }
+        memset(&slot, 0, sizeof(slot));
+    }
+}
 
-        // get # of devices & device Ids
-        // here we have a platform, no context yet
-        status = clGetDeviceIDs(m_platform, deviceType, 0, 0, &m_numDevices);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
+cl_int CLU_API_CALL cluReadAsync(cl_command_queue in_queue, cl_mem in_buffer, size_t in_offset, size_t in_size,
+    clu_read_callback in_callback, void* in_pUserData, cl_uint in_numWaitEvents, const cl_event* in_waitEvents)
+{
+    if ((0 == in_buffer) || (0 == in_size) || (0 == in_callback) || ((0 == in_waitEvents) != (0 == in_numWaitEvents)))
+    {
+        return CL_INVALID_VALUE;
+    }
+    if (0 == in_queue)
+    {
+        in_queue = CLU_DEFAULT_Q;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        status = CLU_Runtime::Get().GetReadbackRing().Read(in_queue, in_buffer, in_offset, in_size,
+            in_callback, in_pUserData, in_numWaitEvents, in_waitEvents);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
 
-        // get device IDs
-        // clamp to CLU_MAX_NUM_DEVICES
-        if (m_numDevices > CLU_MAX_NUM_DEVICES)
+//-----------------------------------------------------------------------------
+// describe the host memory behind an aligned buffer
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL cluGetHostMemoryInfo(cl_mem in_buffer, clu_host_memory_info* out_pInfo)
+{
+    if ((0 == in_buffer) || (0 == out_pInfo))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        HostAllocator::Allocation allocation;
+        if (FindHostAllocation(in_buffer, allocation))
         {
-            m_numDevices = CLU_MAX_NUM_DEVICES;
+            out_pInfo->host_ptr = allocation.m_ptr;
+            out_pInfo->size = allocation.m_size;
+            out_pInfo->backing = allocation.m_backing;
         }
-        status = clGetDeviceIDs(m_platform, deviceType, m_numDevices, m_deviceIds, 0);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
+        else
+        {
+            status = CL_INVALID_MEM_OBJECT;
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
 
-        // NOTE: GCC complains if we use array initialisers combined with goto,
-        //       so do element-wise assignment instead
-        cl_context_properties properties[CLU_MAXPROPERTYCOUNT];
-        int propNum = 0;
+//-----------------------------------------------------------------------------
+// buffer pools
+//   aligned buffers are cached by size class instead of being released.
+//   classes are quarter steps between powers of 2, rounded to the buffer
+//   alignment, so at most ~25% of a buffer is unused.
+//   idle buffers are kept in shards; a thread works in the shard its id
+//   hashes to, and only looks at other shards when its own has no buffer of
+//   the class it needs. threads rarely contend for a shard's mutex.
+//-----------------------------------------------------------------------------
+#define CLU_POOL_NUM_SHARDS 8
 
-        // append any user-provided context properties
-        if (in_params.default_context_props)
+struct PooledBuffer
+{
+    cl_mem m_mem;
+    void*  m_pHostPtr;
+};
+
+struct PoolShard
+{
+    std::mutex m_mutex;
+    std::map<size_t, std::vector<PooledBuffer> > m_idle; // by size class
+    std::set<cl_mem> m_acquired; // handed out, this shard holds those whose handle hashes to it
+};
+
+struct _clu_buffer_pool
+{
+    cl_mem_flags          m_flags;
+    size_t                m_maxCachedBytes; // 0 = unlimited
+    PoolShard             m_shards[CLU_POOL_NUM_SHARDS];
+    std::atomic<cl_ulong> m_acquires;
+    std::atomic<cl_ulong> m_hits;
+    std::atomic<cl_ulong> m_releases;
+    std::atomic<cl_ulong> m_trimmed;
+    std::atomic<size_t>   m_bytesInUse;
+    std::atomic<size_t>   m_bytesCached;
+    std::atomic<size_t>   m_peakBytes;
+};
+
+// 0 if in_size is too large for a size class
+size_t GetPoolSizeClass(size_t in_size)
+{
+    return GetSizeClass(in_size, CLU_Runtime::Get().GetBufferAlignment());
+}
+
+PoolShard& GetPoolShard(clu_buffer_pool in_pPool)
+{
+    size_t hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return in_pPool->m_shards[hash % CLU_POOL_NUM_SHARDS];
+}
+
+PoolShard& GetAcquiredShard(clu_buffer_pool in_pPool, cl_mem in_buffer)
+{
+    size_t hash = std::hash<cl_mem>()(in_buffer);
+    return in_pPool->m_shards[hash % CLU_POOL_NUM_SHARDS];
+}
+
+bool TakeIdleBuffer(PoolShard& in_shard, size_t in_sizeClass, PooledBuffer& out_buffer)
+{
+    std::lock_guard<std::mutex> lock(in_shard.m_mutex);
+    std::map<size_t, std::vector<PooledBuffer> >::iterator iter = in_shard.m_idle.find(in_sizeClass);
+    if ((iter == in_shard.m_idle.end()) || iter->second.empty())
+    {
+        return false;
+    }
+    out_buffer = iter->second.back();
+    iter->second.pop_back();
+    return true;
+}
+
+// release idle buffers until no more than in_maxCachedBytes are cached
+// the shard in_first is trimmed first, it is the one that just grew
+void TrimBufferPool(clu_buffer_pool in_pPool, size_t in_maxCachedBytes, size_t in_first)
+{
+    std::vector<cl_mem> released;
+    for (size_t s = 0; (s < CLU_POOL_NUM_SHARDS) && (in_pPool->m_bytesCached > in_maxCachedBytes); s++)
+    {
+        PoolShard& shard = in_pPool->m_shards[(in_first + s) % CLU_POOL_NUM_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        // largest classes first, they free the most memory per driver call
+        std::map<size_t, std::vector<PooledBuffer> >::reverse_iterator iter = shard.m_idle.rbegin();
+        for (; (iter != shard.m_idle.rend()) && (in_pPool->m_bytesCached > in_maxCachedBytes); iter++)
         {
-            // leave room for platform # and trailing 0
-            int maxPropertyCount = CLU_MAXPROPERTYCOUNT - 3;
-            while (propNum < maxPropertyCount)
+            std::vector<PooledBuffer>& idle = iter->second;
+            while (!idle.empty() && (in_pPool->m_bytesCached > in_maxCachedBytes))
+            {
+                released.push_back(idle.back().m_mem);
+                idle.pop_back();
+                in_pPool->m_bytesCached -= iter->first;
+            }
+        }
+    }
+    // the destructor callbacks free the host memory
+    for (size_t i = 0; i < released.size(); i++)
+    {
+        clReleaseMemObject(released[i]);
+    }
+    in_pPool->m_trimmed += released.size();
+}
+
+clu_buffer_pool CLU_API_CALL
+cluBufferPoolCreate(const clu_buffer_pool_params* in_pParams, cl_int* out_pStatus)
+{
+    clu_buffer_pool pPool = 0;
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        pPool = new _clu_buffer_pool;
+        pPool->m_flags = in_pParams ? in_pParams->flags : 0;
+        pPool->m_maxCachedBytes = in_pParams ? in_pParams->max_cached_bytes : 0;
+        pPool->m_acquires = 0;
+        pPool->m_hits = 0;
+        pPool->m_releases = 0;
+        pPool->m_trimmed = 0;
+        pPool->m_bytesInUse = 0;
+        pPool->m_bytesCached = 0;
+        pPool->m_peakBytes = 0;
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return pPool;
+}
+
+cl_mem CLU_API_CALL
+cluPoolAcquire(clu_buffer_pool in_pPool, size_t in_size, void** out_pPtr, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluPoolAcquire", &status, 0, 0, 0, in_size);
+    PooledBuffer buffer = {0, 0};
+    if (in_pPool && in_size)
+    {
+        try
+        {
+            size_t sizeClass = GetPoolSizeClass(in_size);
+            size_t first = &GetPoolShard(in_pPool) - in_pPool->m_shards;
+            bool hit = false;
+            for (size_t s = 0; sizeClass && !hit && (s < CLU_POOL_NUM_SHARDS); s++)
+            {
+                hit = TakeIdleBuffer(in_pPool->m_shards[(first + s) % CLU_POOL_NUM_SHARDS], sizeClass, buffer);
+            }
+            if (0 == sizeClass)
+            {
+                status = CL_INVALID_BUFFER_SIZE;
+            }
+            else if (hit)
             {
-                cl_context_properties prop = in_params.default_context_props[propNum];
-                if (0 == prop)
+                in_pPool->m_hits++;
+                in_pPool->m_bytesCached -= sizeClass;
+                status = CL_SUCCESS;
+            }
+            else
+            {
+                buffer.m_mem = CreateAlignedBuffer(in_pPool->m_flags, sizeClass, &buffer.m_pHostPtr, &status, "cluPoolAcquire");
+            }
+            if (buffer.m_mem)
+            {
+                PoolShard& shard = GetAcquiredShard(in_pPool, buffer.m_mem);
                 {
-                    break;
+                    std::lock_guard<std::mutex> lock(shard.m_mutex);
+                    shard.m_acquired.insert(buffer.m_mem);
                 }
-                else
+                in_pPool->m_acquires++;
+                size_t inUse = (in_pPool->m_bytesInUse += sizeClass);
+                size_t peak = in_pPool->m_peakBytes;
+                while ((inUse > peak) && !in_pPool->m_peakBytes.compare_exchange_weak(peak, inUse))
                 {
-                    properties[propNum] = prop;
-                    ++propNum;
-                    properties[propNum] = in_params.default_context_props[propNum];
-                    ++propNum;
                 }
-            } // end loop over input properties
-        } // end if there are default context properties
-        properties[propNum] = CL_CONTEXT_PLATFORM;
-        ++propNum;
-        properties[propNum] = (cl_context_properties)m_platform;
-        ++propNum;
-        properties[propNum] = (cl_context_properties)0;
-
-        m_context = clCreateContext(properties, m_numDevices, m_deviceIds,
-            0 /* callback */, 0 /* callback data */, &status);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
-    }
-    else
-    {
-        clRetainContext(in_params.existing_context); // add a reference to the provided context
-
-        // get # of devices & device Ids
-        // here, we have the context, not the platform
-        cl_int status = clGetContextInfo(m_context, CL_CONTEXT_NUM_DEVICES, sizeof(m_numDevices), &m_numDevices, 0);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
-
-        // clamp to CLU_MAX_NUM_DEVICES
-        if (m_numDevices > CLU_MAX_NUM_DEVICES)
+            }
+        }
+        catch (...) // internal error, e.g. thrown by STL
         {
-            m_numDevices = CLU_MAX_NUM_DEVICES;
+            status = CL_OUT_OF_HOST_MEMORY;
+            if (buffer.m_mem)
+            {
+                clReleaseMemObject(buffer.m_mem);
+                buffer.m_mem = 0;
+                buffer.m_pHostPtr = 0;
+            }
         }
-        status = clGetContextInfo(m_context, CL_CONTEXT_DEVICES, m_numDevices * sizeof(cl_device_id), m_deviceIds, 0);
-        OCL_VALIDATE(status);
-        if (CL_SUCCESS != status) goto exit;
     }
-
-    // construct a map from clu device order (cpu, gpu, accelerator, custom) into platform device order
-    for (cl_uint d = 0; d < m_numDevices; d++)
+    if (out_pPtr)
     {
-        cl_device_type deviceType;
-        status = clGetDeviceInfo(m_deviceIds[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &deviceType, 0);
-        OCL_VALIDATE(status);
+        *out_pPtr = buffer.m_pHostPtr;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return buffer.m_mem;
+}
 
-        // usually device 0 is the default, but maybe this runtime explicitly sets this bit:
-        if ((0 == d) || (deviceType & CL_DEVICE_TYPE_DEFAULT))
+cl_int CLU_API_CALL
+cluPoolRelease(clu_buffer_pool in_pPool, cl_mem in_buffer)
+{
+    if ((0 == in_pPool) || (0 == in_buffer))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        // only buffers this pool handed out and did not get back yet, the byte counts would wrap otherwise
         {
-            deviceType &= ~CL_DEVICE_TYPE_DEFAULT; // clear the bit
-            m_device_type_to_id.SetDefault(deviceType);
+            PoolShard& acquiredShard = GetAcquiredShard(in_pPool, in_buffer);
+            std::lock_guard<std::mutex> lock(acquiredShard.m_mutex);
+            if (0 == acquiredShard.m_acquired.erase(in_buffer))
+            {
+                return CL_INVALID_MEM_OBJECT;
+            }
         }
 
-        m_device_type_to_id.SetDevice(deviceType, m_deviceIds[d]);
+        // pooled buffers are created with the size of their class
+        PooledBuffer buffer = {in_buffer, 0};
+        size_t sizeClass = 0;
+        status = clGetMemObjectInfo(in_buffer, CL_MEM_SIZE, sizeof(sizeClass), &sizeClass, 0);
+        if (CL_SUCCESS == status)
+        {
+            status = clGetMemObjectInfo(in_buffer, CL_MEM_HOST_PTR, sizeof(buffer.m_pHostPtr), &buffer.m_pHostPtr, 0);
+        }
+        if (CL_SUCCESS == status)
+        {
+            PoolShard& shard = GetPoolShard(in_pPool);
+            {
+                std::lock_guard<std::mutex> lock(shard.m_mutex);
+                shard.m_idle[sizeClass].push_back(buffer);
+            }
+            in_pPool->m_releases++;
+            in_pPool->m_bytesInUse -= sizeClass;
+            size_t cached = (in_pPool->m_bytesCached += sizeClass);
+            if (in_pPool->m_maxCachedBytes && (cached > in_pPool->m_maxCachedBytes))
+            {
+                TrimBufferPool(in_pPool, in_pPool->m_maxCachedBytes, &shard - in_pPool->m_shards);
+            }
+        }
     }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
 
-    AddObject(m_context);
-
-    m_isInitialized = true;
-
-exit:
-    delete [] platforms;
+cl_int CLU_API_CALL
+cluBufferPoolTrim(clu_buffer_pool in_pPool, size_t in_maxCachedBytes)
+{
+    if (0 == in_pPool)
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        TrimBufferPool(in_pPool, in_maxCachedBytes, 0);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
     return status;
 }
 
-//------------------------------------------------------------------------
-// return cl_device from in_clDeviceType
-//------------------------------------------------------------------------
-cl_device_id CLU_Runtime::GetDevice(cl_device_type in_clDeviceType)
+cl_int CLU_API_CALL
+cluGetBufferPoolStats(clu_buffer_pool in_pPool, clu_buffer_pool_stats* out_pStats)
 {
-    return m_device_type_to_id.GetDevice(in_clDeviceType);
+    if ((0 == in_pPool) || (0 == out_pStats))
+    {
+        return CL_INVALID_VALUE;
+    }
+    out_pStats->acquires = in_pPool->m_acquires;
+    out_pStats->hits = in_pPool->m_hits;
+    out_pStats->releases = in_pPool->m_releases;
+    out_pStats->trimmed = in_pPool->m_trimmed;
+    out_pStats->bytes_in_use = in_pPool->m_bytesInUse;
+    out_pStats->bytes_cached = in_pPool->m_bytesCached;
+    out_pStats->peak_bytes_in_use = in_pPool->m_peakBytes;
+    return CL_SUCCESS;
 }
 
-//-----------------------------------------------------------------------------
-// return command queue based on device type
-//-----------------------------------------------------------------------------
-cl_command_queue CLU_Runtime::GetCommandQueue(cl_device_type in_clDeviceType, cl_int* out_status)
+cl_int CLU_API_CALL
+cluBufferPoolDestroy(clu_buffer_pool in_pPool)
 {
+    if (0 == in_pPool)
+    {
+        return CL_INVALID_VALUE;
+    }
     cl_int status = CL_SUCCESS;
-    int index = m_device_type_to_id.GetIndexFromType(in_clDeviceType);
-    cl_command_queue q = m_commandQueue[index];
-    if (0 == q)
+    try
     {
-        cl_device_id deviceId = m_device_type_to_id.GetDevice(in_clDeviceType);
-
-#ifdef CL_API_SUFFIX__VERSION_2_0
-        // clCreateCommandQueue was deprecated in 2.0
-        // We still need to check if the current platform only supports 1.x, though.
-        clu_platform_info info = cluGetPlatformInfo(m_platform, &status);
-        OCL_VALIDATE(status);
+        TrimBufferPool(in_pPool, 0, 0);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    delete in_pPool;
+    return status;
+}
 
-        if (info.version && strstr(info.version, "OpenCL 1.")) {
-            q = clCreateCommandQueue(m_context, deviceId, m_queueProperties, &status);
-        } else {
-            cl_queue_properties propertyList[3] = {CL_QUEUE_PROPERTIES, m_queueProperties, 0};
-            q = clCreateCommandQueueWithProperties(m_context, deviceId, propertyList, &status);
+//-----------------------------------------------------------------------------
+// shared virtual memory
+//-----------------------------------------------------------------------------
+void* CLU_API_CALL
+cluSVMAlloc(cl_svm_mem_flags in_flags, size_t in_size, cl_int* out_pStatus)
+{
+    cl_int status = CL_INVALID_VALUE;
+    void* p = 0;
+    if (in_size)
+    {
+        try
+        {
+            CLU_Runtime& runtime = CLU_Runtime::Get();
+            p = runtime.GetSvmCache().Allocate(runtime.GetContext(), in_flags, in_size, &status);
         }
-#else
-        q = clCreateCommandQueue(m_context, deviceId, m_queueProperties, &status);
-#endif
-
-        OCL_VALIDATE(status);
-
-        if (q)
+        catch (...) // internal error, e.g. thrown by STL
         {
-            m_commandQueue[index] = q;
-            AddObject(q);
+            status = CL_OUT_OF_HOST_MEMORY;
         }
     }
-
-    if (out_status)
+    if (out_pStatus)
     {
-        *out_status = status;
+        *out_pStatus = status;
     }
-    return q;
+    return p;
 }
 
-//-----------------------------------------------------------------------------
-// return build errors
-// NOT THREAD SAFE: this uses an internal char* for convenience
-//-----------------------------------------------------------------------------
-const char* CLU_Runtime::GetBuildErrors(cl_program in_program)
+cl_int CLU_API_CALL
+cluSVMFree(void* in_ptr)
 {
-    m_buildString.clear();
-    for (cl_uint d = 0; d < m_numDevices; d++)
+    cl_int status = CL_INVALID_VALUE;
+    try
     {
-        // get build log size
-        size_t buildLogSize = 0;
-        cl_int status = clGetProgramBuildInfo(
-            in_program, m_deviceIds[d], CL_PROGRAM_BUILD_LOG,
-            0, 0, &buildLogSize);
-        OCL_VALIDATE(status);
-
-        char* buildLog = new char[buildLogSize+1];
-        assert(buildLog);
+        if (in_ptr && CLU_Runtime::Get().GetSvmCache().Free(in_ptr))
+        {
+            status = CL_SUCCESS;
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
 
-        // get the build log
-        status = clGetProgramBuildInfo(
-            in_program, m_deviceIds[d], CL_PROGRAM_BUILD_LOG, 
-            buildLogSize, buildLog, 0);
-        OCL_VALIDATE(status);
+cl_int CLU_API_CALL
+cluSVMTrim(size_t in_maxCachedBytes)
+{
+    CLU_Runtime& runtime = CLU_Runtime::Get();
+    runtime.GetSvmCache().Trim(runtime.GetContext(), in_maxCachedBytes);
+    return CL_SUCCESS;
+}
 
-        buildLog[buildLogSize] = 0;
-        m_buildString.append(buildLog);
-        delete [] buildLog;
+cl_int CLU_API_CALL
+cluGetSVMStats(clu_svm_stats* out_pStats)
+{
+    if (0 == out_pStats)
+    {
+        return CL_INVALID_VALUE;
     }
-    return m_buildString.c_str();
+    CLU_Runtime::Get().GetSvmCache().GetStats(*out_pStats);
+    return CL_SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
-// Build a program, called by generated code
+// arenas
+//   one aligned buffer; allocations are sub-buffers at increasing offsets.
+//   sub-buffers are kept across resets: a request that allocates the same
+//   sizes in the same order as the previous one gets the same sub-buffers
+//   back, so steady state needs no host or device allocation at all.
 //-----------------------------------------------------------------------------
-cl_program CLU_Runtime::HashProgram(
-    cl_uint in_numSources,
-    const char** in_sources,
-    const size_t* in_source_lengths,
-    cl_int*     out_pStatus)
+cl_int WaitForEvents(const cl_event* in_events, cl_uint in_numEvents, const clu_wait_policy* in_pPolicy);
+
+struct ArenaBlock
 {
-    cl_int status = CL_SUCCESS;
+    size_t m_offset;
+    size_t m_size;
+    cl_mem m_mem;
+};
 
-    // because this is called by generated code, we can be confident that the
-    // source passed in is at an address that is constant for the lifetime of
-    // the application. Hence, it's suitable for use as a hash key:
-    const void* hashKey = in_sources;
+struct _clu_arena
+{
+    cl_mem   m_buffer;
+    char*    m_pHostPtr;
+    size_t   m_capacity;
+    size_t   m_alignment;
+    size_t   m_top;       // first free byte
+    size_t   m_numAllocs; // since the last reset, index into m_blocks
+    cl_event m_fence;     // the memory may be reused once this completes
+    std::vector<ArenaBlock> m_blocks;
+};
 
-    cl_program program = m_programMap[hashKey]; // find program in hash
-    if (0 == program) // hasn't been built yet?
+// the arena's memory may still be in use until the fence of the last reset completes
+cl_int WaitForArenaFence(clu_arena in_pArena)
+{
+    cl_int status = CL_SUCCESS;
+    if (in_pArena->m_fence)
     {
-        // programs hashed by CLU always use the default build options
-        const char* buildOptions = 0;
-        program = BuildProgram(in_numSources, in_sources, in_source_lengths, buildOptions, &status);
-        if (program) // if successful
-        {
-            AddObject(program); // manage lifetime
-            m_programMap[hashKey] = program; // add to hash
-        }
+        status = WaitForEvents(&in_pArena->m_fence, 1, 0);
+        RecycleEvent(in_pArena->m_fence);
+        in_pArena->m_fence = 0;
     }
+    return status;
+}
 
-    if (out_pStatus)
+void ReleaseArenaBlocks(clu_arena in_pArena, size_t in_first)
+{
+    for (size_t i = in_first; i < in_pArena->m_blocks.size(); i++)
     {
-        *out_pStatus = status;
+        clReleaseMemObject(in_pArena->m_blocks[i].m_mem);
     }
-    return program;
+    in_pArena->m_blocks.resize(in_first);
 }
 
-//-----------------------------------------------------------------------------
-// Build a program
-//-----------------------------------------------------------------------------
-cl_program CLU_Runtime::BuildProgram(
-    cl_uint in_numSources,
-    const char** in_sources,
-    const size_t* in_source_lengths,
-    const char* in_buildOptions,
-    cl_int*     out_pStatus)
+clu_arena CLU_API_CALL
+cluCreateArena(cl_mem_flags in_flags, size_t in_capacity, cl_int* out_pStatus)
 {
-    cl_int status = CL_SUCCESS;
-
-    cl_context context = GetContext();
-    cl_program program = clCreateProgramWithSource(context, in_numSources, in_sources, in_source_lengths, &status);
-    OCL_VALIDATE(status);
-
-    // no build options? use default.
-    if (0 == in_buildOptions)
+    cl_int status = CL_INVALID_VALUE;
+    ApiScope scope(CLU_CALL_CREATE_BUFFER, "cluCreateArena", &status, 0, 0, 0, in_capacity);
+    clu_arena pArena = 0;
+    try
+    {
+        void* pHostPtr = 0;
+        cl_mem buffer = CreateAlignedBuffer(in_flags, in_capacity, &pHostPtr, &status, "cluCreateArena");
+        if (buffer)
+        {
+            pArena = new _clu_arena;
+            pArena->m_buffer = buffer;
+            pArena->m_pHostPtr = (char*)pHostPtr;
+            clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(size_t), &pArena->m_capacity, 0);
+            pArena->m_alignment = CLU_Runtime::Get().GetSubBufferAlignment();
+            pArena->m_top = 0;
+            pArena->m_numAllocs = 0;
+            pArena->m_fence = 0;
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
     {
-        in_buildOptions = GetBuildOptions();
+        status = CL_OUT_OF_HOST_MEMORY;
     }
-    status = clBuildProgram(program, m_numDevices, m_deviceIds, in_buildOptions, 0, 0);
-
-    OCL_VALIDATE(status);
-
     if (out_pStatus)
     {
         *out_pStatus = status;
     }
-
-    return program;
+    return pArena;
 }
 
-cl_program CLU_Runtime::BuildProgram(
-    cl_uint in_numBinaries,
-    const size_t* in_binary_lengths,
-    const unsigned char** in_binaries,
-    const char* in_buildOptions,
-    cl_int*     out_pStatus)
+cl_mem CLU_API_CALL
+cluArenaAlloc(clu_arena in_pArena, size_t in_size, void** out_pPtr, cl_int* out_pStatus)
 {
-    cl_int status = CL_SUCCESS;
-
-    // FIXME: how do we know which binary goes to which device?
-    // CLU abstracts the device array internally. Recommend using device type.
-    // Note CLU does not really handle having more than 1 device of the same type, that is an advanced move.
-    // for "advanced" context moves, initialize CLU with an existing context.
-
-    // FIXME: just protect from obvious crashes for now
-    if (in_numBinaries > m_numDevices)
+    cl_int status = CL_INVALID_VALUE;
+    cl_mem mem = 0;
+    size_t offset = 0;
+    if (in_pArena && in_size)
     {
-        in_numBinaries = m_numDevices;
+        status = WaitForArenaFence(in_pArena);
+        offset = (in_pArena->m_top + in_pArena->m_alignment - 1) & ~(in_pArena->m_alignment - 1);
+        if ((CL_SUCCESS == status) &&
+            ((offset > in_pArena->m_capacity) || (in_size > in_pArena->m_capacity - offset)))
+        {
+            status = CL_MEM_OBJECT_ALLOCATION_FAILURE; // full
+        }
+        if (CL_SUCCESS == status)
+        {
+            std::vector<ArenaBlock>& blocks = in_pArena->m_blocks;
+            size_t index = in_pArena->m_numAllocs;
+            if ((index < blocks.size()) && (blocks[index].m_offset == offset) && (blocks[index].m_size == in_size))
+            {
+                mem = blocks[index].m_mem;
+            }
+            else
+            {
+                // the request diverged from the previous one, the cached sub-buffers from here on do not fit
+                ReleaseArenaBlocks(in_pArena, index);
+                cl_buffer_region region = {offset, in_size};
+                mem = clCreateSubBuffer(in_pArena->m_buffer, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+                if (mem)
+                {
+                    try
+                    {
+                        ArenaBlock block = {offset, in_size, mem};
+                        blocks.push_back(block);
+                    }
+                    catch (...) // internal error, e.g. thrown by STL
+                    {
+                        clReleaseMemObject(mem);
+                        mem = 0;
+                        status = CL_OUT_OF_HOST_MEMORY;
+                    }
+                }
+            }
+            if (mem)
+            {
+                in_pArena->m_numAllocs++;
+                in_pArena->m_top = offset + in_size;
+                status = CL_SUCCESS;
+            }
+        }
+    }
+    if (out_pPtr)
+    {
+        *out_pPtr = mem ? in_pArena->m_pHostPtr + offset : 0;
     }
-
-    cl_context context = GetContext();
-    cl_program program = clCreateProgramWithBinary(context, in_numBinaries, m_deviceIds, in_binary_lengths, (const unsigned char **) in_binaries, 0, &status);
-    OCL_VALIDATE(status);
-
-    status = clBuildProgram(program, m_numDevices, m_deviceIds, in_buildOptions, 0, 0);
-    OCL_VALIDATE(status);
-
     if (out_pStatus)
     {
         *out_pStatus = status;
     }
-
-    return program;
+    return mem;
 }
 
-//-----------------------------------------------------------------------------
-// find max buffer alignment across all devices in context
-//-----------------------------------------------------------------------------
-cl_uint CLU_Runtime::GetBufferAlignment()
+cl_int CLU_API_CALL
+cluArenaReset(clu_arena in_pArena, cl_event in_fence)
 {
-    if (0 == m_bufferAlignment)
+    if (0 == in_pArena)
     {
-        // Some architectures require at least 4KB alignment, in base and size,
-        // for 0-copy to work. As of OpenCL 2.0, there is no query for preferred alignment
-        // that would reveal this.
-        m_bufferAlignment = 4096;
-
-        cl_uint numDevices = 0;
-        clGetContextInfo(CLU_CONTEXT, CL_CONTEXT_NUM_DEVICES, sizeof(cl_uint), &numDevices, 0);
-        cl_device_id* pDevices = new cl_device_id[numDevices];
-        clGetContextInfo(CLU_CONTEXT, CL_CONTEXT_DEVICES, sizeof(cl_device_id)*numDevices, pDevices, 0);
-        for (cl_uint i = 0; i < numDevices; i++)
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        status = WaitForArenaFence(in_pArena); // resets without an allocation in between
+        if (in_fence)
         {
-            cl_uint deviceAlign = 0;
-            clGetDeviceInfo(pDevices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &deviceAlign, 0);
-            deviceAlign /= 8; // returns bits! want bytes.
-            if (deviceAlign > m_bufferAlignment)
+            status = clRetainEvent(in_fence);
+            if (CL_SUCCESS == status)
             {
-                m_bufferAlignment = deviceAlign;
+                NoteEventCreated();
+                in_pArena->m_fence = in_fence;
             }
         }
-        delete [] pDevices;
+        in_pArena->m_top = 0;
+        in_pArena->m_numAllocs = 0;
     }
-
-    return m_bufferAlignment;
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
 }
 
-//**********************************************************************************
-// clu API (extern "C")
-//**********************************************************************************
+size_t CLU_API_CALL
+cluArenaUsed(clu_arena in_pArena)
+{
+    return in_pArena ? in_pArena->m_top : 0;
+}
 
-//-----------------------------------------------------------------------------
-// Start using clu
-//-----------------------------------------------------------------------------
 cl_int CLU_API_CALL
-cluInitialize(clu_initialize_params* params)
+cluReleaseArena(clu_arena in_pArena)
 {
+    if (0 == in_pArena)
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
     try
     {
-        clu_initialize_params defaultParams = {0, 0, 0, 0, 0, CL_DEVICE_TYPE_ALL};
-        if (params)
-        {
-            clu_initialize_params temp = {
-                params->vendor_name, params->existing_context,
-                params->compile_options, params->default_queue_props,
-                params->default_context_props, params->preferred_device_type};
-            defaultParams = temp;
-        }
-        return CLU_Runtime::Get().Initialize(defaultParams);
+        status = WaitForArenaFence(in_pArena);
     }
     catch (...) // internal error, e.g. thrown by STL
     {
-        return CL_DEVICE_NOT_FOUND;
+        status = CL_OUT_OF_HOST_MEMORY;
     }
+    ReleaseArenaBlocks(in_pArena, 0);
+    clReleaseMemObject(in_pArena->m_buffer); // sub-buffers hold a reference, so this is the last
+    delete in_pArena;
+    return status;
 }
 
 //-----------------------------------------------------------------------------
-// has clu been initialized?
+// wait until /any/ event in the list fires
 //-----------------------------------------------------------------------------
-cl_bool CLU_API_CALL
-    cluIsInitialized(void)
+void CL_CALLBACK CLU_WaitOnAnyEventCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+{
+    in_event = 0; // unused, remove compiler warning
+    assert(CL_SUCCESS == in_eventStatus);
+    clSetUserEventStatus((cl_event)in_data, CL_COMPLETE);
+    RecycleEvent((cl_event)in_data);
+}
+
+// wait on any event implementation:
+//   1. create a user event
+//   2. set a callback on every event in the input list, this callback sets the user event
+//   3. wait on the internal user event
+cl_int CLU_API_CALL
+cluWaitOnAnyEvent(const cl_event* event_list,
+                  cl_uint         num_events)
 {
+    cl_int status = CL_INVALID_EVENT_WAIT_LIST;
+    ApiScope scope(CLU_CALL_WAIT, "cluWaitOnAnyEvent", &status);
+
+    // need an early exit, or 0-length list results in infinite wait
+    if ((0 == event_list) || (0 == num_events))
+    {
+        goto exit;
+    }
+
     try
     {
-        return CLU_Runtime::Get().GetIsInitialized();
+        cl_event waitEvent = clCreateUserEvent(cluGetContext(), &status);
+        if (CL_SUCCESS == status)
+        {
+            NoteEventCreated();
+            for (cl_uint i = 0; i < num_events; i++)
+            {
+                status = clRetainEvent(waitEvent); // the callback will use the event, so hold a reference
+                NoteEventCreated();
+                status = clSetEventCallback(event_list[i], CL_COMPLETE, CLU_WaitOnAnyEventCallback, waitEvent);
+                if (CL_SUCCESS != status)
+                {
+                    break; // failed for some reason
+                }
+            }
+        } // end if got user event for internal callback function
+
+        if (CL_SUCCESS == status)
+        {
+            status = clWaitForEvents(1, &waitEvent);
+        }
+        RecycleEvent(waitEvent);
     }
-    catch (...) // internal error, e.g. thrown by STL
+    catch (...)
     {
-        return false;
     }
+exit:
+    return status;
 }
 
 //-----------------------------------------------------------------------------
-// release all memory associated with clu
+// wait sets
+//   one callback is set per event when it is added. the callback appends the
+//   event's index to the completed list, waits take indices from that list.
+//   the set is reference counted by the application and by pending callbacks.
 //-----------------------------------------------------------------------------
-void CLU_API_CALL
-cluRelease(void)
+struct _clu_wait_set
 {
-    try
+    std::mutex              m_mutex;
+    std::condition_variable m_completedChanged;
+    std::vector<cl_uint>    m_completed;  // indices not yet reported
+    size_t                  m_reported;   // m_completed[0, m_reported) have been returned
+    cl_uint                 m_numAdded;
+    cl_uint                 m_numPending; // added, not yet reported
+    cl_uint                 m_refCount;
+};
+
+struct WaitSetEntry
+{
+    clu_wait_set m_pSet;
+    cl_uint      m_index;
+};
+
+void ReleaseWaitSet(clu_wait_set in_pSet, std::unique_lock<std::mutex>& in_lock)
+{
+    bool last = (0 == --in_pSet->m_refCount);
+    in_lock.unlock();
+    if (last)
     {
-        CLU_Runtime::Get().Reset();
+        delete in_pSet;
     }
-    catch (...) // internal error, e.g. thrown by STL
-    {}
 }
 
-//-----------------------------------------------------------------------------
-// return the runtime context
-//   may have been created by the runtime, or provided with cluInitialize
-//-----------------------------------------------------------------------------
-cl_context CLU_API_CALL cluGetContext()
+void CL_CALLBACK CLU_WaitSetCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
 {
-    return CLU_Runtime::Get().GetContext();
+    // errors complete the event too: report the index, the application can query the status
+    in_event = 0; in_eventStatus = 0; // unused, remove compiler warning
+    WaitSetEntry* pEntry = (WaitSetEntry*)in_data;
+    clu_wait_set pSet = pEntry->m_pSet;
+    std::unique_lock<std::mutex> lock(pSet->m_mutex);
+    pSet->m_completed.push_back(pEntry->m_index);
+    pSet->m_completedChanged.notify_all();
+    delete pEntry;
+    ReleaseWaitSet(pSet, lock);
 }
 
-//-----------------------------------------------------------------------------
-// return cl device associated with device type
-//-----------------------------------------------------------------------------
-cl_device_id CLU_API_CALL
-cluGetDevice(cl_device_type in_clDeviceType)
+clu_wait_set CLU_API_CALL cluCreateWaitSet(cl_int* out_pStatus)
 {
-    return CLU_Runtime::Get().GetDevice(in_clDeviceType);
+    clu_wait_set pSet = 0;
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        pSet = new _clu_wait_set;
+        pSet->m_reported = 0;
+        pSet->m_numAdded = 0;
+        pSet->m_numPending = 0;
+        pSet->m_refCount = 1;
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return pSet;
 }
 
-//-----------------------------------------------------------------------------
-// Return cl_platform_id
-//   may have been chosen by the runtime, or provided with cluInitialize
-//-----------------------------------------------------------------------------
-cl_platform_id CLU_API_CALL cluGetPlatform()
+cl_int CLU_API_CALL cluWaitSetAdd(clu_wait_set in_pSet, cl_event in_event, cl_uint* out_pIndex)
 {
-    return CLU_Runtime::Get().GetPlatform();
+    if ((0 == in_pSet) || (0 == in_event))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        WaitSetEntry* pEntry = new WaitSetEntry;
+        pEntry->m_pSet = in_pSet;
+        {
+            std::lock_guard<std::mutex> lock(in_pSet->m_mutex);
+            pEntry->m_index = in_pSet->m_numAdded++;
+            in_pSet->m_numPending++;
+            in_pSet->m_refCount++; // held by the callback
+        }
+        if (out_pIndex)
+        {
+            *out_pIndex = pEntry->m_index;
+        }
+        // the callback may run before this returns
+        status = clSetEventCallback(in_event, CL_COMPLETE, CLU_WaitSetCallback, pEntry);
+        if (CL_SUCCESS != status)
+        {
+            std::lock_guard<std::mutex> lock(in_pSet->m_mutex);
+            in_pSet->m_numPending--;
+            delete pEntry;
+            in_pSet->m_refCount--; // the application still holds a reference
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
 }
 
-//-----------------------------------------------------------------------------
-// Return cl_command_queue associated with cl_device_id
-//-----------------------------------------------------------------------------
-cl_command_queue CLU_API_CALL
-cluGetCommandQueue(cl_device_type in_clDeviceType,
-                  cl_int * errcode_ret)
+cl_int WaitSetWait(clu_wait_set in_pSet, cl_uint in_timeoutMs,
+    cl_uint in_maxIndices, cl_uint* out_indices, cl_uint* out_pNumIndices)
 {
-    return CLU_Runtime::Get().GetCommandQueue(in_clDeviceType, errcode_ret);
+    cl_int status = CL_SUCCESS;
+    cl_uint numIndices = 0;
+    try
+    {
+        std::unique_lock<std::mutex> lock(in_pSet->m_mutex);
+        if (0 == in_pSet->m_numPending)
+        {
+            status = CL_INVALID_EVENT_WAIT_LIST; // nothing to wait for, would never return
+        }
+        else
+        {
+            std::vector<cl_uint>& completed = in_pSet->m_completed;
+            size_t& reported = in_pSet->m_reported;
+            if (CLU_WAIT_INFINITE == in_timeoutMs)
+            {
+                while (reported == completed.size())
+                {
+                    in_pSet->m_completedChanged.wait(lock);
+                }
+            }
+            else
+            {
+                std::chrono::steady_clock::time_point timeout =
+                    std::chrono::steady_clock::now() + std::chrono::milliseconds(in_timeoutMs);
+                while (reported == completed.size())
+                {
+                    if (std::cv_status::timeout == in_pSet->m_completedChanged.wait_until(lock, timeout))
+                    {
+                        break;
+                    }
+                }
+            }
+
+            numIndices = (cl_uint)std::min((size_t)in_maxIndices, completed.size() - reported);
+            if (0 == numIndices)
+            {
+                status = CLU_WAIT_TIMEOUT;
+            }
+            for (cl_uint i = 0; i < numIndices; i++)
+            {
+                out_indices[i] = completed[reported++];
+            }
+            in_pSet->m_numPending -= numIndices;
+            // compact rather than erase from the front on every wait
+            if (reported == completed.size())
+            {
+                completed.clear();
+                reported = 0;
+            }
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (out_pNumIndices)
+    {
+        *out_pNumIndices = numIndices;
+    }
+    return status;
 }
 
-//-----------------------------------------------------------------------------
-// enqueue a kernel
-//-----------------------------------------------------------------------------
-cl_int CLU_API_CALL
-cluEnqueue(cl_kernel kern, clu_enqueue_params* params)
+cl_int CLU_API_CALL cluWaitSetWait(clu_wait_set in_pSet, cl_uint in_timeoutMs,
+    cl_uint in_maxIndices, cl_uint* out_indices, cl_uint* out_pNumIndices)
 {
-    cl_command_queue q = params->queue;
-    if (0 == q)
+    if ((0 == in_pSet) || (0 == in_maxIndices) || (0 == out_indices))
     {
-        q = CLU_DEFAULT_Q;
+        return CL_INVALID_VALUE;
     }
-    const clu_nd_range& range = params->nd_range;
-    const size_t * offset = (!range.offset[0] && !range.offset[1] && !range.offset[2]) ? 0 : range.offset;
-    const size_t * local  = (!range.local[0]  && !range.local[1]  && !range.local[2])  ? 0 : range.local;
-    cl_int status = clEnqueueNDRangeKernel(q, kern, range.dim, offset, range.global, local,
-        params->num_events_in_wait_list, params->event_wait_list, params->out_event);
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_WAIT, "cluWaitSetWait", &status);
+    status = WaitSetWait(in_pSet, in_timeoutMs, in_maxIndices, out_indices, out_pNumIndices);
     return status;
 }
 
-//-----------------------------------------------------------------------------
-// get build errors (as a string) from a cl_program
-//-----------------------------------------------------------------------------
-const char * CLU_API_CALL cluGetBuildErrors(cl_program in_program)
+cl_uint CLU_API_CALL cluWaitSetPending(clu_wait_set in_pSet)
 {
-    const char* errors = 0;
-    try
+    if (0 == in_pSet)
     {
-        errors = CLU_Runtime::Get().GetBuildErrors(in_program);
+        return 0;
     }
-    catch (...)
+    std::lock_guard<std::mutex> lock(in_pSet->m_mutex);
+    return in_pSet->m_numPending;
+}
+
+cl_int CLU_API_CALL cluReleaseWaitSet(clu_wait_set in_pSet)
+{
+    if (0 == in_pSet)
     {
+        return CL_INVALID_VALUE;
     }
-    return errors;
+    std::unique_lock<std::mutex> lock(in_pSet->m_mutex);
+    ReleaseWaitSet(in_pSet, lock);
+    return CL_SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
-// Build a program for all current devices from source
+// completion queues
+//   event callbacks push (tag, status) into a lock-free ring, the consumer pops.
+//   registrations are limited to the ring capacity, so a push never fails.
+//   the consumer only takes the mutex to sleep; producers only take it to wake
+//   a sleeping consumer.
 //-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildSource(const char* in_source,
-              size_t source_length, /* may be zero */
-              const char* in_buildOptions, /* may be NULL */
-              cl_int * errcode_ret) /* may be NULL */
+#define CLU_COMPLETION_QUEUE_DEFAULT_CAPACITY 4096
+
+struct CompletedEvent
 {
-    cl_program program = 0;
-    cl_int status = CL_INVALID_VALUE;
+    void*  m_tag;
+    cl_int m_status;
+};
 
-    size_t* pLength = 0;
-    if (0 != source_length)
-    {
-        pLength = &source_length;
-    }
+struct _clu_completion_queue
+{
+    _clu_completion_queue(size_t in_capacity) : m_ring(in_capacity), m_capacity(in_capacity),
+        m_registered(0), m_refCount(1), m_consumerSleeping(false) {}
+
+    MpscRing<CompletedEvent> m_ring;
+    size_t                   m_capacity;
+    std::atomic<size_t>      m_registered; // added, not yet polled
+    std::atomic<cl_uint>     m_refCount;   // application + pending callbacks
+    std::atomic<bool>        m_consumerSleeping;
+    std::mutex               m_mutex;
+    std::condition_variable  m_completed;
+};
 
-    try
-    {
-        program = CLU_Runtime::Get().BuildProgram(1, &in_source, pLength, in_buildOptions, &status);
-    }
-    catch (...) // internal error, e.g. thrown by STL
-    {
-        status = CL_BUILD_PROGRAM_FAILURE;
-    }
+struct CompletionQueueEntry
+{
+    clu_completion_queue m_pQueue;
+    void*                m_tag;
+};
 
-    if (errcode_ret)
+void ReleaseCompletionQueue(clu_completion_queue in_pQueue)
+{
+    if (1 == in_pQueue->m_refCount.fetch_sub(1))
     {
-        *errcode_ret = status;
+        delete in_pQueue;
     }
-    return program;
 }
 
-//-----------------------------------------------------------------------------
-// Build a program for all current devices from binary
-//-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildBinary(size_t binary_length,
-              const unsigned char* in_binary,
-              const char* in_buildOptions, /* may be NULL */
-              cl_int * errcode_ret) /* may be NULL */
+void CL_CALLBACK CLU_CompletionQueueCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
 {
-    cl_program program = 0;
-    cl_int status = CL_INVALID_VALUE;
-
-    size_t* pLength = 0;
-    if (0 != binary_length)
-    {
-        pLength = &binary_length;
-    }
+    in_event = 0; // unused, remove compiler warning
+    CompletionQueueEntry* pEntry = (CompletionQueueEntry*)in_data;
+    clu_completion_queue pQueue = pEntry->m_pQueue;
+    CompletedEvent completed = {pEntry->m_tag, in_eventStatus};
+    delete pEntry;
 
-    try
-    {
-        program = CLU_Runtime::Get().BuildProgram(1, pLength, &in_binary, in_buildOptions, &status);
-    }
-    catch (...) // internal error, e.g. thrown by STL
+    if (!pQueue->m_ring.Push(completed))
     {
-        status = CL_BUILD_PROGRAM_FAILURE;
+        assert(0); // registrations never exceed the capacity
     }
 
-    if (errcode_ret)
+    // pairs with the fence in cluCompletionQueuePoll: either the consumer sees
+    // the pushed value, or this thread sees the consumer is going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pQueue->m_consumerSleeping.load(std::memory_order_relaxed))
     {
-        *errcode_ret = status;
+        std::lock_guard<std::mutex> lock(pQueue->m_mutex);
+        pQueue->m_completed.notify_one();
     }
-    return program;
+    ReleaseCompletionQueue(pQueue);
 }
 
-//-----------------------------------------------------------------------------
-// Build a program for all current devices from source
-//   can override global build options
-//-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildSourceArray(cl_uint num_sources,
-                   const char** sources,
-                   const size_t* source_lengths, /* may be NULL */
-                   const char*  in_buildOptions, /* may be NULL */
-                   cl_int * errcode_ret)         /* may be NULL */
+clu_completion_queue CLU_API_CALL cluCreateCompletionQueue(cl_uint in_capacity, cl_int* out_pStatus)
 {
-    cl_program program = 0;
-    cl_int status = CL_INVALID_VALUE;
+    clu_completion_queue pQueue = 0;
+    cl_int status = CL_SUCCESS;
     try
     {
-        // was this build called by the clu code generator?
-        // if so, we should be smart about handling the program object
-        if (0 == strncmp(CLU_MAGIC_BUILD_FLAG, in_buildOptions, strlen(CLU_MAGIC_BUILD_FLAG)))
-        {
-            // this will retrieve it from a hash or build it if it's not there:
-            program = CLU_Runtime::Get().HashProgram(num_sources, sources, source_lengths, &status);
-        }
-        else
-        {
-            program = CLU_Runtime::Get().BuildProgram(num_sources, sources, source_lengths,
-                in_buildOptions, &status);
-        }
+        pQueue = new _clu_completion_queue(in_capacity ? in_capacity : CLU_COMPLETION_QUEUE_DEFAULT_CAPACITY);
     }
     catch (...) // internal error, e.g. thrown by STL
     {
-        status = CL_BUILD_PROGRAM_FAILURE;
+        status = CL_OUT_OF_HOST_MEMORY;
     }
-
-    if (errcode_ret)
+    if (out_pStatus)
     {
-        *errcode_ret = status;
+        *out_pStatus = status;
     }
-    return program;
+    return pQueue;
 }
 
-//-----------------------------------------------------------------------------
-// Build a program for all current devices from binary
-//   can override global build options
-//-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildBinaryArray(cl_uint num_binaries,
-                   const size_t* binary_lengths,
-                   const unsigned char** binaries,
-                   const char*  in_buildOptions, /* may be NULL */
-                   cl_int * errcode_ret)         /* may be NULL */
+cl_int CLU_API_CALL cluCompletionQueueAdd(clu_completion_queue in_pQueue, cl_event in_event, void* in_tag)
 {
-    cl_program program = 0;
-    cl_int status = CL_INVALID_VALUE;
-    try
-    {
-        program = CLU_Runtime::Get().BuildProgram(num_binaries, binary_lengths, binaries,
-            in_buildOptions, &status);
-    }
-    catch (...) // internal error, e.g. thrown by STL
+    if ((0 == in_pQueue) || (0 == in_event))
     {
-        status = CL_BUILD_PROGRAM_FAILURE;
+        return CL_INVALID_VALUE;
     }
-
-    if (errcode_ret)
+    if (in_pQueue->m_registered.fetch_add(1) >= in_pQueue->m_capacity)
     {
-        *errcode_ret = status;
+        in_pQueue->m_registered--;
+        return CL_OUT_OF_RESOURCES;
     }
-    return program;
-}
-
-//-----------------------------------------------------------------------------
-// convert a source file into a cl_program
-//-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildSourceFromFile(const char* in_pFileName,
-                       const char* in_buildOptions, /* may be NULL */
-                       cl_int * errcode_ret) /* may be NULL */
-{
-    cl_int status = CL_INVALID_VALUE;
-    cl_program program = 0;
+    cl_int status = CL_SUCCESS;
     try
     {
-        if (in_pFileName)
+        CompletionQueueEntry* pEntry = new CompletionQueueEntry;
+        pEntry->m_pQueue = in_pQueue;
+        pEntry->m_tag = in_tag;
+        in_pQueue->m_refCount++; // held by the callback
+        status = clSetEventCallback(in_event, CL_COMPLETE, CLU_CompletionQueueCallback, pEntry);
+        if (CL_SUCCESS != status)
         {
-            std::ifstream ifs(in_pFileName, std::ios::in);
-            if (ifs.is_open())
-            {
-                std::string s((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-                program = cluBuildSource((const char *) s.c_str(), s.size(), in_buildOptions, &status);
-                ifs.close();
-            }
-        } // end if non-null file name string
+            delete pEntry;
+            in_pQueue->m_refCount--; // the application still holds a reference
+            in_pQueue->m_registered--;
+        }
     }
     catch (...) // internal error, e.g. thrown by STL
     {
+        in_pQueue->m_registered--;
         status = CL_OUT_OF_HOST_MEMORY;
     }
+    return status;
+}
 
-    if (errcode_ret)
+cl_int CLU_API_CALL cluCompletionQueuePoll(clu_completion_queue in_pQueue, void** out_tags,
+    cl_int* out_statuses, cl_uint in_maxTags, cl_uint in_timeoutMs, cl_uint* out_pNumTags)
+{
+    if ((0 == in_pQueue) || (0 == out_tags) || (0 == in_maxTags))
     {
-        *errcode_ret = status;
+        return CL_INVALID_VALUE;
     }
-    return program;
-}
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_WAIT, "cluCompletionQueuePoll", &status);
 
-//-----------------------------------------------------------------------------
-// convert a binary file into a cl_program
-//-----------------------------------------------------------------------------
-cl_program CLU_API_CALL
-cluBuildBinaryFromFile(const char* in_pFileName,
-                       const char* in_buildOptions, /* may be NULL */
-                       cl_int * errcode_ret) /* may be NULL */
-{
-    cl_int status = CL_INVALID_VALUE;
-    cl_program program = 0;
-    try
+    cl_uint numTags = 0;
+    CompletedEvent completed;
+    while ((numTags < in_maxTags) && in_pQueue->m_ring.Pop(completed))
     {
-        if (in_pFileName)
+        out_tags[numTags] = completed.m_tag;
+        if (out_statuses) out_statuses[numTags] = completed.m_status;
+        numTags++;
+    }
+
+    if ((0 == numTags) && (0 != in_timeoutMs))
+    {
+        try
         {
-            std::ifstream ifs(in_pFileName, std::ios::in | std::ios::binary);
-            if (ifs.is_open())
+            std::chrono::steady_clock::time_point timeout =
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(in_timeoutMs);
+            std::unique_lock<std::mutex> lock(in_pQueue->m_mutex);
+            in_pQueue->m_consumerSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // producers that push from now on lock the mutex to notify,
+            // so they cannot slip in between a failed Pop and the wait
+            bool popped = false;
+            while (!(popped = in_pQueue->m_ring.Pop(completed)))
             {
-                std::string s((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
-                program = cluBuildBinary(s.size(), (const unsigned char *) s.c_str(), in_buildOptions, &status);
-                ifs.close();
+                if (CLU_WAIT_INFINITE == in_timeoutMs)
+                {
+                    in_pQueue->m_completed.wait(lock);
+                }
+                else if (std::cv_status::timeout == in_pQueue->m_completed.wait_until(lock, timeout))
+                {
+                    popped = in_pQueue->m_ring.Pop(completed);
+                    break;
+                }
             }
-        } // end if non-null file name string
+            in_pQueue->m_consumerSleeping.store(false, std::memory_order_relaxed);
+            if (popped)
+            {
+                out_tags[0] = completed.m_tag;
+                if (out_statuses) out_statuses[0] = completed.m_status;
+                numTags = 1;
+            }
+        }
+        catch (...) // internal error, e.g. thrown by STL
+        {
+            status = CL_OUT_OF_HOST_MEMORY;
+        }
+        // take whatever else has completed meanwhile
+        while ((numTags > 0) && (numTags < in_maxTags) && in_pQueue->m_ring.Pop(completed))
+        {
+            out_tags[numTags] = completed.m_tag;
+            if (out_statuses) out_statuses[numTags] = completed.m_status;
+            numTags++;
+        }
     }
-    catch (...) // internal error, e.g. thrown by STL
+
+    in_pQueue->m_registered -= numTags;
+    if ((CL_SUCCESS == status) && (0 == numTags))
     {
-        status = CL_OUT_OF_HOST_MEMORY;
+        status = CLU_WAIT_TIMEOUT;
     }
-
-    if (errcode_ret)
+    if (out_pNumTags)
     {
-        *errcode_ret = status;
+        *out_pNumTags = numTags;
     }
-    return program;
+    return status;
 }
 
-//-----------------------------------------------------------------------------
-// release a buffer and its aligned host memory
-// (expects created with cluCreateAlignedBuffer)
-//-----------------------------------------------------------------------------
-void CL_CALLBACK CLU_ReleaseAlignedBufferCallback(cl_mem in_buffer, void* in_pHostPtr)
+cl_int CLU_API_CALL cluReleaseCompletionQueue(clu_completion_queue in_pQueue)
 {
-    in_buffer = 0; // unused, fixes compile warning about unused param.
-#if defined _WIN32            
-    _aligned_free(in_pHostPtr);
-#else
-    free(in_pHostPtr);
-#endif
+    if (0 == in_pQueue)
+    {
+        return CL_INVALID_VALUE;
+    }
+    ReleaseCompletionQueue(in_pQueue);
+    return CL_SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
-// allocate host memory aligned for optimal access and create a buffer using it
+// wait until any event in the list completes, with a timeout
+//   a one-shot wait set. its callbacks stay registered until their events
+//   complete, so applications waiting repeatedly should keep a wait set instead
 //-----------------------------------------------------------------------------
-cl_mem CLU_API_CALL cluCreateAlignedBuffer(
-    cl_mem_flags in_flags,
-    size_t in_size,
-    void** out_pPtr,
-    cl_int* out_pStatus)
+cl_int CLU_API_CALL
+cluWaitOnAnyEventEx(const cl_event* event_list, cl_uint num_events,
+                    cl_uint timeout_ms, cl_uint* out_index)
 {
-    cl_mem mem = 0;
-    try
+    if ((0 == event_list) || (0 == num_events))
     {
-        cl_int status = CL_INVALID_VALUE;
-        void* pMem = 0;
-
-        // create aligned host memory
-        if (in_size)
-        {
-            cl_uint alignment = CLU_Runtime::Get().GetBufferAlignment();
-
-            // round size up to the alignment.
-            // some architectures require aligned size for 0-copy to work properly.
-            in_size += (alignment - 1);
-            in_size &= ~(alignment - 1);
-
-#if defined _WIN32
-            pMem = _aligned_malloc(in_size, alignment);
-#elif defined __linux__
-            pMem = memalign(alignment, in_size);
-#elif defined __MACH__
-            pMem = malloc(in_size);
-#else
-            pMem = valloc(in_size);
-#endif
-        }
-
-        // wrap aligned host memory in an OpenCL buffer
-        if (pMem)
-        {
-            mem = clCreateBuffer(CLU_CONTEXT, in_flags | CL_MEM_USE_HOST_PTR, in_size, pMem, out_pStatus);
-        }
-        else
+        return CL_INVALID_EVENT_WAIT_LIST;
+    }
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_WAIT, "cluWaitOnAnyEventEx", &status);
+    clu_wait_set pSet = cluCreateWaitSet(&status);
+    for (cl_uint i = 0; (i < num_events) && (CL_SUCCESS == status); i++)
+    {
+        status = cluWaitSetAdd(pSet, event_list[i], 0);
+    }
+    if (CL_SUCCESS == status)
+    {
+        cl_uint index = 0;
+        status = WaitSetWait(pSet, timeout_ms, 1, &index, 0);
+        if ((CL_SUCCESS == status) && out_index)
         {
-            status = CL_INVALID_VALUE;
+            *out_index = index;
         }
+    }
+    if (pSet)
+    {
+        cluReleaseWaitSet(pSet);
+    }
+    return status;
+}
 
-        // set a callback to automatically free the host memory when the OpenCL buffer is destroyed
-        if (mem)
+//-----------------------------------------------------------------------------
+// internal: poll events until all are complete, or the time is up
+// returns CL_COMPLETE, CL_SUBMITTED (still waiting) or an error
+// in_pFirst: events before this index are known to be complete
+//-----------------------------------------------------------------------------
+cl_int PollEvents(const cl_event* in_events, cl_uint in_numEvents, cl_uint* in_pFirst,
+    cl_ulong in_endNs, bool in_yield)
+{
+    do
+    {
+        for (; *in_pFirst < in_numEvents; (*in_pFirst)++)
         {
-            status = clSetMemObjectDestructorCallback(mem, CLU_ReleaseAlignedBufferCallback, pMem);
-            if (out_pPtr)
+            cl_int executionStatus = CL_QUEUED;
+            cl_int status = clGetEventInfo(in_events[*in_pFirst], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof(executionStatus), &executionStatus, 0);
+            if (CL_SUCCESS != status)
             {
-                *out_pPtr = pMem;
+                return status;
+            }
+            if (executionStatus < 0)
+            {
+                return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+            }
+            if (CL_COMPLETE != executionStatus)
+            {
+                break;
             }
         }
-        else
+        if (*in_pFirst == in_numEvents)
         {
-            status = CL_OUT_OF_HOST_MEMORY;
-#if defined _WIN32            
-            _aligned_free(out_pPtr);
-#else
-            free(out_pPtr);
-#endif
+            return CL_COMPLETE;
         }
-        if (out_pStatus)
+        if (in_yield)
         {
-            *out_pStatus = status;
+            std::this_thread::yield();
         }
-    }
-    catch (...)
-    {
-    }
-    return mem;
+    } while (GetHostTimeNs() < in_endNs);
+    return CL_SUBMITTED;
 }
 
 //-----------------------------------------------------------------------------
-// wait until /any/ event in the list fires
+// wait until all events complete: spin, then yield, then block
 //-----------------------------------------------------------------------------
-void CL_CALLBACK CLU_WaitOnAnyEventCallback(cl_event in_event, cl_int in_eventStatus, void* in_data)
+cl_int WaitForEvents(const cl_event* in_events, cl_uint in_numEvents, const clu_wait_policy* in_pPolicy)
 {
-    in_event = 0; // unused, remove compiler warning
-    assert(CL_SUCCESS == in_eventStatus);
-    clSetUserEventStatus((cl_event)in_data, CL_COMPLETE);
-    clReleaseEvent((cl_event)in_data);
+    WaitTuner& tuner = CLU_Runtime::Get().GetWaitTuner();
+    cl_ulong spinNs = tuner.GetSpinNs();
+    cl_ulong yieldNs = spinNs;
+    if (in_pPolicy)
+    {
+        if (CLU_WAIT_ADAPTIVE != in_pPolicy->spin_ns) spinNs = in_pPolicy->spin_ns;
+        if (CLU_WAIT_ADAPTIVE != in_pPolicy->yield_ns) yieldNs = in_pPolicy->yield_ns;
+    }
+
+    // commands must reach the device before polling can see them complete
+    // (clWaitForEvents flushes implicitly). user events have no queue.
+    cl_command_queue flushed = 0;
+    for (cl_uint i = 0; i < in_numEvents; i++)
+    {
+        cl_command_queue queue = 0;
+        clGetEventInfo(in_events[i], CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, 0);
+        if (queue && (queue != flushed))
+        {
+            clFlush(queue);
+            flushed = queue;
+        }
+    }
+
+    cl_ulong start = GetHostTimeNs();
+    cl_uint first = 0;
+    cl_int status = PollEvents(in_events, in_numEvents, &first, start + spinNs, false);
+    if (CL_SUBMITTED == status)
+    {
+        status = PollEvents(in_events, in_numEvents, &first, GetHostTimeNs() + yieldNs, true);
+    }
+    if (CL_SUBMITTED == status)
+    {
+        status = clWaitForEvents(in_numEvents - first, in_events + first);
+    }
+    else if (CL_COMPLETE == status)
+    {
+        status = CL_SUCCESS;
+    }
+    if (CL_SUCCESS == status)
+    {
+        tuner.Add(GetHostTimeNs() - start);
+    }
+    return status;
 }
 
-// wait on any event implementation:
-//   1. create a user event
-//   2. set a callback on every event in the input list, this callback sets the user event
-//   3. wait on the internal user event
 cl_int CLU_API_CALL
-cluWaitOnAnyEvent(const cl_event* event_list,
-                  cl_uint         num_events)
+cluWait(const cl_event* event_list, cl_uint num_events, const clu_wait_policy* policy)
 {
-    cl_int status = CL_INVALID_EVENT_WAIT_LIST;
-
-    // need an early exit, or 0-length list results in infinite wait
     if ((0 == event_list) || (0 == num_events))
     {
-        goto exit;
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_WAIT, "cluWait", &status);
+    try
+    {
+        status = WaitForEvents(event_list, num_events, policy);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
     }
+    return status;
+}
 
+//-----------------------------------------------------------------------------
+// wait until a queue is empty: wait on a marker behind everything in it
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL
+cluFinish(cl_command_queue queue, const clu_wait_policy* policy)
+{
+    cl_int status = CL_SUCCESS;
+    ApiScope scope(CLU_CALL_WAIT, "cluFinish", &status);
     try
     {
-        cl_event waitEvent = clCreateUserEvent(cluGetContext(), &status);
-        if (CL_SUCCESS == status)
+        if (0 == queue)
         {
-            for (cl_uint i = 0; i < num_events; i++)
-            {
-                status = clRetainEvent(waitEvent); // the callback will use the event, so hold a reference
-                status = clSetEventCallback(event_list[i], CL_COMPLETE, CLU_WaitOnAnyEventCallback, waitEvent);
-                if (CL_SUCCESS != status)
-                {
-                    break; // failed for some reason
-                }
-            }
-        } // end if got user event for internal callback function
-
+            queue = CLU_DEFAULT_Q;
+        }
+        cl_event marker = 0;
+        status = clEnqueueMarkerWithWaitList(queue, 0, 0, &marker);
         if (CL_SUCCESS == status)
         {
-            status = clWaitForEvents(1, &waitEvent);
+            NoteEventCreated();
+            status = WaitForEvents(&marker, 1, policy);
+            RecycleEvent(marker);
         }
-        clReleaseEvent(waitEvent);
     }
-    catch (...)
+    catch (...) // internal error, e.g. thrown by STL
     {
+        status = CL_OUT_OF_HOST_MEMORY;
     }
-exit:
     return status;
 }
 
@@ -1465,6 +6689,60 @@ const clu_image_format* CLU_Runtime::GetImageFormats(cl_uint* out_pArraySize, cl
     return &m_imageFormats[0];
 }
 
+//-----------------------------------------------------------------------------
+// can images of this type and format be created with these flags
+// each type and set of flags is queried once, as the union kept by GetImageFormats
+// would accept flags that are only supported separately, or only for the other type
+//-----------------------------------------------------------------------------
+bool CLU_Runtime::IsImageFormatSupported(const cl_image_format& in_format, cl_mem_object_type in_type, cl_mem_flags in_flags)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ImageQuery query(in_type, in_flags);
+    std::map<ImageQuery, std::vector<cl_image_format> >::iterator iter = m_supportedImageFormats.find(query);
+    if (iter == m_supportedImageFormats.end())
+    {
+        std::vector<cl_image_format> formats;
+        cl_uint numFormats = 0;
+        cl_int status = clGetSupportedImageFormats(m_context, in_flags, in_type, 0, 0, &numFormats);
+        if ((CL_SUCCESS == status) && numFormats)
+        {
+            formats.resize(numFormats);
+            status = clGetSupportedImageFormats(m_context, in_flags, in_type, numFormats, &formats[0], 0);
+        }
+        if (CL_SUCCESS != status)
+        {
+            return false; // not cached, the query may succeed later
+        }
+        iter = m_supportedImageFormats.insert(std::make_pair(query, formats)).first;
+    }
+    const std::vector<cl_image_format>& formats = iter->second;
+    for (size_t i = 0; i < formats.size(); i++)
+    {
+        if ((formats[i].image_channel_order == in_format.image_channel_order) &&
+            (formats[i].image_channel_data_type == in_format.image_channel_data_type))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// max image pitch alignment across all devices in context, in pixels
+// devices that do not report one (before OpenCL 2.0) return 0
+//-----------------------------------------------------------------------------
+cl_uint CLU_Runtime::GetImagePitchAlignment()
+{
+    cl_uint alignment = 1;
+    for (cl_uint i = 0; i < m_numDevices; i++)
+    {
+        cl_uint deviceAlign = 0;
+        clGetDeviceInfo(m_deviceIds[i], CL_DEVICE_IMAGE_PITCH_ALIGNMENT, sizeof(cl_uint), &deviceAlign, 0);
+        alignment = std::max(alignment, deviceAlign);
+    }
+    return alignment;
+}
+
 //-----------------------------------------------------------------------------
 // Return an array of image formats supported in a given CL context
 // the array returned is internal to CLU, applications should not attempt to free/delete it
@@ -1489,6 +6767,211 @@ const clu_image_format* CLU_API_CALL cluGetSupportedImageFormats(cl_uint* array_
     return pFormats;
 }
 
+/********************************************************************************************************/
+/* Profiling                                                                                            */
+/********************************************************************************************************/
+
+//-----------------------------------------------------------------------------
+// Return per-kernel execution statistics
+// the array returned is internal to CLU, applications should not attempt to free/delete it
+//-----------------------------------------------------------------------------
+const clu_kernel_stats* CLU_API_CALL cluGetKernelStats(cl_uint* array_size, cl_int* out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+    const clu_kernel_stats* pStats = 0;
+    cl_uint size = 0;
+    try
+    {
+        pStats = CLU_Runtime::Get().GetKernelProfiler().GetStats(&size);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (array_size)
+    {
+        *array_size = size;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return pStats;
+}
+
+//-----------------------------------------------------------------------------
+// zero the per-kernel execution statistics
+//-----------------------------------------------------------------------------
+void CLU_API_CALL cluResetKernelStats(void)
+{
+    try
+    {
+        CLU_Runtime::Get().GetKernelProfiler().Clear();
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {}
+}
+
+//-----------------------------------------------------------------------------
+// add a command enqueued by the application to the trace
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL cluTraceCommand(cl_event in_event, const char* in_name)
+{
+    if ((0 == in_event) || (0 == in_name))
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        Tracer& tracer = CLU_Runtime::Get().GetTracer();
+        if (tracer.IsEnabled())
+        {
+            ProfiledCommand* pCommand = new ProfiledCommand;
+            pCommand->m_generation = 0;
+            pCommand->m_name = in_name;
+            pCommand->m_hostSubmit = 0; // already enqueued, too late to align clocks with it
+            WatchProfiledCommand(in_event, pCommand);
+
+            // so the queue has an offset even if clu launches nothing on it
+            cl_command_queue queue = 0;
+            clGetEventInfo(in_event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, 0);
+            if (queue && tracer.NeedsClockSample(queue))
+            {
+                SampleQueueClock(queue);
+            }
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+//-----------------------------------------------------------------------------
+// write the trace recorded so far
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL cluWriteTrace(const char* in_fileName)
+{
+    if (0 == in_fileName)
+    {
+        return CL_INVALID_VALUE;
+    }
+    cl_int status = CL_INVALID_OPERATION;
+    try
+    {
+        Tracer& tracer = CLU_Runtime::Get().GetTracer();
+        if (tracer.IsEnabled())
+        {
+            status = tracer.Write(in_fileName);
+        }
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+/********************************************************************************************************/
+/* Memory accounting                                                                                    */
+/********************************************************************************************************/
+
+//-----------------------------------------------------------------------------
+// Return per-tag memory statistics and the totals
+// the array returned is internal to CLU, applications should not attempt to free/delete it
+//-----------------------------------------------------------------------------
+const clu_memory_tag_stats* CLU_API_CALL cluGetMemoryStats(clu_memory_stats* out_pTotals, cl_uint* array_size, cl_int* out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+    const clu_memory_tag_stats* pStats = 0;
+    cl_uint size = 0;
+    try
+    {
+        pStats = CLU_Runtime::Get().GetMemoryTracker().GetStats(out_pTotals, &size);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (array_size)
+    {
+        *array_size = size;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return pStats;
+}
+
+cl_int CLU_API_CALL cluSetMemoryTag(const char* in_pTag)
+{
+    cl_int status = CL_SUCCESS;
+    try
+    {
+        CLU_Runtime::Get().GetMemoryTracker().SetThreadTag(in_pTag);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    return status;
+}
+
+cl_int CLU_API_CALL cluSetMemorySoftLimit(size_t in_limit)
+{
+    CLU_Runtime::Get().GetMemoryTracker().SetSoftLimit(in_limit);
+    return CL_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Return bytes moved by cluMigrate, per pair of devices
+// the array returned is internal to CLU, applications should not attempt to free/delete it
+//-----------------------------------------------------------------------------
+const clu_migration_stats* CLU_API_CALL cluGetMigrationStats(cl_uint* array_size, cl_int* out_pStatus)
+{
+    cl_int status = CL_SUCCESS;
+    const clu_migration_stats* pStats = 0;
+    cl_uint size = 0;
+    try
+    {
+        pStats = CLU_Runtime::Get().GetMigrationTracker().GetStats(&size);
+    }
+    catch (...) // internal error, e.g. thrown by STL
+    {
+        status = CL_OUT_OF_HOST_MEMORY;
+    }
+    if (array_size)
+    {
+        *array_size = size;
+    }
+    if (out_pStatus)
+    {
+        *out_pStatus = status;
+    }
+    return pStats;
+}
+
+/********************************************************************************************************/
+/* Hooks                                                                                                */
+/********************************************************************************************************/
+
+//-----------------------------------------------------------------------------
+// register application hooks, or remove them
+//-----------------------------------------------------------------------------
+cl_int CLU_API_CALL cluSetHooks(const clu_hooks* in_pHooks)
+{
+    SetApiObserver(CLU_OBSERVE_HOOKS, false);
+    if (in_pHooks && (in_pHooks->pre || in_pHooks->post))
+    {
+        g_hooks = *in_pHooks;
+        SetApiObserver(CLU_OBSERVE_HOOKS, true);
+    }
+    return CL_SUCCESS;
+}
+
 /********************************************************************************************************/
 /* String Functions: convert enums/defines to char*                                                     */
 /********************************************************************************************************/
@@ -1556,6 +7039,8 @@ const char* CLU_API_CALL cluPrintError(cl_int errcode_ret)
         CLU_ENUM_TO_STRING_CASE(CL_INVALID_LINKER_OPTIONS);
         CLU_ENUM_TO_STRING_CASE(CL_INVALID_DEVICE_PARTITION_COUNT);
 #endif
+        CLU_ENUM_TO_STRING_CASE(CLU_WAIT_TIMEOUT);
+        CLU_ENUM_TO_STRING_CASE(CLU_MEMORY_LIMIT_EXCEEDED);
     }
     return "Unknown CL error";
 }
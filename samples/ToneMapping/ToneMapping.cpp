@@ -57,7 +57,7 @@ unsigned char ClampFloat(float in_f)
 //-----------------------------------------------------------------------------
 // Write a float RGBA image to a (BGRA) BMP
 //-----------------------------------------------------------------------------
-bool SaveImageAsBMP (cl_mem in_buffer, int width, int height, const char* fileName)
+bool SaveImageAsBMP (const cl_float* ptr, int width, int height, const char* fileName)
 {
     bool success = false;
 
@@ -70,12 +70,6 @@ bool SaveImageAsBMP (cl_mem in_buffer, int width, int height, const char* fileNa
         goto ErrExit;
     }
 
-    cl_uint imageSize = 0;
-    clGetMemObjectInfo(in_buffer, CL_MEM_SIZE, sizeof(imageSize), &imageSize, 0);
-
-    cl_float* ptr = (cl_float*)clEnqueueMapBuffer(CLU_DEFAULT_Q,
-        in_buffer, CL_TRUE, CL_MAP_READ, 0, imageSize, 0, NULL, NULL, NULL);
-
     if (0 == ptr)
     {
         goto ErrExit;
@@ -128,7 +122,7 @@ bool SaveImageAsBMP (cl_mem in_buffer, int width, int height, const char* fileNa
         for (int x=0; x<width; x++)
         {
             int index = (height-1-y)*width+x;
-            float* p = &ptr[index*4];
+            const float* p = &ptr[index*4];
             // Ensure that no value is greater than 255.0
             unsigned char bytes[4] = // RGBA float -> BGRA byte
             {
@@ -150,10 +144,28 @@ bool SaveImageAsBMP (cl_mem in_buffer, int width, int height, const char* fileNa
     success = true;
 ErrExit:
     fclose(stream);
-    clEnqueueUnmapMemObject(CLU_DEFAULT_Q, in_buffer, ptr, 0, 0, 0);
     return success;
 }
 
+//-----------------------------------------------------------------------------
+// Save a buffer as BMP without blocking: cluReadAsync calls back with its contents
+//-----------------------------------------------------------------------------
+struct BMPInfo
+{
+    int         width;
+    int         height;
+    const char* fileName;
+};
+
+void CLU_CALLBACK SaveReadbackAsBMP(const void* host_ptr, size_t size, cl_int status, void* user_data)
+{
+    const BMPInfo* pInfo = (const BMPInfo*)user_data;
+    if (CL_SUCCESS == status)
+    {
+        SaveImageAsBMP((const cl_float*)host_ptr, pInfo->width, pInfo->height, pInfo->fileName);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // HDR image loading utility
 //-----------------------------------------------------------------------------
@@ -193,12 +205,14 @@ cl_mem ReadHDRimage(cl_uint* out_pImageWidth, cl_uint* out_pImageHeight, cl_uint
     iMemSize = iWidth*iHeight*4*sizeof(cl_float);
 
     // Allocate memory.
+    // the pixels are rewritten below, so they are read into an aligned (zero-copy) buffer
+    // rather than mapped from the file with cluCreateBufferFromFile, which suits data that is only read
     cl_int status = CL_SUCCESS;
     cl_mem buffer = cluCreateAlignedBuffer(0, iMemSize, 0, &status);
 
     // map buffer to reach OpenCL synchronization point (for cross-platform compatibility)
-    cl_float* pData = (cl_float*)clEnqueueMapBuffer(CLU_DEFAULT_Q,
-        buffer, CL_TRUE, CL_MAP_READ, 0, iMemSize, 0, NULL, NULL, &status);
+    cl_float* pData = buffer ? (cl_float*)clEnqueueMapBuffer(CLU_DEFAULT_Q,
+        buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, iMemSize, 0, NULL, NULL, &status) : 0;
 
     if(!pData)
     {
@@ -310,9 +324,11 @@ int main(int argc, char* argv[])
     printf("Executing OpenCL kernel...\n");
     ExecuteToneMappingKernel(inputBuffer, outputBuffer, &HDRData, imageWidth, imageHeight);
 
-    //save results in bitmap files
-    SaveImageAsBMP(inputBuffer, imageWidth, imageHeight, "ToneMappingInput.bmp");
-    SaveImageAsBMP(outputBuffer, imageWidth, imageHeight, "ToneMappingOutput.bmp");
+    //save results in bitmap files. the files are written on a CLU thread, cluRelease waits for them
+    BMPInfo inputInfo = {(int)imageWidth, (int)imageHeight, "ToneMappingInput.bmp"};
+    BMPInfo outputInfo = {(int)imageWidth, (int)imageHeight, "ToneMappingOutput.bmp"};
+    cluReadAsync(0, inputBuffer, 0, imageSize, SaveReadbackAsBMP, &inputInfo, 0, 0);
+    cluReadAsync(0, outputBuffer, 0, imageSize, SaveReadbackAsBMP, &outputInfo, 0, 0);
 
     clReleaseMemObject(inputBuffer);
     clReleaseMemObject(outputBuffer);
@@ -9,7 +9,7 @@ Redistribution and use in source and binary forms, with or without modification,
 
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
-#include <clu.h>
+#include <clu.hpp>
 
 const int NUM_VALUES = 16;
 
@@ -37,21 +37,23 @@ int main()
         f[i] = i + 0.3f;
     }
 
-    cl_mem t0 = clCreateBuffer(CLU_CONTEXT, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, NUM_VALUES*sizeof(cl_float), f, &status);
-    cl_mem t1 = clCreateBuffer(CLU_CONTEXT, CL_MEM_READ_WRITE, NUM_VALUES*sizeof(cl_half), 0, &status);
-  
-    // if I had written my kernel in a separate file, I could have used the CLU generator to
-    // generate a function that set the kernel arguments for me... but I didn't.
-    clSetKernelArg(k, 0, sizeof(cl_mem), &t0);
-    clSetKernelArg(k, 1, sizeof(cl_mem), &t1);
-
-    clu_enqueue_params params = CLU_DEFAULT_PARAMS;
-    params.nd_range = CLU_ND1(NUM_VALUES);
-    status = cluEnqueue(k, &params);
-
-    // inspect the results of converting from 32-bit float to 16-bit float:
-    cl_half* pHalf = (cl_half*)clEnqueueMapBuffer(CLU_DEFAULT_Q, t1, CL_TRUE, CL_MAP_READ, 0, NUM_VALUES*sizeof(cl_half), 0, 0, 0, &status);
-    status = clEnqueueUnmapMemObject(CLU_DEFAULT_Q, t1, pHalf, 0, 0, 0);
+    {
+        // typed buffers: sizes are in elements, and both are released at the end of this scope
+        clu::buffer<cl_float> t0(f, NUM_VALUES, CL_MEM_READ_ONLY, &status);
+        clu::buffer<cl_half> t1(NUM_VALUES, CL_MEM_WRITE_ONLY, &status);
+
+        // if I had written my kernel in a separate file, I could have used the CLU generator to
+        // generate a function that set the kernel arguments for me... but I didn't.
+        clSetKernelArg(k, 0, sizeof(cl_mem), &t0.get());
+        clSetKernelArg(k, 1, sizeof(cl_mem), &t1.get());
+
+        clu_enqueue_params params = CLU_DEFAULT_PARAMS;
+        params.nd_range = CLU_ND1(t0.size());
+        status = cluEnqueue(k, &params);
+
+        // inspect the results of converting from 32-bit float to 16-bit float:
+        clu::mapped<cl_half> halves = t1.map(CL_MAP_READ);
+    } // unmaps, then releases t1 and t0
 
     cluRelease();
 
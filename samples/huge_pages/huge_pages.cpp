@@ -0,0 +1,152 @@
+/*
+Copyright (c) 2013, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// bandwidth of a streaming kernel over zero-copy buffers,
+// with the host memory in regular pages and in 2MB huge pages.
+// the difference is largest on cpu devices, where every access goes through the host TLB.
+//
+// usage: huge_pages [megabytes_per_buffer] [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "clu.h"
+
+#define DEFAULT_MEGABYTES  512
+#define DEFAULT_ITERATIONS 10
+
+const char* g_source =
+    "kernel void Triad(global const float* in_a, global const float* in_b, global float* out_c, float in_s) {"
+    "    size_t i = get_global_id(0);"
+    "    out_c[i] = in_a[i] + in_s * in_b[i]; }";
+
+const char* BackingName(cl_uint in_backing)
+{
+    switch (in_backing)
+    {
+    case CLU_HOST_MEMORY_HUGETLB:                return "hugetlb";
+    case CLU_HOST_MEMORY_TRANSPARENT_HUGE_PAGES: return "transparent huge pages";
+    default:                                     return "regular pages";
+    }
+}
+
+// returns GB/s, 0 on failure
+double Run(cl_kernel in_kernel, cl_mem_flags in_flags, size_t in_bytes, int in_iterations)
+{
+    size_t n = in_bytes / sizeof(cl_float);
+    cl_mem buffers[3] = {0};
+    cl_float* pHost[3] = {0};
+    cl_int status = CL_SUCCESS;
+    for (int i = 0; (i < 3) && (CL_SUCCESS == status); i++)
+    {
+        buffers[i] = cluCreateAlignedBuffer(in_flags, in_bytes, (void**)&pHost[i], &status);
+    }
+    if (CL_SUCCESS != status)
+    {
+        printf("cluCreateAlignedBuffer failed: %s\n", cluPrintError(status));
+        return 0;
+    }
+
+    clu_host_memory_info info = {0};
+    cluGetHostMemoryInfo(buffers[0], &info);
+    printf("%-24s", BackingName(info.backing));
+
+    // touch every page on the host first, so page faults are not timed
+    for (size_t i = 0; i < n; i++)
+    {
+        pHost[0][i] = 1.0f;
+        pHost[1][i] = 2.0f;
+        pHost[2][i] = 0.0f;
+    }
+
+    cl_float s = 3.0f;
+    for (int i = 0; i < 3; i++)
+    {
+        clSetKernelArg(in_kernel, i, sizeof(cl_mem), &buffers[i]);
+    }
+    clSetKernelArg(in_kernel, 3, sizeof(cl_float), &s);
+
+    clu_enqueue_params params = CLU_DEFAULT_PARAMS;
+    params.nd_range = CLU_ND1(n);
+    cluEnqueue(in_kernel, &params); // warm up
+    clFinish(CLU_DEFAULT_Q);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < in_iterations; i++)
+    {
+        cluEnqueue(in_kernel, &params);
+    }
+    status = clFinish(CLU_DEFAULT_Q);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // map to make the results visible to the host, as an application would
+    void* p = clEnqueueMapBuffer(CLU_DEFAULT_Q, buffers[2], CL_TRUE, CL_MAP_READ, 0, in_bytes, 0, 0, 0, &status);
+    bool correct = (CL_SUCCESS == status) && (7.0f == ((cl_float*)p)[n - 1]);
+    clEnqueueUnmapMemObject(CLU_DEFAULT_Q, buffers[2], p, 0, 0, 0);
+    clFinish(CLU_DEFAULT_Q);
+
+    for (int i = 0; i < 3; i++)
+    {
+        clReleaseMemObject(buffers[i]);
+    }
+    if (!correct)
+    {
+        printf("wrong result\n");
+        return 0;
+    }
+
+    // 2 reads and 1 write per element
+    double gbps = 3.0 * in_bytes * in_iterations / seconds / 1e9;
+    printf("%8.2f GB/s\n", gbps);
+    return gbps;
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = (argc > 1) ? (size_t)atoi(argv[1]) : DEFAULT_MEGABYTES;
+    int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if ((0 == megabytes) || (iterations <= 0))
+    {
+        printf("usage: huge_pages [megabytes_per_buffer] [iterations]\n");
+        return 1;
+    }
+
+    cl_int status = cluInitialize(0);
+    if (CL_SUCCESS != status)
+    {
+        printf("cluInitialize failed: %s\n", cluPrintError(status));
+        return 1;
+    }
+    clu_device_info device = cluGetDeviceInfo(cluGetDevice(CL_DEVICE_TYPE_DEFAULT), 0);
+    printf("%s, 3 buffers of %u MB, %d iterations\n", device.device_name, (cl_uint)megabytes, iterations);
+
+    cl_program program = cluBuildSource(g_source, 0, 0, &status);
+    if (CL_SUCCESS != status)
+    {
+        printf("build failed: %s\n", cluGetBuildErrors(program));
+        return 1;
+    }
+    cl_kernel kernel = clCreateKernel(program, "Triad", &status);
+
+    size_t bytes = megabytes * 1024 * 1024;
+    double regular = Run(kernel, 0, bytes, iterations);
+    double huge = Run(kernel, CLU_MEM_HUGE_PAGES, bytes, iterations);
+    if ((regular > 0) && (huge > 0))
+    {
+        printf("huge pages: %.2fx\n", huge / regular);
+    }
+
+    clReleaseKernel(kernel);
+    cluRelease();
+
+    return ((regular > 0) && (huge > 0)) ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2013, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// streams a data set through the device in chunks with cluStream,
+// with a single staging buffer (no overlap) and with a ring of buffers,
+// where upload, compute and download of consecutive chunks overlap.
+//
+// usage: stream [megabytes_total] [megabytes_per_chunk]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "clu.h"
+
+#define DEFAULT_MEGABYTES       1024
+#define DEFAULT_CHUNK_MEGABYTES 16
+
+const char* g_source =
+    "kernel void Scale(global const float* in_a, global float* out_b, float in_s) {"
+    "    size_t i = get_global_id(0);"
+    "    out_b[i] = in_s * in_a[i]; }";
+
+struct StreamState
+{
+    size_t  m_totalFloats;
+    size_t  m_produced; // floats
+    size_t  m_consumed; // floats
+    bool    m_correct;
+};
+
+// input value i is i modulo 1024, so any float can be checked
+size_t CLU_CALLBACK Produce(void* in_pHost, size_t in_capacity, cl_uint in_chunk, void* in_pUserData)
+{
+    in_chunk = 0; // unused, remove compiler warning
+    StreamState* pState = (StreamState*)in_pUserData;
+    size_t n = std::min(in_capacity / sizeof(cl_float), pState->m_totalFloats - pState->m_produced);
+    cl_float* p = (cl_float*)in_pHost;
+    for (size_t i = 0; i < n; i++)
+    {
+        p[i] = (cl_float)((pState->m_produced + i) & 1023);
+    }
+    pState->m_produced += n;
+    return n * sizeof(cl_float);
+}
+
+cl_int CLU_CALLBACK Launch(cl_kernel in_kernel, cl_mem in_input, cl_mem in_output, size_t in_inputBytes,
+    cl_uint in_chunk, clu_enqueue_params* in_pParams, size_t* in_pOutputBytes, void* in_pUserData)
+{
+    in_chunk = 0; in_pUserData = 0; // unused, remove compiler warning
+    cl_float s = 2.0f;
+    clSetKernelArg(in_kernel, 0, sizeof(cl_mem), &in_input);
+    clSetKernelArg(in_kernel, 1, sizeof(cl_mem), &in_output);
+    clSetKernelArg(in_kernel, 2, sizeof(cl_float), &s);
+    in_pParams->nd_range = CLU_ND1(in_inputBytes / sizeof(cl_float));
+    *in_pOutputBytes = in_inputBytes;
+    return CL_SUCCESS;
+}
+
+cl_bool CLU_CALLBACK Consume(const void* in_pHost, size_t in_bytes, cl_uint in_chunk, void* in_pUserData)
+{
+    in_chunk = 0; // unused, remove compiler warning
+    StreamState* pState = (StreamState*)in_pUserData;
+    const cl_float* p = (const cl_float*)in_pHost;
+    size_t n = in_bytes / sizeof(cl_float);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (p[i] != 2.0f * (cl_float)((pState->m_consumed + i) & 1023))
+        {
+            pState->m_correct = false;
+            return CL_FALSE;
+        }
+    }
+    pState->m_consumed += n;
+    return CL_TRUE;
+}
+
+// returns GB/s, 0 on failure
+double Run(cl_kernel in_kernel, size_t in_totalBytes, size_t in_chunkBytes, cl_uint in_numBuffers)
+{
+    StreamState state = {in_totalBytes / sizeof(cl_float), 0, 0, true};
+
+    clu_stream_params params;
+    memset(&params, 0, sizeof(params));
+    params.kernel = in_kernel;
+    params.input_chunk_size = in_chunkBytes;
+    params.output_chunk_size = in_chunkBytes;
+    params.num_buffers = in_numBuffers;
+    params.producer = Produce;
+    params.launch = Launch;
+    params.consumer = Consume;
+    params.user_data = &state;
+
+    clu_stream_stats stats;
+    cl_int status = cluStream(&params, &stats);
+    if ((CL_SUCCESS != status) || !state.m_correct || (state.m_consumed != state.m_totalFloats))
+    {
+        printf("%u buffers: failed: %s\n", in_numBuffers, state.m_correct ? cluPrintError(status) : "wrong result");
+        return 0;
+    }
+    double gbps = stats.bytes_per_second / 1e9;
+    printf("%u buffers: %u chunks, %8.2f GB/s, producer waited %.1f ms\n",
+        in_numBuffers, stats.chunks, gbps, stats.stall_ns / 1e6);
+    return gbps;
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = (argc > 1) ? (size_t)atoi(argv[1]) : DEFAULT_MEGABYTES;
+    size_t chunkMegabytes = (argc > 2) ? (size_t)atoi(argv[2]) : DEFAULT_CHUNK_MEGABYTES;
+    if ((0 == megabytes) || (0 == chunkMegabytes))
+    {
+        printf("usage: stream [megabytes_total] [megabytes_per_chunk]\n");
+        return 1;
+    }
+
+    cl_int status = cluInitialize(0);
+    if (CL_SUCCESS != status)
+    {
+        printf("cluInitialize failed: %s\n", cluPrintError(status));
+        return 1;
+    }
+    clu_device_info device = cluGetDeviceInfo(cluGetDevice(CL_DEVICE_TYPE_DEFAULT), 0);
+    printf("%s, %u MB in chunks of %u MB\n", device.device_name, (cl_uint)megabytes, (cl_uint)chunkMegabytes);
+
+    cl_program program = cluBuildSource(g_source, 0, 0, &status);
+    if (CL_SUCCESS != status)
+    {
+        printf("build failed: %s\n", cluGetBuildErrors(program));
+        return 1;
+    }
+    cl_kernel kernel = clCreateKernel(program, "Scale", &status);
+
+    double serial = Run(kernel, megabytes * 1024 * 1024, chunkMegabytes * 1024 * 1024, 1);
+    double overlapped = Run(kernel, megabytes * 1024 * 1024, chunkMegabytes * 1024 * 1024, 3);
+    if ((serial > 0) && (overlapped > 0))
+    {
+        printf("overlap: %.2fx\n", overlapped / serial);
+    }
+
+    clReleaseKernel(kernel);
+    cluRelease();
+    return ((serial > 0) && (overlapped > 0)) ? 0 : 1;
+}
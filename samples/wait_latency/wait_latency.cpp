@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2013, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// benchmark of the latency of waiting for a short kernel:
+// measures from enqueue to the wait returning, with clWaitForEvents, cluWait and clFinish/cluFinish,
+// and prints the median and tail latencies of each.
+//
+// usage: wait_latency [num_launches] [work_items]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "clu.h"
+
+#define DEFAULT_NUM_LAUNCHES 5000
+#define DEFAULT_WORK_ITEMS   1024
+#define NUM_WARMUP_LAUNCHES  100
+
+typedef std::chrono::steady_clock Clock;
+
+const char* g_source =
+    "kernel void Increment(global int* p) {"
+    "    p[get_global_id(0)] += 1; }";
+
+enum WaitMode
+{
+    WAIT_CL_WAIT_FOR_EVENTS,
+    WAIT_CLU_WAIT_ADAPTIVE,
+    WAIT_CLU_WAIT_SPIN,
+    WAIT_CL_FINISH,
+    WAIT_CLU_FINISH,
+    NUM_WAIT_MODES
+};
+
+const char* g_modeNames[NUM_WAIT_MODES] = {
+    "clWaitForEvents",
+    "cluWait (adaptive)",
+    "cluWait (spin 1ms)",
+    "clFinish",
+    "cluFinish (adaptive)"};
+
+// returns the latency of every launch, in microseconds
+bool Run(WaitMode in_mode, cl_kernel in_kernel, size_t in_workItems, cl_uint in_numLaunches,
+    std::vector<double>& out_latencies)
+{
+    clu_wait_policy spin = {1000000, 0};
+    clu_enqueue_params params = CLU_DEFAULT_PARAMS;
+    params.nd_range = CLU_ND1(in_workItems);
+
+    out_latencies.clear();
+    for (cl_uint i = 0; i < NUM_WARMUP_LAUNCHES + in_numLaunches; i++)
+    {
+        cl_event e = 0;
+        bool withEvent = (in_mode != WAIT_CL_FINISH) && (in_mode != WAIT_CLU_FINISH);
+        params.out_event = withEvent ? &e : 0;
+
+        Clock::time_point start = Clock::now();
+        cl_int status = cluEnqueue(in_kernel, &params);
+        if (CL_SUCCESS == status)
+        {
+            switch (in_mode)
+            {
+            case WAIT_CL_WAIT_FOR_EVENTS: status = clWaitForEvents(1, &e); break;
+            case WAIT_CLU_WAIT_ADAPTIVE:  status = cluWait(&e, 1, 0); break;
+            case WAIT_CLU_WAIT_SPIN:      status = cluWait(&e, 1, &spin); break;
+            case WAIT_CL_FINISH:          status = clFinish(CLU_DEFAULT_Q); break;
+            case WAIT_CLU_FINISH:         status = cluFinish(0, 0); break;
+            default: break;
+            }
+        }
+        double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        if (e)
+        {
+            clReleaseEvent(e);
+        }
+        if (CL_SUCCESS != status)
+        {
+            printf("%s failed: %s\n", g_modeNames[in_mode], cluPrintError(status));
+            return false;
+        }
+        if (i >= NUM_WARMUP_LAUNCHES)
+        {
+            out_latencies.push_back(us);
+        }
+    }
+    return true;
+}
+
+double Percentile(const std::vector<double>& in_sorted, double in_percent)
+{
+    size_t i = (size_t)((in_sorted.size() - 1) * in_percent / 100.0);
+    return in_sorted[i];
+}
+
+int main(int argc, char** argv)
+{
+    cl_uint numLaunches = (argc > 1) ? (cl_uint)atoi(argv[1]) : DEFAULT_NUM_LAUNCHES;
+    size_t workItems = (argc > 2) ? (size_t)atoi(argv[2]) : DEFAULT_WORK_ITEMS;
+    if (0 == numLaunches)
+    {
+        numLaunches = DEFAULT_NUM_LAUNCHES;
+    }
+
+    cl_int status = cluInitialize(0);
+    if (CL_SUCCESS != status)
+    {
+        printf("cluInitialize failed: %s\n", cluPrintError(status));
+        return 1;
+    }
+
+    cl_program program = cluBuildSource(g_source, 0, 0, &status);
+    if (CL_SUCCESS != status)
+    {
+        printf("build failed: %s\n", cluGetBuildErrors(program));
+        return 1;
+    }
+    cl_kernel kernel = clCreateKernel(program, "Increment", &status);
+    cl_mem buffer = clCreateBuffer(CLU_CONTEXT, CL_MEM_READ_WRITE, workItems * sizeof(cl_int), 0, &status);
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+
+    printf("%u launches of %u work items, latency from enqueue to wait returning, in us\n",
+        numLaunches, (cl_uint)workItems);
+    printf("%-22s %9s %9s %9s %9s %9s\n", "", "p50", "p90", "p99", "p99.9", "max");
+
+    bool ok = true;
+    std::vector<double> latencies;
+    for (int mode = 0; ok && (mode < NUM_WAIT_MODES); mode++)
+    {
+        ok = Run((WaitMode)mode, kernel, workItems, numLaunches, latencies);
+        if (ok)
+        {
+            std::sort(latencies.begin(), latencies.end());
+            printf("%-22s %9.1f %9.1f %9.1f %9.1f %9.1f\n", g_modeNames[mode],
+                Percentile(latencies, 50), Percentile(latencies, 90), Percentile(latencies, 99),
+                Percentile(latencies, 99.9), latencies.back());
+        }
+    }
+
+    clReleaseMemObject(buffer);
+    clReleaseKernel(kernel);
+    cluRelease();
+
+    return ok ? 0 : 1;
+}
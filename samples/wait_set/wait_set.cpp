@@ -0,0 +1,227 @@
+/*
+Copyright (c) 2013, Intel Corporation
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// stress test and benchmark for wait sets
+// a signaling thread completes user events in random order while the main thread waits for them.
+// compares a wait set against calling cluWaitOnAnyEvent on the events still outstanding.
+//
+// usage: wait_set [num_events] [num_rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "clu.h"
+
+#define DEFAULT_NUM_EVENTS 10000
+#define DEFAULT_NUM_ROUNDS 4
+#define MAX_INDICES_PER_WAIT 256
+#define MAX_WAIT_ON_ANY_EVENTS 2000 // cluWaitOnAnyEvent is quadratic, keep its run short
+
+typedef std::chrono::steady_clock Clock;
+
+double ElapsedMs(Clock::time_point in_start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - in_start).count();
+}
+
+// complete the events in the given order
+void Signal(std::vector<cl_event>* in_pEvents, const std::vector<cl_uint>* in_pOrder)
+{
+    for (size_t i = 0; i < in_pOrder->size(); i++)
+    {
+        clSetUserEventStatus((*in_pEvents)[(*in_pOrder)[i]], CL_COMPLETE);
+        if (0 == (i & 63))
+        {
+            std::this_thread::yield(); // let the waiter run mid-stream
+        }
+    }
+}
+
+void CreateEvents(cl_uint in_numEvents, std::mt19937& in_random,
+    std::vector<cl_event>& out_events, std::vector<cl_uint>& out_order)
+{
+    out_events.resize(in_numEvents);
+    out_order.resize(in_numEvents);
+    for (cl_uint i = 0; i < in_numEvents; i++)
+    {
+        out_events[i] = clCreateUserEvent(cluGetContext(), 0);
+        out_order[i] = i;
+    }
+    std::shuffle(out_order.begin(), out_order.end(), in_random);
+}
+
+void ReleaseEvents(std::vector<cl_event>& in_events)
+{
+    for (size_t i = 0; i < in_events.size(); i++)
+    {
+        clReleaseEvent(in_events[i]);
+    }
+}
+
+// every event must be reported exactly once
+bool RunWaitSet(cl_uint in_numEvents, std::mt19937& in_random, double& out_ms)
+{
+    std::vector<cl_event> events;
+    std::vector<cl_uint> order;
+    CreateEvents(in_numEvents, in_random, events, order);
+
+    Clock::time_point start = Clock::now();
+    clu_wait_set waitSet = cluCreateWaitSet(0);
+    for (cl_uint i = 0; i < in_numEvents; i++)
+    {
+        cl_uint index = 0;
+        cluWaitSetAdd(waitSet, events[i], &index);
+        if (index != i)
+        {
+            printf("wait set: event %u was given index %u\n", i, index);
+            return false;
+        }
+    }
+
+    std::thread signaler(Signal, &events, &order);
+
+    bool ok = true;
+    std::vector<char> seen(in_numEvents, 0);
+    cl_uint numSeen = 0;
+    cl_uint indices[MAX_INDICES_PER_WAIT];
+    while (ok && (numSeen < in_numEvents))
+    {
+        cl_uint numIndices = 0;
+        cl_int status = cluWaitSetWait(waitSet, 10000, MAX_INDICES_PER_WAIT, indices, &numIndices);
+        if (CL_SUCCESS != status)
+        {
+            printf("wait set: wait returned %s with %u events outstanding\n", cluPrintError(status), in_numEvents - numSeen);
+            ok = false;
+        }
+        for (cl_uint i = 0; ok && (i < numIndices); i++)
+        {
+            if ((indices[i] >= in_numEvents) || seen[indices[i]])
+            {
+                printf("wait set: index %u reported twice or out of range\n", indices[i]);
+                ok = false;
+            }
+            else
+            {
+                seen[indices[i]] = 1;
+                numSeen++;
+            }
+        }
+    }
+    signaler.join();
+    out_ms = ElapsedMs(start);
+
+    if (ok && (0 != cluWaitSetPending(waitSet)))
+    {
+        printf("wait set: %u events still pending\n", cluWaitSetPending(waitSet));
+        ok = false;
+    }
+    cluReleaseWaitSet(waitSet);
+    ReleaseEvents(events);
+    return ok;
+}
+
+// the pre-wait-set way: wait on whatever is still outstanding, then scan for what completed
+bool RunWaitOnAnyEvent(cl_uint in_numEvents, std::mt19937& in_random, double& out_ms)
+{
+    std::vector<cl_event> events;
+    std::vector<cl_uint> order;
+    CreateEvents(in_numEvents, in_random, events, order);
+
+    Clock::time_point start = Clock::now();
+    std::thread signaler(Signal, &events, &order);
+
+    bool ok = true;
+    std::vector<cl_event> outstanding(events);
+    while (ok && !outstanding.empty())
+    {
+        cl_int status = cluWaitOnAnyEvent(&outstanding[0], (cl_uint)outstanding.size());
+        if (CL_SUCCESS != status)
+        {
+            printf("wait on any: returned %s\n", cluPrintError(status));
+            ok = false;
+        }
+        size_t numOutstanding = 0;
+        for (size_t i = 0; i < outstanding.size(); i++)
+        {
+            cl_int executionStatus = CL_QUEUED;
+            clGetEventInfo(outstanding[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(executionStatus), &executionStatus, 0);
+            if (CL_COMPLETE != executionStatus)
+            {
+                outstanding[numOutstanding++] = outstanding[i];
+            }
+        }
+        outstanding.resize(numOutstanding);
+    }
+    signaler.join();
+    out_ms = ElapsedMs(start);
+
+    ReleaseEvents(events);
+    return ok;
+}
+
+// a wait must give up when nothing completes in time, and succeed once something does
+bool RunTimeout()
+{
+    cl_event e = clCreateUserEvent(cluGetContext(), 0);
+    cl_uint index = 1;
+
+    Clock::time_point start = Clock::now();
+    cl_int status = cluWaitOnAnyEventEx(&e, 1, 50, &index);
+    double ms = ElapsedMs(start);
+    bool ok = (CLU_WAIT_TIMEOUT == status) && (ms >= 49.0);
+    printf("timeout:    returned %s after %.1f ms\n", cluPrintError(status), ms);
+
+    clSetUserEventStatus(e, CL_COMPLETE);
+    status = cluWaitOnAnyEventEx(&e, 1, CLU_WAIT_INFINITE, &index);
+    ok = ok && (CL_SUCCESS == status) && (0 == index);
+    printf("timeout:    complete event returned %s, index %u\n", cluPrintError(status), index);
+
+    clReleaseEvent(e);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    cl_uint numEvents = (argc > 1) ? (cl_uint)atoi(argv[1]) : DEFAULT_NUM_EVENTS;
+    cl_uint numRounds = (argc > 2) ? (cl_uint)atoi(argv[2]) : DEFAULT_NUM_ROUNDS;
+    cl_uint numWaitOnAnyEvents = std::min(numEvents, (cl_uint)MAX_WAIT_ON_ANY_EVENTS);
+
+    cl_int status = cluInitialize(0);
+    if (CL_SUCCESS != status)
+    {
+        printf("cluInitialize failed: %s\n", cluPrintError(status));
+        return 1;
+    }
+
+    std::mt19937 random(1234);
+    bool ok = RunTimeout();
+    for (cl_uint round = 0; ok && (round < numRounds); round++)
+    {
+        double ms = 0;
+        ok = RunWaitSet(numEvents, random, ms);
+        printf("round %u: wait set,                %6u events: %9.2f ms, %7.2f us/event\n",
+            round, numEvents, ms, 1000.0 * ms / numEvents);
+
+        ok = ok && RunWaitOnAnyEvent(numWaitOnAnyEvents, random, ms);
+        printf("round %u: repeated cluWaitOnAnyEvent, %6u events: %9.2f ms, %7.2f us/event\n",
+            round, numWaitOnAnyEvents, ms, 1000.0 * ms / numWaitOnAnyEvents);
+    }
+
+    cluRelease();
+
+    printf("%s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}